@@ -1,2 +1,4 @@
 #use this to force -O0 to avoid SIGBUS in Android.
 APP_OPTIM := debug
+#armeabi-v7a adds the NEON raster ops, armeabi stays for older devices.
+APP_ABI := armeabi armeabi-v7a
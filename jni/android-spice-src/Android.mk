@@ -18,7 +18,17 @@ libspicec_link_objs 	:= $(CROSS_DIR)/lib/libintl.a \
 
 LOCAL_MODULE    := spicec
 
-LOCAL_SRC_FILES := jpeg_encoder.c spicy.c spice-cmdline.c android-worker.c android-spice.c coroutine_gthread.c spice-util.c spice-session.c spice-channel.c spice-marshal.c spice-glib-enums.c generated_demarshallers.c generated_demarshallers1.c generated_marshallers.c generated_marshallers1.c gio-coroutine.c channel-base.c channel-main.c channel-display.c channel-display-mjpeg.c channel-inputs.c decode-glz.c decode-jpeg.c decode-zlib.c mem.c marshaller.c canvas_utils.c sw_canvas.c pixman_utils.c lines.c rop3.c quic.c lz.c region.c ssl_verify.c
+LOCAL_SRC_FILES := jpeg_encoder.c spicy.c spice-cmdline.c android-worker.c android-spice.c coroutine_gthread.c spice-util.c spice-session.c spice-channel.c spice-marshal.c spice-glib-enums.c generated_demarshallers.c generated_demarshallers1.c generated_marshallers.c generated_marshallers1.c gio-coroutine.c channel-base.c channel-main.c channel-display.c channel-display-mjpeg.c channel-inputs.c decode-glz.c decode-jpeg.c decode-zlib.c decode-pool.c canvas-bands.c mem.c marshaller.c canvas_utils.c sw_canvas.c pixman_utils.c pixman_utils_simd.c lines.c rop3.c rop3_simd.c quic.c lz.c region.c ssl_verify.c
+
+# On armeabi-v7a the raster op, blend and rop3 kernels get their NEON
+# versions, which are only used once rop_simd_supported() found NEON on
+# the cpu. Only the files holding the kernels are built with -mfpu=neon,
+# the compiler would otherwise be free to vectorize the scalar code run
+# on cpus without NEON.
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_SRC_FILES := $(patsubst pixman_utils_simd.c,pixman_utils_simd.c.neon,$(LOCAL_SRC_FILES))
+LOCAL_SRC_FILES := $(patsubst rop3_simd.c,rop3_simd.c.neon,$(LOCAL_SRC_FILES))
+endif
 
 LOCAL_LDLIBS 	+= $(libspicec_link_objs) \
 		   -L$(CROSS_DIR)/lib \
@@ -37,6 +37,7 @@ struct spice_display {
     bool                    keyboard_grab_enable;
     bool                    mouse_grab_enable;
     bool                    resize_guest_enable;
+    bool                    cull_draws;
 
     /* state */
     enum SpiceSurfaceFmt    format;
@@ -108,6 +108,7 @@ static void spice_display_init(SpiceDisplay *display)
     d = display->priv = SPICE_DISPLAY_GET_PRIVATE(display);
     memset(d, 0, sizeof(*d));
     d->have_mitshm = true;
+    d->cull_draws = true;
 }
 
 
@@ -286,6 +287,20 @@ gboolean button_event(AndroidEventButton *button)
     return true;
 }
 
+/* the java side shows the guest display scaled by permille/1000 */
+gboolean view_scale_event(gint permille)
+{
+    spice_display *d = SPICE_DISPLAY_GET_PRIVATE(android_display);
+
+    SPICE_DEBUG("view scale: %d/1000", permille);
+
+    if (!d->display || permille <= 0)
+	return true;
+
+    spice_display_set_view_scale(SPICE_DISPLAY_CHANNEL(d->display), permille / 1000.0);
+    return true;
+}
+
 void show_event(spice_display* d,gint x,gint y,gint w, gint h)
 {
     //drop some tiny but annoying updating caused by QXL to 
@@ -403,6 +418,7 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data)
 	if (id != d->channel_id)
 	    return;
 	d->display = channel;
+	spice_display_set_cull_draws(SPICE_DISPLAY_CHANNEL(channel), d->cull_draws);
 	g_signal_connect(channel, "display-primary-create",
 		G_CALLBACK(primary_create), display);
 	g_signal_connect(channel, "display-primary-destroy",
@@ -464,6 +480,23 @@ static void channel_destroy(SpiceSession *s, SpiceChannel *channel, gpointer dat
     return;
 }
 
+/**
+ * spice_display_set_culling:
+ * @display: a #SpiceDisplay
+ * @cull: whether to cull hidden draw operations
+ *
+ * Lets the display channel skip draw operations that later ones cover
+ * completely, when it falls behind the server. On by default.
+ **/
+void spice_display_set_culling(SpiceDisplay *display, gboolean cull)
+{
+    spice_display *d = SPICE_DISPLAY_GET_PRIVATE(display);
+
+    d->cull_draws = cull;
+    if (d->display)
+	spice_display_set_cull_draws(SPICE_DISPLAY_CHANNEL(d->display), cull);
+}
+
 /**
  * spice_display_new:
  * @session: a #SpiceSession
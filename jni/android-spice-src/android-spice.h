@@ -74,6 +74,7 @@ typedef enum
     ANDROID_BUTTON_PRESS = 3,
     ANDROID_BUTTON_RELEASE = 4,
     ANDROID_SHOW = 5,
+    ANDROID_VIEW_SCALE = 6, /* followed by the scale in 1/1000 */
 } AndroidEventType;
 struct _AndroidEventKey
 {
@@ -135,6 +136,7 @@ GType	        spice_display_get_type(void);
 SpiceDisplay* spice_display_new(SpiceSession *session, int id);
 void spice_display_send_keys(SpiceDisplay *display, const guint *keyvals,
 	int nkeyvals, SpiceDisplayKeyEvent kind);
+void spice_display_set_culling(SpiceDisplay *display, gboolean cull);
 
 G_END_DECLS
 
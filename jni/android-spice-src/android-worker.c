@@ -36,6 +36,7 @@ extern volatile int android_task;
 volatile AndroidShow android_show_display;
 gboolean key_event(AndroidEventKey* key);
 gboolean button_event(AndroidEventButton *button);
+gboolean view_scale_event(gint permille);
 
 void getval(void* dest,void* src,int type)
 {
@@ -117,6 +118,17 @@ int msg_recv_handle(int sockfd,char* buf)
 		else
 		    error("msg_recv error!\n");
 		break;
+	    case ANDROID_VIEW_SCALE:
+		n = read(sockfd,buf,4);
+		if(n==4)
+		{
+		    gint permille;
+		    getval(&permille,buf,INT);
+		    view_scale_event(permille);
+		}
+		else
+		    error("msg_recv error!\n");
+		break;
 	}
     }
     else
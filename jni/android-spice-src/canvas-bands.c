@@ -0,0 +1,313 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2011  Keqisoft,Co,Ltd,Shanghai,China
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Splits large canvas operations into row bands drawn by a few threads,
+ * the calling thread included. There is a single job at a time, canvas
+ * drawing being serialized by the coroutines anyway. */
+
+#include <unistd.h>
+
+#include "spice-util.h"
+#include "canvas-bands.h"
+
+/* The caller draws bands too, so this makes at most 5 threads busy */
+#define CANVAS_BANDS_MAX_THREADS 4
+/* Smaller bands cost more in wakeups than they gain. Provisional like
+ * CANVAS_BANDS_MIN_PIXELS */
+#define CANVAS_BANDS_MIN_ROWS 16
+
+typedef struct CanvasBandsJob {
+    canvas_band_fn_t fn;
+    void *opaque;
+    int next_y;
+    int end_y;
+    int band_rows;
+    int running;
+    int joined;
+    int max_workers;
+} CanvasBandsJob;
+
+static struct {
+    GMutex *run_lock;
+    GMutex *lock;
+    GCond *work;
+    GCond *done;
+    CanvasBandsJob *job;
+    int quit;
+    int users;
+    int max_threads;
+    GThread *threads[CANVAS_BANDS_MAX_THREADS];
+    int nthreads;
+} bands;
+
+/* Draws bands of job until there are none left, with bands.lock held */
+static void bands_work(CanvasBandsJob *job)
+{
+    int y1, y2;
+
+    while (job->next_y < job->end_y) {
+        y1 = job->next_y;
+        y2 = MIN(y1 + job->band_rows, job->end_y);
+        job->next_y = y2;
+        job->running++;
+
+        g_mutex_unlock(bands.lock);
+        job->fn(job->opaque, y1, y2);
+        g_mutex_lock(bands.lock);
+
+        job->running--;
+    }
+    if (job->running == 0) {
+        g_cond_signal(bands.done);
+    }
+}
+
+static gboolean bands_has_work(void)
+{
+    CanvasBandsJob *job = bands.job;
+
+    return job != NULL && job->next_y < job->end_y &&
+           job->joined < job->max_workers;
+}
+
+static gpointer bands_thread_run(gpointer data G_GNUC_UNUSED)
+{
+    g_mutex_lock(bands.lock);
+    for (;;) {
+        while (!bands.quit && !bands_has_work()) {
+            g_cond_wait(bands.work, bands.lock);
+        }
+        if (bands.quit) {
+            break;
+        }
+        bands.job->joined++;
+        bands_work(bands.job);
+    }
+    g_mutex_unlock(bands.lock);
+
+    return NULL;
+}
+
+static void bands_run(canvas_band_fn_t fn, void *opaque, int y1, int y2, int max_workers)
+{
+    CanvasBandsJob job;
+    int nbands;
+
+    if (max_workers == 0 || y2 - y1 < 2 * CANVAS_BANDS_MIN_ROWS) {
+        fn(opaque, y1, y2);
+        return;
+    }
+
+    /* a few bands per thread so that one slow band doesn't keep
+       everyone else waiting */
+    nbands = (max_workers + 1) * 2;
+    job.fn = fn;
+    job.opaque = opaque;
+    job.next_y = y1;
+    job.end_y = y2;
+    job.band_rows = MAX((y2 - y1 + nbands - 1) / nbands, CANVAS_BANDS_MIN_ROWS);
+    job.running = 0;
+    job.joined = 0;
+    job.max_workers = max_workers;
+
+    g_mutex_lock(bands.run_lock);
+    g_mutex_lock(bands.lock);
+    bands.job = &job;
+    g_cond_broadcast(bands.work);
+    bands_work(&job);
+    while (job.running) {
+        g_cond_wait(bands.done, bands.lock);
+    }
+    bands.job = NULL;
+    g_mutex_unlock(bands.lock);
+    g_mutex_unlock(bands.run_lock);
+}
+
+#ifdef CANVAS_BANDS_SELF_TEST
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BANDS_TEST_WIDTH 1920
+#define BANDS_TEST_HEIGHT 1080
+#define BANDS_TEST_RUNS 200
+
+typedef struct {
+    uint32_t *bits;
+} BandsTest;
+
+static void bands_test_fill(void *opaque, int y1, int y2)
+{
+    BandsTest *test = opaque;
+    uint32_t *now = test->bits + y1 * BANDS_TEST_WIDTH;
+    uint32_t *end = test->bits + y2 * BANDS_TEST_WIDTH;
+
+    for (; now < end; now++) {
+        *now += 1;
+    }
+}
+
+static double bands_test_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Checks every row is drawn exactly once, and prints the full screen
+ * ops/s for each number of threads */
+static void bands_self_test(void)
+{
+    BandsTest test;
+    int workers, i, run;
+    double t;
+
+    test.bits = g_new(uint32_t, BANDS_TEST_WIDTH * BANDS_TEST_HEIGHT);
+    for (workers = 0; workers <= bands.nthreads; workers++) {
+        memset(test.bits, 0, BANDS_TEST_WIDTH * BANDS_TEST_HEIGHT * 4);
+        t = bands_test_now();
+        for (run = 0; run < BANDS_TEST_RUNS; run++) {
+            bands_run(bands_test_fill, &test, 0, BANDS_TEST_HEIGHT, workers);
+        }
+        t = bands_test_now() - t;
+        for (i = 0; i < BANDS_TEST_WIDTH * BANDS_TEST_HEIGHT; i++) {
+            if (test.bits[i] != BANDS_TEST_RUNS) {
+                printf("%s: %d threads: pixel %d drawn %u times\n",
+                       __FUNCTION__, workers + 1, i, test.bits[i]);
+                abort();
+            }
+        }
+        printf("%s: %d threads: %.1f ops/s\n", __FUNCTION__, workers + 1,
+               BANDS_TEST_RUNS / t);
+    }
+    g_free(test.bits);
+}
+#endif
+
+/* With bands.run_lock held, so that no job is in flight */
+static void bands_start(void)
+{
+    int i;
+
+    bands.quit = FALSE;
+    for (i = 0; i < bands.max_threads; i++) {
+        bands.threads[i] = g_thread_create(bands_thread_run, NULL, TRUE, NULL);
+        if (bands.threads[i] == NULL) {
+            g_warning("failed to create canvas band thread");
+            break;
+        }
+        bands.nthreads++;
+    }
+
+    SPICE_DEBUG("canvas bands: %d threads", bands.nthreads);
+}
+
+/* With bands.run_lock held */
+static void bands_stop(void)
+{
+    int i;
+
+    g_mutex_lock(bands.lock);
+    bands.quit = TRUE;
+    g_cond_broadcast(bands.work);
+    g_mutex_unlock(bands.lock);
+
+    for (i = 0; i < bands.nthreads; i++) {
+        g_thread_join(bands.threads[i]);
+        bands.threads[i] = NULL;
+    }
+    bands.nthreads = 0;
+}
+
+/* Not thread safe, call it once before any canvas is created */
+void canvas_bands_init(void)
+{
+    static int need_init = 1;
+    long ncpu;
+
+    if (!need_init) {
+        return;
+    }
+    need_init = 0;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    bands.max_threads = MAX(MIN(ncpu - 1, CANVAS_BANDS_MAX_THREADS), 0);
+    if (bands.max_threads == 0) {
+        return;
+    }
+
+    if (!g_thread_supported())
+        g_thread_init(NULL);
+
+    bands.run_lock = g_mutex_new();
+    bands.lock = g_mutex_new();
+    bands.work = g_cond_new();
+    bands.done = g_cond_new();
+}
+
+/* Each canvas holds a reference, the threads run while there is at
+ * least one of them and are joined when the last one is destroyed */
+void canvas_bands_ref(void)
+{
+    int started;
+
+    if (bands.max_threads == 0) {
+        return;
+    }
+
+    g_mutex_lock(bands.run_lock);
+    started = bands.users++ == 0;
+    if (started) {
+        bands_start();
+    }
+    g_mutex_unlock(bands.run_lock);
+
+#ifdef CANVAS_BANDS_SELF_TEST
+    if (started) {
+        bands_self_test();
+    }
+#endif
+}
+
+void canvas_bands_unref(void)
+{
+    if (bands.max_threads == 0) {
+        return;
+    }
+
+    g_mutex_lock(bands.run_lock);
+    if (bands.users == 0) {
+        g_warning("canvas bands unref without a ref");
+    } else if (--bands.users == 0) {
+        bands_stop();
+    }
+    g_mutex_unlock(bands.run_lock);
+}
+
+gboolean canvas_bands_worth_it(int pixels)
+{
+    return bands.nthreads > 0 && pixels >= CANVAS_BANDS_MIN_PIXELS;
+}
+
+/* Calls fn over rows [y1, y2), split in bands drawn in parallel, and
+ * returns once all of them are done */
+void canvas_bands_run(canvas_band_fn_t fn, void *opaque, int y1, int y2)
+{
+    bands_run(fn, opaque, y1, y2, bands.nthreads);
+}
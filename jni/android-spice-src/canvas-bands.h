@@ -0,0 +1,42 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2011  Keqisoft,Co,Ltd,Shanghai,China
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef CANVAS_BANDS_H_
+# define CANVAS_BANDS_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Below this many pixels an operation isn't worth handing to other
+ * threads and runs inline. Provisional, it hasn't been measured on a
+ * device yet: tune it with the numbers CANVAS_BANDS_SELF_TEST prints */
+#define CANVAS_BANDS_MIN_PIXELS (256 * 256)
+
+/* Draws rows [y1, y2) of an operation. Called from several threads at
+ * once for different rows, so it must only write to its own rows. */
+typedef void (*canvas_band_fn_t)(void *opaque, int y1, int y2);
+
+void canvas_bands_init(void);
+void canvas_bands_ref(void);
+void canvas_bands_unref(void);
+gboolean canvas_bands_worth_it(int pixels);
+void canvas_bands_run(canvas_band_fn_t fn, void *opaque, int y1, int y2);
+
+G_END_DECLS
+
+#endif // CANVAS_BANDS_H_
@@ -32,6 +32,7 @@
 #include "lines.h"
 #include "rop3.h"
 #include "mem.h"
+#include "ring.h"
 
 #include "mutex.h"
 
@@ -149,6 +150,106 @@ typedef struct QuicData {
     uint32_t current_chunk;
 } QuicData;
 
+/* Rendered text masks, so that a string drawn again, eg a label or a
+ * terminal line, is found instead of going through canvas_put_glyph_bits.
+ * Glyphs are looked up first, by a hash of their data compared in place,
+ * and keep a copy of their data under an id that is never reused. Masks
+ * are then keyed by bpp and each glyph's id and position in the string
+ * bounds. Both levels are hash tables evicted in LRU order, once glyphs
+ * take more than GLYPH_CACHE_BYTES and masks STR_MASK_CACHE_BYTES. */
+#define STR_MASK_CACHE_BYTES (1024 * 1024)
+#define STR_MASK_CACHE_BUCKETS 256
+#define GLYPH_CACHE_BYTES (256 * 1024)
+#define GLYPH_CACHE_BUCKETS 256
+#define STR_MASK_STATS_INTERVAL 1024
+
+typedef struct GlyphEntry {
+    RingItem lru_link;
+    struct GlyphEntry *next;
+    uint32_t hash;
+    uint32_t id;
+    int bpp;
+    uint16_t width;
+    uint16_t height;
+    int data_size;
+    uint8_t data[0];
+} GlyphEntry;
+
+typedef struct StrMaskEntry {
+    RingItem lru_link;
+    struct StrMaskEntry *next;
+    uint32_t hash;
+    uint32_t key_size;
+    uint32_t *key;
+    size_t bytes;
+    pixman_image_t *mask;
+} StrMaskEntry;
+
+typedef struct StrMaskCache {
+    StrMaskEntry *buckets[STR_MASK_CACHE_BUCKETS];
+    Ring lru;
+    size_t bytes;
+    GlyphEntry *glyph_buckets[GLYPH_CACHE_BUCKETS];
+    Ring glyph_lru;
+    size_t glyph_bytes;
+    uint32_t next_glyph_id;
+    uint32_t *key_buf;
+    uint32_t key_buf_size;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t glyph_hits;
+    uint32_t glyph_misses;
+} StrMaskCache;
+
+#if defined(SW_CANVAS_CACHE) || defined(SW_CANVAS_IMAGE_CACHE)
+/* Pattern brushes the server keeps sending from the image cache, eg
+ * dithered backgrounds, converted to the canvas format once. An entry
+ * only matches while the image cache returns the same source image for
+ * its id, so a lossless replacement or a reused id doesn't see a stale
+ * tile. */
+#define BRUSH_CACHE_SIZE 8
+
+typedef struct BrushCacheEntry {
+    uint64_t id;
+    pixman_image_t *source;
+    pixman_image_t *tile;
+} BrushCacheEntry;
+
+typedef struct BrushCache {
+    BrushCacheEntry entries[BRUSH_CACHE_SIZE]; /* most recently used first */
+    int n_entries;
+} BrushCache;
+#endif
+
+/* Regions of the masks that come from the image cache, eg icon
+ * transparency masks, so that drawing with the same mask again doesn't
+ * turn its bits into a region again. Inverted masks are kept as inverted
+ * regions, so inverting costs nothing once cached. Entries match on the
+ * id and the image the cache holds for it, and are dropped in LRU order
+ * once they take more than MASK_CACHE_BYTES. A mask whose region alone
+ * would take more than MASK_CACHE_BYTES / 8 is only remembered as too
+ * big, and keeps being converted a part at a time. */
+#define MASK_CACHE_BYTES (1024 * 1024)
+#define MASK_CACHE_MAX_ENTRIES 64
+/* Larger masks are seldom used whole, see canvas_mask_pixman */
+#define MASK_CACHE_MAX_PIXELS (512 * 512)
+
+typedef struct MaskCacheEntry {
+    RingItem lru_link;
+    uint64_t id;
+    pixman_image_t *source;
+    int invert;
+    int too_big;
+    size_t bytes;
+    pixman_region32_t region;
+} MaskCacheEntry;
+
+typedef struct MaskCache {
+    Ring lru;
+    int n_entries;
+    size_t bytes;
+} MaskCache;
+
 typedef struct CanvasBase {
     SpiceCanvas parent;
     uint32_t color_shift;
@@ -177,6 +278,12 @@ typedef struct CanvasBase {
     SpiceJpegDecoder* jpeg;
     SpiceZlibDecoder* zlib;
 
+    StrMaskCache str_masks;
+    MaskCache masks;
+#if defined(SW_CANVAS_CACHE) || defined(SW_CANVAS_IMAGE_CACHE)
+    BrushCache brushes;
+#endif
+
     void *usr_data;
     spice_destroy_fn_t usr_data_destroy;
 } CanvasBase;
@@ -427,8 +534,14 @@ static pixman_image_t *canvas_get_quic(CanvasBase *canvas, SpiceImage *image,
         break;
     case QUIC_IMAGE_TYPE_RGB32:
     case QUIC_IMAGE_TYPE_RGB24:
-        as_type = QUIC_IMAGE_TYPE_RGB32;
-        pixman_format = PIXMAN_x8r8g8b8;
+        /* converted while decoding rather than by canvas_get_image_internal */
+        if (!want_original && canvas->format == SPICE_SURFACE_FMT_16_555) {
+            as_type = QUIC_IMAGE_TYPE_RGB16;
+            pixman_format = PIXMAN_x1r5g5b5;
+        } else {
+            as_type = QUIC_IMAGE_TYPE_RGB32;
+            pixman_format = PIXMAN_x8r8g8b8;
+        }
         break;
     case QUIC_IMAGE_TYPE_RGB16:
         if (!want_original &&
@@ -792,8 +905,17 @@ static pixman_image_t *canvas_get_lz(CanvasBase *canvas, SpiceImage *image, int
     case LZ_IMAGE_TYPE_PLT4_LE:
     case LZ_IMAGE_TYPE_PLT4_BE:
     case LZ_IMAGE_TYPE_PLT8:
-        as_type = LZ_IMAGE_TYPE_RGB32;
-        pixman_format = PIXMAN_x8r8g8b8;
+        /* converted while decoding rather than by canvas_get_image_internal.
+           lz_decode writes rows back to back, so only rows of an even
+           number of pixels give the 4 byte aligned stride pixman needs */
+        if (!want_original && canvas->format == SPICE_SURFACE_FMT_16_555 &&
+            (n_comp_pixels / height) % 2 == 0) {
+            as_type = LZ_IMAGE_TYPE_RGB16;
+            pixman_format = PIXMAN_x1r5g5b5;
+        } else {
+            as_type = LZ_IMAGE_TYPE_RGB32;
+            pixman_format = PIXMAN_x8r8g8b8;
+        }
         break;
     case LZ_IMAGE_TYPE_RGB16:
         if (!want_original &&
@@ -824,7 +946,7 @@ static pixman_image_t *canvas_get_lz(CanvasBase *canvas, SpiceImage *image, int
 
     src = (uint8_t *)pixman_image_get_data(lz_data->decode_data.out_surface);
 
-    stride = (n_comp_pixels / height) * 4;
+    stride = (n_comp_pixels / height) * (PIXMAN_FORMAT_BPP(pixman_format) / 8);
     if (!top_down) {
         stride = -stride;
         decomp_buf = src + stride * (height - 1);
@@ -888,21 +1010,23 @@ static pixman_image_t *canvas_get_glz(CanvasBase *canvas, SpiceImage *image,
 static pixman_image_t *canvas_get_zlib_glz_rgb(CanvasBase *canvas, SpiceImage *image,
                                                int want_original)
 {
-    uint8_t *glz_data;
-    pixman_image_t *surface;
-
     if (canvas->zlib == NULL) {
         CANVAS_ERROR("zlib not supported");
     }
+    if (canvas->glz_data.decoder == NULL) {
+        CANVAS_ERROR("glz not supported");
+    }
 
     ASSERT(image->u.zlib_glz.data->num_chunks == 1); /* TODO: Handle chunks */
-    glz_data = (uint8_t*)spice_malloc(image->u.zlib_glz.glz_data_size);
-    canvas->zlib->ops->decode(canvas->zlib, image->u.zlib_glz.data->chunk[0].data,
-                              image->u.zlib_glz.data->chunk[0].len,
-                              glz_data, image->u.zlib_glz.glz_data_size);
-    surface = canvas_get_glz_rgb_common(canvas, glz_data, want_original);
-    free(glz_data);
-    return surface;
+    /* the glz data is inflated piecewise as the glz decoder consumes it,
+       it is never all in memory at once */
+    canvas->glz_data.decoder->ops->decode_zlib(canvas->glz_data.decoder, canvas->zlib,
+                                               image->u.zlib_glz.data->chunk[0].data,
+                                               image->u.zlib_glz.data->chunk[0].len,
+                                               NULL, &canvas->glz_data.decode_data);
+
+    /* global_decode calls alloc_lz_image, which sets canvas->glz_data.surface */
+    return (canvas->glz_data.decode_data.out_surface);
 }
 
 //#define DEBUG_DUMP_BITMAP
@@ -1067,12 +1191,44 @@ static SpiceCanvas *canvas_get_surface_mask_internal(CanvasBase *canvas, SpiceIm
  * you have to be able to handle any image format. This is useful to avoid
  * e.g. losing alpha when blending a argb32 image on a rgb16 surface.
  */
+/* Takes over the reference to surface */
+static pixman_image_t *canvas_convert_to_target(CanvasBase *canvas, pixman_image_t *surface)
+{
+    pixman_image_t *converted;
+    pixman_format_code_t wanted_format, surface_format;
+
+    surface_format = spice_pixman_image_get_format(surface);
+    wanted_format = canvas_get_target_format(canvas,
+                                             surface_format == PIXMAN_a8r8g8b8);
+
+    if (surface_format != wanted_format) {
+        converted = surface_create(
+#ifdef WIN32
+                                   canvas->dc,
+#endif
+                                   wanted_format,
+                                   pixman_image_get_width(surface),
+                                   pixman_image_get_height(surface),
+                                   TRUE);
+        pixman_image_composite32 (PIXMAN_OP_SRC,
+                                  surface, NULL, converted,
+                                  0, 0,
+                                  0, 0,
+                                  0, 0,
+                                  pixman_image_get_width(surface),
+                                  pixman_image_get_height(surface));
+        pixman_image_unref (surface);
+        surface = converted;
+    }
+    return surface;
+}
+
 static pixman_image_t *canvas_get_image_internal(CanvasBase *canvas, SpiceImage *image,
                                                  int want_original, int real_get)
 {
     SpiceImageDescriptor *descriptor = &image->descriptor;
-    pixman_image_t *surface, *converted;
-    pixman_format_code_t wanted_format, surface_format;
+    pixman_image_t *surface;
+    pixman_format_code_t surface_format;
     int saved_want_original;
 #ifdef DEBUG_LZ
     LOG_DEBUG("canvas_get_image image type: " << (int)descriptor->type);
@@ -1100,54 +1256,64 @@ static pixman_image_t *canvas_get_image_internal(CanvasBase *canvas, SpiceImage
         want_original = TRUE;
     }
 
-    SPICE_DEBUG("-----------Got SPICE_IMAGE_TYPE:%d",descriptor->type);
-    switch (descriptor->type) {
-    case SPICE_IMAGE_TYPE_QUIC: {
-        surface = canvas_get_quic(canvas, image, 0, want_original);
-        break;
+    surface = NULL;
+#ifdef SW_CANVAS_CACHE
+    /* The cache owner may already have decoded this image ahead of time */
+    if (canvas->bits_cache->ops->get_decoded != NULL) {
+        surface = canvas->bits_cache->ops->get_decoded(canvas->bits_cache, image);
     }
+#endif
+
+    if (surface == NULL) {
+        SPICE_DEBUG("-----------Got SPICE_IMAGE_TYPE:%d",descriptor->type);
+        switch (descriptor->type) {
+        case SPICE_IMAGE_TYPE_QUIC: {
+            surface = canvas_get_quic(canvas, image, 0, want_original);
+            break;
+        }
 #if defined(SW_CANVAS_CACHE)
-    case SPICE_IMAGE_TYPE_LZ_PLT: {
-        surface = canvas_get_lz(canvas, image, 0, want_original);
-        break;
-    }
-    case SPICE_IMAGE_TYPE_LZ_RGB: {
-        surface = canvas_get_lz(canvas, image, 0, want_original);
-        break;
-    }
+        case SPICE_IMAGE_TYPE_LZ_PLT: {
+            surface = canvas_get_lz(canvas, image, 0, want_original);
+            break;
+        }
+        case SPICE_IMAGE_TYPE_LZ_RGB: {
+            surface = canvas_get_lz(canvas, image, 0, want_original);
+            break;
+        }
 #endif
-    case SPICE_IMAGE_TYPE_JPEG: {
-        surface = canvas_get_jpeg(canvas, image, 0);
-        break;
-    }
-    case SPICE_IMAGE_TYPE_JPEG_ALPHA: {
-        surface = canvas_get_jpeg_alpha(canvas, image, 0);
-        break;
-    }
+        case SPICE_IMAGE_TYPE_JPEG: {
+            surface = canvas_get_jpeg(canvas, image, 0);
+            break;
+        }
+        case SPICE_IMAGE_TYPE_JPEG_ALPHA: {
+            surface = canvas_get_jpeg_alpha(canvas, image, 0);
+            break;
+        }
 #if defined(SW_CANVAS_CACHE)
-    case SPICE_IMAGE_TYPE_GLZ_RGB: {
-        surface = canvas_get_glz(canvas, image, want_original);
-        break;
-    }
-    case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB: {
-        surface = canvas_get_zlib_glz_rgb(canvas, image, want_original);
-        break;
-    }
+        case SPICE_IMAGE_TYPE_GLZ_RGB: {
+            surface = canvas_get_glz(canvas, image, want_original);
+            break;
+        }
+        case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB: {
+            surface = canvas_get_zlib_glz_rgb(canvas, image, want_original);
+            break;
+        }
 #endif
-    case SPICE_IMAGE_TYPE_FROM_CACHE:
-        surface = canvas->bits_cache->ops->get(canvas->bits_cache, descriptor->id);
-        break;
+        case SPICE_IMAGE_TYPE_FROM_CACHE:
+            surface = canvas->bits_cache->ops->get(canvas->bits_cache, descriptor->id);
+            break;
 #ifdef SW_CANVAS_CACHE
-    case SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS:
-        surface = canvas->bits_cache->ops->get_lossless(canvas->bits_cache, descriptor->id);
-        break;
+        case SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS:
+            surface = canvas->bits_cache->ops->get_lossless(canvas->bits_cache, descriptor->id);
+            break;
 #endif
-    case SPICE_IMAGE_TYPE_BITMAP: {
-        surface = canvas_get_bits(canvas, &image->u.bitmap, want_original);
-        break;
-    }
-    default:
-        CANVAS_ERROR("invalid image type");
+        case SPICE_IMAGE_TYPE_BITMAP: {
+            surface = canvas_get_bits(canvas, &image->u.bitmap, want_original);
+            break;
+        }
+        default:
+            CANVAS_ERROR("invalid image type");
+        }
     }
 
     surface_format = spice_pixman_image_get_format(surface);
@@ -1213,29 +1379,7 @@ static pixman_image_t *canvas_get_image_internal(CanvasBase *canvas, SpiceImage
            happen above (due to save/load to cache for instance, or
            maybe the reader didn't support conversion).
            If so we convert here. */
-
-        wanted_format = canvas_get_target_format(canvas,
-                                                 surface_format == PIXMAN_a8r8g8b8);
-
-        if (surface_format != wanted_format) {
-            converted = surface_create(
-#ifdef WIN32
-                                       canvas->dc,
-#endif
-                                       wanted_format,
-                                       pixman_image_get_width(surface),
-                                       pixman_image_get_height(surface),
-                                       TRUE);
-            pixman_image_composite32 (PIXMAN_OP_SRC,
-                                      surface, NULL, converted,
-                                      0, 0,
-                                      0, 0,
-                                      0, 0,
-                                      pixman_image_get_width(surface),
-                                      pixman_image_get_height(surface));
-            pixman_image_unref (surface);
-            surface = converted;
-        }
+        surface = canvas_convert_to_target(canvas, surface);
     }
 
     return surface;
@@ -1289,6 +1433,73 @@ static void canvas_touch_image(CanvasBase *canvas, SpiceImage *image)
     canvas_get_image_internal(canvas, image, TRUE, FALSE);
 }
 
+#if defined(SW_CANVAS_CACHE) || defined(SW_CANVAS_IMAGE_CACHE)
+static void brush_cache_destroy(BrushCache *cache)
+{
+    int i;
+
+    for (i = 0; i < cache->n_entries; i++) {
+        pixman_image_unref(cache->entries[i].source);
+        pixman_image_unref(cache->entries[i].tile);
+    }
+    cache->n_entries = 0;
+}
+#endif
+
+/* Same as canvas_get_image, with the conversion of cached patterns done
+ * once */
+static pixman_image_t *canvas_get_brush_image(CanvasBase *canvas, SpiceImage *image)
+{
+#if defined(SW_CANVAS_CACHE) || defined(SW_CANVAS_IMAGE_CACHE)
+    SpiceImageDescriptor *descriptor = &image->descriptor;
+    BrushCache *cache = &canvas->brushes;
+    BrushCacheEntry entry;
+    pixman_image_t *source;
+    int i;
+
+    if (descriptor->type == SPICE_IMAGE_TYPE_FROM_CACHE) {
+        source = canvas->bits_cache->ops->get(canvas->bits_cache, descriptor->id);
+#ifdef SW_CANVAS_CACHE
+    } else if (descriptor->type == SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS) {
+        source = canvas->bits_cache->ops->get_lossless(canvas->bits_cache, descriptor->id);
+#endif
+    } else {
+        source = NULL;
+    }
+    if (source == NULL) {
+        return canvas_get_image(canvas, image, FALSE);
+    }
+
+    for (i = 0; i < cache->n_entries; i++) {
+        if (cache->entries[i].id == descriptor->id && cache->entries[i].source == source) {
+            break;
+        }
+    }
+
+    if (i < cache->n_entries) {
+        entry = cache->entries[i];
+        pixman_image_unref(source);
+    } else {
+        entry.id = descriptor->id;
+        entry.source = source;
+        entry.tile = canvas_convert_to_target(canvas, pixman_image_ref(source));
+        if (cache->n_entries == BRUSH_CACHE_SIZE) {
+            i = BRUSH_CACHE_SIZE - 1;
+            pixman_image_unref(cache->entries[i].source);
+            pixman_image_unref(cache->entries[i].tile);
+        } else {
+            i = cache->n_entries++;
+        }
+    }
+    memmove(&cache->entries[1], &cache->entries[0], i * sizeof(BrushCacheEntry));
+    cache->entries[0] = entry;
+
+    return pixman_image_ref(entry.tile);
+#else
+    return canvas_get_image(canvas, image, FALSE);
+#endif
+}
+
 static pixman_image_t* canvas_get_image_from_self(SpiceCanvas *canvas,
                                                   int x, int y,
                                                   int32_t width, int32_t height)
@@ -1439,39 +1650,8 @@ static pixman_image_t *canvas_get_bitmap_mask(CanvasBase *canvas, SpiceBitmap* b
     return surface;
 }
 
-static inline pixman_image_t *canvas_A1_invers(pixman_image_t *src_surf)
-{
-    int width = pixman_image_get_width(src_surf);
-    int height = pixman_image_get_height(src_surf);
-    pixman_image_t * invers;
-    uint8_t *src_line, *end_line,  *dest_line;
-    int src_stride, line_size, dest_stride;
-
-    ASSERT(pixman_image_get_depth(src_surf) == 1);
-
-    invers = pixman_image_create_bits(PIXMAN_a1, width, height, NULL, 0);
-    if (invers == NULL) {
-        CANVAS_ERROR("create surface failed");
-    }
-
-    src_line = (uint8_t *)pixman_image_get_data(src_surf);
-    src_stride = pixman_image_get_stride(src_surf);
-    end_line = src_line + (height * src_stride);
-    line_size = SPICE_ALIGN(width, 8) >> 3;
-    dest_line = (uint8_t *)pixman_image_get_data(invers);
-    dest_stride = pixman_image_get_stride(invers);
-
-    for (; src_line != end_line; src_line += src_stride, dest_line += dest_stride) {
-        uint8_t *dest = dest_line;
-        uint8_t *now = src_line;
-        uint8_t *end = now + line_size;
-        while (now < end) {
-            *(dest++) = ~*(now++);
-        }
-    }
-    return invers;
-}
-
+/* Inverted masks from the image cache aren't inverted here but where
+ * they're used, see needs_invert_out */
 static pixman_image_t *canvas_get_mask(CanvasBase *canvas, SpiceQMask *mask, int *needs_invert_out)
 {
     SpiceImage *image;
@@ -1480,9 +1660,8 @@ static pixman_image_t *canvas_get_mask(CanvasBase *canvas, SpiceQMask *mask, int
     int is_invers;
     int cache_me;
 
-    if (needs_invert_out) {
-        *needs_invert_out = 0;
-    }
+    ASSERT(needs_invert_out != NULL);
+    *needs_invert_out = 0;
 
     image = mask->bitmap;
     need_invers = mask->flags & SPICE_MASK_FLAGS_INVERS;
@@ -1521,14 +1700,7 @@ static pixman_image_t *canvas_get_mask(CanvasBase *canvas, SpiceQMask *mask, int
     }
 
     if (need_invers && !is_invers) { // surface is in cache
-        if (needs_invert_out != NULL) {
-            *needs_invert_out = TRUE;
-        } else {
-            pixman_image_t *inv_surf;
-            inv_surf = canvas_A1_invers(surface);
-            pixman_image_unref(surface);
-            surface = inv_surf;
-        }
+        *needs_invert_out = TRUE;
     }
 #endif
     return surface;
@@ -1677,13 +1849,267 @@ static void canvas_put_glyph_bits(SpiceRasterGlyph *glyph, int bpp, uint8_t *des
     }
 }
 
+static inline int canvas_raster_glyph_data_size(const SpiceRasterGlyph *glyph, int bpp)
+{
+    switch (bpp) {
+    case 1:
+        return (SPICE_ALIGN(glyph->width, 8) >> 3) * glyph->height;
+    case 4:
+        return (SPICE_ALIGN(glyph->width * 4, 8) >> 3) * glyph->height;
+    case 8:
+        return glyph->width * glyph->height;
+    default:
+        CANVAS_ERROR("invalid bpp");
+    }
+    return 0;
+}
+
+static void str_mask_cache_init(StrMaskCache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+    ring_init(&cache->lru);
+    ring_init(&cache->glyph_lru);
+}
+
+static void str_mask_cache_dump_stats(StrMaskCache *cache)
+{
+    SPICE_DEBUG("str mask cache: %u hits %u misses, %u KB, "
+                "glyphs %u hits %u misses, %u KB",
+                cache->hits, cache->misses, (unsigned)(cache->bytes >> 10),
+                cache->glyph_hits, cache->glyph_misses,
+                (unsigned)(cache->glyph_bytes >> 10));
+}
+
+static void str_mask_cache_remove(StrMaskCache *cache, StrMaskEntry *entry)
+{
+    StrMaskEntry **now = &cache->buckets[entry->hash % STR_MASK_CACHE_BUCKETS];
+
+    while (*now != entry) {
+        now = &(*now)->next;
+    }
+    *now = entry->next;
+    ring_remove(&entry->lru_link);
+    cache->bytes -= entry->bytes;
+    pixman_image_unref(entry->mask);
+    free(entry->key);
+    free(entry);
+}
+
+/* Masks keyed by an evicted glyph's id are left to age out, the id is
+ * never given to another glyph */
+static void str_mask_cache_remove_glyph(StrMaskCache *cache, GlyphEntry *entry)
+{
+    GlyphEntry **now = &cache->glyph_buckets[entry->hash % GLYPH_CACHE_BUCKETS];
+
+    while (*now != entry) {
+        now = &(*now)->next;
+    }
+    *now = entry->next;
+    ring_remove(&entry->lru_link);
+    cache->glyph_bytes -= sizeof(GlyphEntry) + entry->data_size;
+    free(entry);
+}
+
+static void str_mask_cache_destroy(StrMaskCache *cache)
+{
+    RingItem *item;
+
+    if (cache->hits + cache->misses) {
+        str_mask_cache_dump_stats(cache);
+    }
+    while ((item = ring_get_tail(&cache->lru))) {
+        str_mask_cache_remove(cache, SPICE_CONTAINEROF(item, StrMaskEntry, lru_link));
+    }
+    while ((item = ring_get_tail(&cache->glyph_lru))) {
+        str_mask_cache_remove_glyph(cache, SPICE_CONTAINEROF(item, GlyphEntry, lru_link));
+    }
+    free(cache->key_buf);
+    cache->key_buf = NULL;
+}
+
+static uint32_t str_mask_cache_hash(const uint32_t *key, uint32_t size)
+{
+    uint32_t hash = 2166136261u;
+
+    while (size--) {
+        hash = (hash ^ *key++) * 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+static uint32_t str_mask_cache_hash_glyph(const SpiceRasterGlyph *glyph, int bpp, int data_size)
+{
+    const uint8_t *data = glyph->data;
+    uint32_t hash = 2166136261u;
+    uint32_t word;
+
+    hash = (hash ^ bpp) * 16777619u;
+    hash = (hash ^ ((glyph->width << 16) | glyph->height)) * 16777619u;
+    for (; data_size >= 4; data_size -= 4, data += 4) {
+        memcpy(&word, data, 4);
+        hash = (hash ^ word) * 16777619u;
+    }
+    while (data_size--) {
+        hash = (hash ^ *data++) * 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+/* Returns the id of the glyph's entry, adding one if needed, or 0 if the
+ * glyph is too big to be cached */
+static uint32_t str_mask_cache_glyph_id(StrMaskCache *cache, const SpiceRasterGlyph *glyph,
+                                        int bpp)
+{
+    int data_size = canvas_raster_glyph_data_size(glyph, bpp);
+    uint32_t hash = str_mask_cache_hash_glyph(glyph, bpp, data_size);
+    GlyphEntry **bucket = &cache->glyph_buckets[hash % GLYPH_CACHE_BUCKETS];
+    GlyphEntry *entry;
+    RingItem *tail;
+    RingItem *item;
+    size_t bytes;
+
+    for (entry = *bucket; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->bpp == bpp &&
+            entry->width == glyph->width && entry->height == glyph->height &&
+            memcmp(entry->data, glyph->data, data_size) == 0) {
+            ring_remove(&entry->lru_link);
+            ring_add(&cache->glyph_lru, &entry->lru_link);
+            cache->glyph_hits++;
+            return entry->id;
+        }
+    }
+    cache->glyph_misses++;
+
+    bytes = sizeof(GlyphEntry) + data_size;
+    if (bytes > GLYPH_CACHE_BYTES / 8) {
+        return 0;
+    }
+    while (cache->glyph_bytes + bytes > GLYPH_CACHE_BYTES &&
+           (tail = ring_get_tail(&cache->glyph_lru))) {
+        str_mask_cache_remove_glyph(cache, SPICE_CONTAINEROF(tail, GlyphEntry, lru_link));
+    }
+
+    if (++cache->next_glyph_id == 0) {
+        /* the ids wrapped: the glyphs holding old ones, and the masks
+           keyed by them, have to go before any id is given again */
+        while ((item = ring_get_tail(&cache->lru))) {
+            str_mask_cache_remove(cache, SPICE_CONTAINEROF(item, StrMaskEntry, lru_link));
+        }
+        while ((item = ring_get_tail(&cache->glyph_lru))) {
+            str_mask_cache_remove_glyph(cache, SPICE_CONTAINEROF(item, GlyphEntry, lru_link));
+        }
+        cache->next_glyph_id = 1;
+    }
+
+    entry = (GlyphEntry *)spice_malloc(bytes);
+    ring_item_init(&entry->lru_link);
+    entry->hash = hash;
+    entry->id = cache->next_glyph_id;
+    entry->bpp = bpp;
+    entry->width = glyph->width;
+    entry->height = glyph->height;
+    entry->data_size = data_size;
+    memcpy(entry->data, glyph->data, data_size);
+    entry->next = *bucket;
+    *bucket = entry;
+    ring_add(&cache->glyph_lru, &entry->lru_link);
+    cache->glyph_bytes += bytes;
+    return entry->id;
+}
+
+/* Builds the key of the mask of str into cache->key_buf and returns its
+ * size in words, or 0 if the string can't be cached */
+static uint32_t str_mask_cache_make_key(StrMaskCache *cache, SpiceString *str, int bpp,
+                                        const SpiceRect *bounds)
+{
+    uint32_t size = 2 + 2 * str->length;
+    uint32_t first_id = cache->next_glyph_id;
+    uint32_t *key;
+    int i;
+
+    if (size > cache->key_buf_size) {
+        free(cache->key_buf);
+        cache->key_buf = spice_new(uint32_t, size);
+        cache->key_buf_size = size;
+    }
+
+    key = cache->key_buf;
+    *key++ = bpp;
+    *key++ = str->length;
+    for (i = 0; i < str->length; i++) {
+        SpiceRasterGlyph *glyph = str->glyphs[i];
+        SpiceRect glyph_box;
+
+        canvas_raster_glyph_box(glyph, &glyph_box);
+        *key++ = ((glyph_box.left - bounds->left) << 16) | (glyph_box.top - bounds->top);
+        if ((*key++ = str_mask_cache_glyph_id(cache, glyph, bpp)) == 0) {
+            return 0;
+        }
+    }
+    if (cache->next_glyph_id < first_id) {
+        /* the ids wrapped part way: the key mixes old and new ones */
+        return 0;
+    }
+    return size;
+}
+
+static pixman_image_t *str_mask_cache_lookup(StrMaskCache *cache, uint32_t hash, uint32_t key_size)
+{
+    StrMaskEntry *entry = cache->buckets[hash % STR_MASK_CACHE_BUCKETS];
+
+    for (; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->key_size == key_size &&
+            memcmp(entry->key, cache->key_buf, key_size * 4) == 0) {
+            ring_remove(&entry->lru_link);
+            ring_add(&cache->lru, &entry->lru_link);
+            return entry->mask;
+        }
+    }
+    return NULL;
+}
+
+static void str_mask_cache_add(StrMaskCache *cache, uint32_t hash, uint32_t key_size,
+                               pixman_image_t *mask)
+{
+    StrMaskEntry *entry;
+    RingItem *tail;
+    size_t bytes;
+
+    bytes = sizeof(StrMaskEntry) + key_size * 4 +
+            pixman_image_get_stride(mask) * pixman_image_get_height(mask);
+    /* a single huge string would only flush everything else */
+    if (bytes > STR_MASK_CACHE_BYTES / 8) {
+        return;
+    }
+
+    while (cache->bytes + bytes > STR_MASK_CACHE_BYTES &&
+           (tail = ring_get_tail(&cache->lru))) {
+        str_mask_cache_remove(cache, SPICE_CONTAINEROF(tail, StrMaskEntry, lru_link));
+    }
+
+    entry = spice_new(StrMaskEntry, 1);
+    ring_item_init(&entry->lru_link);
+    entry->hash = hash;
+    entry->key_size = key_size;
+    entry->key = spice_memdup(cache->key_buf, key_size * 4);
+    entry->bytes = bytes;
+    entry->mask = pixman_image_ref(mask);
+    entry->next = cache->buckets[hash % STR_MASK_CACHE_BUCKETS];
+    cache->buckets[hash % STR_MASK_CACHE_BUCKETS] = entry;
+    ring_add(&cache->lru, &entry->lru_link);
+    cache->bytes += bytes;
+}
+
+/* The returned mask may be shared with the cache and must not be written to */
 static pixman_image_t *canvas_get_str_mask(CanvasBase *canvas, SpiceString *str, int bpp, SpicePoint *pos)
 {
+    StrMaskCache *cache = &canvas->str_masks;
     SpiceRasterGlyph *glyph;
     SpiceRect bounds;
     pixman_image_t *str_mask;
     uint8_t *dest;
     int dest_stride;
+    uint32_t key_size, hash = 0;
     int i;
 
     ASSERT(str->length > 0);
@@ -1698,6 +2124,23 @@ static pixman_image_t *canvas_get_str_mask(CanvasBase *canvas, SpiceString *str,
         rect_union(&bounds, &glyph_box);
     }
 
+    pos->x = bounds.left;
+    pos->y = bounds.top;
+
+    if (((cache->hits + cache->misses + 1) % STR_MASK_STATS_INTERVAL) == 0) {
+        str_mask_cache_dump_stats(cache);
+    }
+
+    key_size = str_mask_cache_make_key(cache, str, bpp, &bounds);
+    if (key_size) {
+        hash = str_mask_cache_hash(cache->key_buf, key_size);
+        if ((str_mask = str_mask_cache_lookup(cache, hash, key_size))) {
+            cache->hits++;
+            return pixman_image_ref(str_mask);
+        }
+    }
+    cache->misses++;
+
     str_mask = pixman_image_create_bits((bpp == 1) ? PIXMAN_a1 : PIXMAN_a8,
                                         bounds.right - bounds.left,
                                         bounds.bottom - bounds.top, NULL, 0);
@@ -1716,8 +2159,9 @@ static pixman_image_t *canvas_get_str_mask(CanvasBase *canvas, SpiceString *str,
 #endif
     }
 
-    pos->x = bounds.left;
-    pos->y = bounds.top;
+    if (key_size) {
+        str_mask_cache_add(cache, hash, key_size, str_mask);
+    }
     return str_mask;
 }
 
@@ -1856,6 +2300,11 @@ static void canvas_base_destroy(CanvasBase *canvas)
 {
     quic_destroy(canvas->quic_data.quic);
     lz_destroy(canvas->lz_data.lz);
+    str_mask_cache_destroy(&canvas->str_masks);
+    mask_cache_destroy(&canvas->masks);
+#if defined(SW_CANVAS_CACHE) || defined(SW_CANVAS_IMAGE_CACHE)
+    brush_cache_destroy(&canvas->brushes);
+#endif
 #ifdef GDI_CANVAS
     DeleteDC(canvas->dc);
 #endif
@@ -1888,6 +2337,39 @@ void *spice_canvas_get_usr_data(SpiceCanvas *spice_canvas)
     CanvasBase *canvas = (CanvasBase *)spice_canvas;
     return  canvas->usr_data;
 }
+
+/* Decode a compressed image without going through the image and palette
+ * caches. Only image types that don't depend on cache state are handled,
+ * NULL is returned for anything else. Since QUIC, LZ and JPEG decoding only
+ * touch canvas private state, this may be called from another thread than
+ * the one drawing, as long as the canvas itself is not shared. GLZ images
+ * go through the canvas glz decoder window, and must be decoded in stream
+ * order. */
+pixman_image_t *spice_canvas_decode_image(SpiceCanvas *spice_canvas,
+                                          SpiceImage *image,
+                                          int want_original)
+{
+    CanvasBase *canvas = (CanvasBase *)spice_canvas;
+
+    switch (image->descriptor.type) {
+    case SPICE_IMAGE_TYPE_QUIC:
+        return canvas_get_quic(canvas, image, 0, want_original);
+#if defined(SW_CANVAS_CACHE)
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+        return canvas_get_lz(canvas, image, 0, want_original);
+    case SPICE_IMAGE_TYPE_GLZ_RGB:
+        return canvas_get_glz(canvas, image, want_original);
+    case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB:
+        return canvas_get_zlib_glz_rgb(canvas, image, want_original);
+#endif
+    case SPICE_IMAGE_TYPE_JPEG:
+        return canvas_get_jpeg(canvas, image, 0);
+    case SPICE_IMAGE_TYPE_JPEG_ALPHA:
+        return canvas_get_jpeg_alpha(canvas, image, 0);
+    default:
+        return NULL;
+    }
+}
 #endif
 
 
@@ -1918,6 +2400,111 @@ static void canvas_clip_pixman(CanvasBase *canvas,
     }
 }
 
+static void mask_cache_init(MaskCache *cache)
+{
+    ring_init(&cache->lru);
+    cache->n_entries = 0;
+    cache->bytes = 0;
+}
+
+static void mask_cache_remove(MaskCache *cache, MaskCacheEntry *entry)
+{
+    ring_remove(&entry->lru_link);
+    cache->n_entries--;
+    cache->bytes -= entry->bytes;
+    pixman_region32_fini(&entry->region);
+    pixman_image_unref(entry->source);
+    free(entry);
+}
+
+static void mask_cache_destroy(MaskCache *cache)
+{
+    RingItem *item;
+
+    while ((item = ring_get_tail(&cache->lru))) {
+        mask_cache_remove(cache, SPICE_CONTAINEROF(item, MaskCacheEntry, lru_link));
+    }
+}
+
+/* Returns the region of the whole of image, an A1 mask cached under id,
+ * or NULL if it is too big to be cached */
+static pixman_region32_t *mask_cache_get(MaskCache *cache, uint64_t id,
+                                         pixman_image_t *image, int invert)
+{
+    MaskCacheEntry *entry;
+    RingItem *item;
+    int n_rects;
+
+    for (item = ring_get_head(&cache->lru); item; item = ring_next(&cache->lru, item)) {
+        entry = SPICE_CONTAINEROF(item, MaskCacheEntry, lru_link);
+        if (entry->id == id && entry->source == image && entry->invert == invert) {
+            ring_remove(&entry->lru_link);
+            ring_add(&cache->lru, &entry->lru_link);
+            return entry->too_big ? NULL : &entry->region;
+        }
+    }
+
+    entry = spice_new(MaskCacheEntry, 1);
+    ring_item_init(&entry->lru_link);
+    entry->id = id;
+    entry->source = pixman_image_ref(image);
+    entry->invert = invert;
+    entry->too_big = FALSE;
+    pixman_region32_init_from_image(&entry->region, image);
+    if (invert) {
+        pixman_box32_t rect;
+
+        rect.x1 = rect.y1 = 0;
+        rect.x2 = pixman_image_get_width(image);
+        rect.y2 = pixman_image_get_height(image);
+        pixman_region32_inverse(&entry->region, &entry->region, &rect);
+    }
+    pixman_region32_rectangles(&entry->region, &n_rects);
+    entry->bytes = sizeof(MaskCacheEntry) + n_rects * sizeof(pixman_box32_t) +
+                   pixman_image_get_stride(image) * pixman_image_get_height(image);
+    /* like a single huge string in the string mask cache, it would only
+       flush everything else */
+    if (entry->bytes > MASK_CACHE_BYTES / 8) {
+        pixman_region32_fini(&entry->region);
+        pixman_region32_init(&entry->region);
+        entry->too_big = TRUE;
+        entry->bytes = sizeof(MaskCacheEntry) +
+                       pixman_image_get_stride(image) * pixman_image_get_height(image);
+    }
+
+    while ((cache->bytes + entry->bytes > MASK_CACHE_BYTES ||
+            cache->n_entries == MASK_CACHE_MAX_ENTRIES) &&
+           (item = ring_get_tail(&cache->lru))) {
+        mask_cache_remove(cache, SPICE_CONTAINEROF(item, MaskCacheEntry, lru_link));
+    }
+    ring_add(&cache->lru, &entry->lru_link);
+    cache->n_entries++;
+    cache->bytes += entry->bytes;
+
+    return entry->too_big ? NULL : &entry->region;
+}
+
+static int canvas_mask_is_cached(SpiceQMask *mask)
+{
+    SpiceImageDescriptor *descriptor = &mask->bitmap->descriptor;
+
+    switch (descriptor->type) {
+#if defined(SW_CANVAS_CACHE) || defined(SW_CANVAS_IMAGE_CACHE)
+    case SPICE_IMAGE_TYPE_FROM_CACHE:
+        return TRUE;
+#endif
+#ifdef SW_CANVAS_CACHE
+    case SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS:
+        return TRUE;
+    case SPICE_IMAGE_TYPE_BITMAP:
+        /* canvas_get_mask returns the image it puts in the cache */
+        return descriptor->flags & SPICE_IMAGE_FLAGS_CACHE_ME;
+#endif
+    default:
+        return FALSE;
+    }
+}
+
 static void canvas_mask_pixman(CanvasBase *canvas,
                                pixman_region32_t *dest_region,
                                SpiceQMask *mask, int x, int y)
@@ -1954,6 +2541,21 @@ static void canvas_mask_pixman(CanvasBase *canvas,
     mask_x = mask->pos.x;
     mask_y = mask->pos.y;
 
+    if (!surface_canvas && canvas_mask_is_cached(mask) &&
+        mask_width * mask_height <= MASK_CACHE_MAX_PIXELS) {
+        pixman_region32_t *cached;
+
+        cached = mask_cache_get(&canvas->masks, mask->bitmap->descriptor.id,
+                                image, needs_invert);
+        if (cached != NULL) {
+            pixman_region32_translate(dest_region, mask_x - x, mask_y - y);
+            pixman_region32_intersect(dest_region, dest_region, cached);
+            pixman_region32_translate(dest_region, x - mask_x, y - mask_y);
+            pixman_image_unref(image);
+            return;
+        }
+    }
+
     /* We need to subset the area of the mask that we turn into a region,
        because a cached mask may be much larger than what is used for
        the clip operation. */
@@ -1988,7 +2590,7 @@ static void canvas_mask_pixman(CanvasBase *canvas,
     /* round down X to even 32 pixels (i.e. uint32_t) */
     extents.x1 = extents.x1 & ~(0x1f);
 
-    mask_data = (uint32_t *)((uint8_t *)mask_data + mask_stride * extents.y1 + extents.x1 / 32);
+    mask_data = (uint32_t *)((uint8_t *)mask_data + mask_stride * extents.y1 + extents.x1 / 8);
     mask_x -= extents.x1;
     mask_y -= extents.y1;
     mask_width = extents.x2 - extents.x1;
@@ -2061,7 +2663,7 @@ static void draw_brush(SpiceCanvas *canvas,
                                                                rop);
             }
         } else {
-            tile = canvas_get_image(canvas_base, pattern->pat, FALSE);
+            tile = canvas_get_brush_image(canvas_base, pattern->pat);
             if (rop == SPICE_ROP_COPY) {
                 canvas->ops->fill_tiled_rects(canvas, rects, n_rects, tile, offset_x, offset_y);
             } else {
@@ -2983,11 +3585,109 @@ static void stroke_lines_append_bezier(StrokeLines *lines,
     subdivide_bezier(lines, point0, *point1, *point2, *point3);
 }
 
+static void stroke_fill_solid_box(StrokeGC *gc, pixman_box32_t *box)
+{
+    SpiceCanvas *canvas = gc->canvas;
+    pixman_region32_t area;
+    pixman_box32_t *area_rects;
+    int n_area_rects;
+
+    if (pixman_region32_n_rects(&gc->dest_region) == 1) {
+        pixman_box32_t *extents = pixman_region32_extents(&gc->dest_region);
+
+        box->x1 = MAX(box->x1, extents->x1);
+        box->y1 = MAX(box->y1, extents->y1);
+        box->x2 = MIN(box->x2, extents->x2);
+        box->y2 = MIN(box->y2, extents->y2);
+        if (box->x1 >= box->x2 || box->y1 >= box->y2) {
+            return;
+        }
+        if (gc->fore_rop == SPICE_ROP_COPY) {
+            canvas->ops->fill_solid_rects(canvas, box, 1, gc->color);
+        } else {
+            canvas->ops->fill_solid_rects_rop(canvas, box, 1, gc->color, gc->fore_rop);
+        }
+        return;
+    }
+
+    pixman_region32_init_rects(&area, box, 1);
+    pixman_region32_intersect(&area, &area, &gc->dest_region);
+    area_rects = pixman_region32_rectangles(&area, &n_area_rects);
+    if (n_area_rects != 0) {
+        if (gc->fore_rop == SPICE_ROP_COPY) {
+            canvas->ops->fill_solid_rects(canvas, area_rects, n_area_rects, gc->color);
+        } else {
+            canvas->ops->fill_solid_rects_rop(canvas, area_rects, n_area_rects,
+                                              gc->color, gc->fore_rop);
+        }
+    }
+    pixman_region32_fini(&area);
+}
+
+/* Solid zero width lines made only of horizontal and vertical segments,
+ * eg window borders and grids, are filled as one rect per segment,
+ * giving the same pixels as miZeroLine with CapNotLast: each segment
+ * starts at its first point and stops just before its last. Returns FALSE
+ * without drawing anything if some segment is diagonal. */
+static int stroke_lines_draw_axis_aligned(StrokeLines *lines, StrokeGC *gc)
+{
+    SpicePoint *p = lines->points;
+    pixman_box32_t box;
+    int i;
+
+    for (i = 1; i < lines->num_points; i++) {
+        if (p[i].x != p[i - 1].x && p[i].y != p[i - 1].y) {
+            return FALSE;
+        }
+    }
+
+    for (i = 1; i < lines->num_points; i++) {
+        if (p[i].y == p[i - 1].y) {
+            if (p[i].x == p[i - 1].x) {
+                continue;
+            }
+            box.y1 = p[i].y;
+            box.y2 = box.y1 + 1;
+            if (p[i].x > p[i - 1].x) {
+                box.x1 = p[i - 1].x;
+                box.x2 = p[i].x;
+            } else {
+                box.x1 = p[i].x + 1;
+                box.x2 = p[i - 1].x + 1;
+            }
+        } else {
+            box.x1 = p[i].x;
+            box.x2 = box.x1 + 1;
+            if (p[i].y > p[i - 1].y) {
+                box.y1 = p[i - 1].y;
+                box.y2 = p[i].y;
+            } else {
+                box.y1 = p[i].y + 1;
+                box.y2 = p[i - 1].y + 1;
+            }
+        }
+        /* miZeroLine clips to the canvas */
+        box.x1 = MAX(box.x1, 0);
+        box.y1 = MAX(box.y1, 0);
+        box.x2 = MIN(box.x2, gc->base.width);
+        box.y2 = MIN(box.y2, gc->base.height);
+        if (box.x1 < box.x2 && box.y1 < box.y2) {
+            stroke_fill_solid_box(gc, &box);
+        }
+    }
+    return TRUE;
+}
+
 static void stroke_lines_draw(StrokeLines *lines,
                               lineGC *gc,
                               int dashed)
 {
     if (lines->num_points != 0) {
+        if (!dashed && ((StrokeGC *)gc)->solid &&
+            stroke_lines_draw_axis_aligned(lines, (StrokeGC *)gc)) {
+            lines->num_points = 0;
+            return;
+        }
         if (dashed) {
             spice_canvas_zero_dash_line(gc, CoordModeOrigin,
                                         lines->num_points, lines->points);
@@ -3101,9 +3801,8 @@ static void canvas_draw_stroke(SpiceCanvas *spice_canvas, SpiceRect *bbox,
             gc.surface_canvas = surface_canvas;
         } else {
             gc.use_surface_canvas = FALSE;
-            gc.tile = canvas_get_image(canvas,
-                                       stroke->brush.u.pattern.pat,
-                                       FALSE);
+            gc.tile = canvas_get_brush_image(canvas,
+                                             stroke->brush.u.pattern.pat);
         }
         gc.tile_offset_x = stroke->brush.u.pattern.pos.x;
         gc.tile_offset_y = stroke->brush.u.pattern.pos.y;
@@ -3221,7 +3920,7 @@ static void canvas_draw_rop3(SpiceCanvas *spice_canvas, SpiceRect *bbox,
         if (_surface_canvas) {
             p = _surface_canvas->ops->get_image(_surface_canvas);
         } else {
-            p = canvas_get_image(canvas, rop3->brush.u.pattern.pat, FALSE);
+            p = canvas_get_brush_image(canvas, rop3->brush.u.pattern.pat);
         }
         SpicePoint pat_pos;
 
@@ -3375,6 +4074,8 @@ static int canvas_base_init(CanvasBase *canvas, SpiceCanvasOps *ops,
     canvas->glz_data.decoder = glz_decoder;
     canvas->jpeg = jpeg_decoder;
     canvas->zlib = zlib_decoder;
+    str_mask_cache_init(&canvas->str_masks);
+    mask_cache_init(&canvas->masks);
 
     canvas->format = format;
 
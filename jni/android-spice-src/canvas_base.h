@@ -53,6 +53,10 @@ typedef struct {
                           pixman_image_t *surface);
     pixman_image_t *(*get_lossless)(SpiceImageCache *cache,
                                     uint64_t id);
+    /* optional, returns a new reference to an already decoded
+       version of image, or NULL */
+    pixman_image_t *(*get_decoded)(SpiceImageCache *cache,
+                                   SpiceImage *image);
 #endif
 } SpiceImageCacheOps;
 
@@ -87,6 +91,13 @@ typedef struct {
                    uint8_t *data,
                    SpicePalette *plt,
                    void *usr_data);
+    /* same, with the glz data inflated from zlib as it is decoded */
+    void (*decode_zlib)(SpiceGlzDecoder *decoder,
+                        SpiceZlibDecoder *zlib,
+                        uint8_t *data,
+                        int data_size,
+                        SpicePalette *plt,
+                        void *usr_data);
 } SpiceGlzDecoderOps;
 
 struct _SpiceGlzDecoder {
@@ -116,6 +127,15 @@ typedef struct {
                    int data_size,
                    uint8_t *dest,
                    int dest_size);
+    /* inflates data incrementally: each decode_chunk call fills dest as
+       far as it can and returns the number of bytes written, 0 once the
+       stream has ended or is broken */
+    void (*begin_decode)(SpiceZlibDecoder *decoder,
+                         uint8_t *data,
+                         int data_size);
+    int (*decode_chunk)(SpiceZlibDecoder *decoder,
+                        uint8_t *dest,
+                        int dest_size);
 } SpiceZlibDecoderOps;
 
 struct _SpiceZlibDecoder {
@@ -308,6 +328,8 @@ typedef struct {
 
 void spice_canvas_set_usr_data(SpiceCanvas *canvas, void *data, spice_destroy_fn_t destroy_fn);
 void *spice_canvas_get_usr_data(SpiceCanvas *canvas);
+pixman_image_t *spice_canvas_decode_image(SpiceCanvas *canvas, SpiceImage *image,
+                                          int want_original);
 
 struct _SpiceCanvas {
   SpiceCanvasOps *ops;
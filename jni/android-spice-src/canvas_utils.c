@@ -56,7 +56,9 @@ static void release_data(pixman_image_t *image, void *release_data)
         gdi_handlers--;
     }
 #endif
-    if (data->data) {
+    if (data->release) {
+        data->release(data->data, data->opaque);
+    } else if (data->data) {
         free(data->data);
     }
 
@@ -283,6 +285,31 @@ pixman_image_t *surface_create_stride(pixman_format_code_t format, int width, in
     return __surface_create_stride(format, width, height, stride);
 }
 
+/* Wraps pixels owned by the caller, release is called with data once
+ * the image is gone. bits points at the first row, as for
+ * pixman_image_create_bits */
+pixman_image_t *surface_create_for_data(pixman_format_code_t format, int width, int height,
+                                        int stride, uint8_t *bits, uint8_t *data,
+                                        PixmanDataRelease release, void *opaque)
+{
+    pixman_image_t *surface;
+    PixmanData *pixman_data;
+
+    surface = pixman_image_create_bits(format, width, height, (uint32_t *)bits, stride);
+    if (surface == NULL) {
+        release(data, opaque);
+        CANVAS_ERROR("create surface failed, out of memory");
+    }
+
+    pixman_data = pixman_image_add_data(surface);
+    pixman_data->data = data;
+    pixman_data->format = format;
+    pixman_data->release = release;
+    pixman_data->opaque = opaque;
+
+    return surface;
+}
+
 pixman_image_t *alloc_lz_image_surface(LzDecodeUsrData *canvas_data,
                                        pixman_format_code_t pixman_format, int width,
                                        int height, int gross_pixels, int top_down)
@@ -28,6 +28,8 @@
 #include "pixman_utils.h"
 #include "lz.h"
 
+typedef void (*PixmanDataRelease)(uint8_t *data, void *opaque);
+
 typedef struct PixmanData {
 #ifdef WIN32
     HBITMAP bitmap;
@@ -35,6 +37,10 @@ typedef struct PixmanData {
 #endif
     uint8_t *data;
     pixman_format_code_t format;
+    /* when set, data belongs to someone else and is handed back here
+       instead of being freed */
+    PixmanDataRelease release;
+    void *opaque;
 } PixmanData;
 
 void spice_pixman_image_set_format(pixman_image_t *image,
@@ -57,6 +63,9 @@ pixman_image_t *surface_create_stride(pixman_format_code_t format, int width, in
                                       int stride);
 #endif
 
+pixman_image_t *surface_create_for_data(pixman_format_code_t format, int width, int height,
+                                        int stride, uint8_t *bits, uint8_t *data,
+                                        PixmanDataRelease release, void *opaque);
 
 typedef struct LzDecodeUsrData {
 #ifdef WIN32
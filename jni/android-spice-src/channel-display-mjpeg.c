@@ -61,64 +61,42 @@ void stream_mjpeg_init(display_stream *st)
     st->mjpeg_cinfo.src               = &st->mjpeg_src;
 }
 
-static void mjpeg_convert_scanline(uint8_t *dest, uint8_t *src, int width, int compat)
-{
-    uint32_t *row = (void*)dest;
-    uint32_t c;
-    int x;
-
-    if (compat) {
-        /*
-         * We need to check for the old major and for backwards compat
-         *  a) swap r and b (done)
-         *  b) to-yuv with right values and then from-yuv with old wrong values (TODO)
-         */
-        for (x = 0; x < width; x++) {
-            c = src[2] << 16 | src[1] << 8 | src[0];
-            src += 3;
-            *row++ = c;
-        }
-    } else {
-        for (x = 0; x < width; x++) {
-            c = src[0] << 16 | src[1] << 8 | src[2];
-            src += 3;
-            *row++ = c;
-        }
-    }
-}
-
 G_GNUC_INTERNAL
 void stream_mjpeg_data(display_stream *st)
 {
-    SpiceMsgDisplayStreamCreate *info = spice_msg_in_parsed(st->msg_create);
-    int width = info->stream_width;
-    int height = info->stream_height;
-    uint8_t *line, *dest;
-    int i;
+    struct jpeg_decompress_struct *cinfo = &st->mjpeg_cinfo;
+    uint32_t width, height;
+
+    jpeg_read_header(cinfo, 1);
 
-    line = malloc(width * 3);
-    dest = malloc(width * height * 4);
+    /* downscaling in the idct, libjpeg supports 1/2, 1/4 and 1/8 */
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = st->scale_denom;
+    jpeg_calc_output_dimensions(cinfo);
+    width = cinfo->output_width;
+    height = cinfo->output_height;
 
-    if (st->out_frame) {
+    /* the previous frame has been drawn already, its buffer only changes
+       with the scale */
+    if (st->out_frame == NULL || width != st->out_width || height != st->out_height) {
         free(st->out_frame);
+        st->out_frame = spice_malloc(width * height * 4);
+        st->out_width = width;
+        st->out_height = height;
     }
-    st->out_frame = dest;
-
-    jpeg_read_header(&st->mjpeg_cinfo, 1);
-    st->mjpeg_cinfo.out_color_space = JCS_RGB;
-    jpeg_start_decompress(&st->mjpeg_cinfo);
-    for (i = 0; i < height; i++) {
-        jpeg_read_scanlines(&st->mjpeg_cinfo, &line, 1);
-        mjpeg_convert_scanline(dest, line, width, 0 /* FIXME: compat */);
-        dest += 4 * width;
-    }
-    jpeg_finish_decompress(&st->mjpeg_cinfo);
+    st->out_scale = st->scale_denom;
 
-    free(line);
+    /* We need to check for the old major and for backwards compat
+     *  a) swap r and b
+     *  b) to-yuv with right values and then from-yuv with old wrong values (TODO)
+     */
+    jpeg_decode_rows(cinfo, st->out_frame, width * 4, SPICE_BITMAP_FMT_32BIT);
 }
 
 G_GNUC_INTERNAL
 void stream_mjpeg_cleanup(display_stream *st)
 {
     jpeg_destroy_decompress(&st->mjpeg_cinfo);
+    free(st->out_frame);
+    st->out_frame = NULL;
 }
@@ -28,12 +28,47 @@
 #include "ring.h"
 #include "quic.h"
 #include "rop3.h"
+#include "decode.h"
 
 G_BEGIN_DECLS
 
 #define DISPLAY_PIXMAP_CACHE (1024 * 1024 * 32)
 #define GLZ_WINDOW_SIZE      (1024 * 1024 * 16)
 
+/* draw operations queued while their images are decoded, or to
+   look ahead for operations hidden by later ones */
+#define DISPLAY_PENDING_MAX         32
+#define DISPLAY_PENDING_MAX_IMAGES  4
+/* how many messages, and how many ms, a draw needing a lossless cached
+   image waits for the lossy version to be replaced before it is drawn
+   with it */
+#define DISPLAY_LOSSLESS_WAIT       32
+#define DISPLAY_LOSSLESS_TIMEOUT    100
+
+/* invalidated areas are sent to the main context once per batch of
+   messages, or after this many draw operations */
+#define DISPLAY_INVALIDATE_MAX_OPS   64
+#define DISPLAY_INVALIDATE_MAX_RECTS 16
+
+/* buffers of destroyed offscreen surfaces are kept for reuse, up to
+   this many bytes. They are sorted in size classes of 4k, then 4
+   classes per power of two up to 16M, the largest buffer the pool can
+   keep; bigger ones are always freed. */
+#define DISPLAY_SURFACE_POOL_SIZE      (1024 * 1024 * 16)
+#define DISPLAY_SURFACE_POOL_MIN_SHIFT 12
+#define DISPLAY_SURFACE_POOL_MAX_SHIFT 23
+#define DISPLAY_SURFACE_POOL_CLASSES \
+    (1 + (DISPLAY_SURFACE_POOL_MAX_SHIFT - DISPLAY_SURFACE_POOL_MIN_SHIFT + 1) * 4)
+
+typedef struct display_surface_pool {
+    /* free buffers, linked through their first bytes */
+    void                        *buffers[DISPLAY_SURFACE_POOL_CLASSES];
+    size_t                      retained;
+    size_t                      peak;
+    /* stats */
+    guint                       hits, misses;
+} display_surface_pool;
+
 typedef struct display_surface {
     RingItem                    link;
     int                         surface_id;
@@ -42,10 +77,8 @@ typedef struct display_surface {
     int                         width, height, stride, size;
     int                         shmid;
     uint8_t                     *data;
+    int                         pool_class;
     SpiceCanvas                 *canvas;
-    SpiceGlzDecoder             *glz_decoder;
-    SpiceZlibDecoder            *zlib_decoder;
-    SpiceJpegDecoder            *jpeg_decoder;
 } display_surface;
 
 typedef struct display_stream {
@@ -65,12 +98,35 @@ typedef struct display_stream {
     struct jpeg_decompress_struct  mjpeg_cinfo;
     struct jpeg_error_mgr          mjpeg_jerr;
 
+    int                         scale_denom; /* wanted for the next frame */
+    spice_msg_in                *msg_last; /* last frame, kept while it is reduced */
+
     uint8_t                     *out_frame;
+    uint32_t                    out_width, out_height;
+    int                         out_scale; /* out_frame is 1/out_scale size */
     GQueue                      *msgq;
     guint                       timeout;
     SpiceChannel                *channel;
 } display_stream;
 
+typedef struct display_pending_image {
+    SpiceImage                  *image;
+    SpiceDecodeJob              *job;
+    pixman_image_t              *surface;
+} display_pending_image;
+
+typedef struct display_pending {
+    spice_msg_in                *msg;
+    int                         nimages;
+    display_pending_image       images[DISPLAY_PENDING_MAX_IMAGES];
+    gboolean                    culled;  /* overwritten before being seen */
+    gboolean                    pinned;  /* a later operation reads it */
+    gboolean                    puts_cache; /* adds images or palettes to the caches */
+    gboolean                    deferrable; /* may wait for lossless images */
+    gint64                      deadline; /* ms, once waiting for lossless */
+    guint                       seq;
+} display_pending;
+
 /* channel-display-mjpeg.c */
 void stream_mjpeg_init(display_stream *st);
 void stream_mjpeg_data(display_stream *st);
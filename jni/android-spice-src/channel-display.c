@@ -37,6 +37,7 @@
 #include "spice-channel-priv.h"
 #include "spice-session-priv.h"
 #include "channel-display-priv.h"
+#include "rect.h"
 #include "decode.h"
 
 /**
@@ -69,9 +70,24 @@ struct spice_display_channel {
     SpicePaletteCache           palette_cache;
     SpiceImageSurfaces          image_surfaces;
     SpiceGlzDecoderWindow       *glz_window;
+    /* decoding only happens in the channel coroutine, so the
+       canvases of all surfaces share the same decoders */
+    SpiceGlzDecoder             *glz_decoder;
+    SpiceZlibDecoder            *zlib_decoder;
+    SpiceJpegDecoder            *jpeg_decoder;
+    display_surface_pool        surface_pool;
     display_stream              **streams;
     int                         nstreams;
     gboolean                    mark;
+    SpiceDecodePool             *decode_pool;
+    GQueue                      *pending;
+    display_pending             *drawing;
+    gboolean                    cull_draws; /* atomic */
+    guint                       nculled;
+    guint                       nmsgs;
+    QRegion                     invalid;
+    int                         invalid_ops;
+    gint                        stream_scale_denom; /* atomic */
 #ifdef WIN32
     HDC dc;
 #endif
@@ -93,13 +109,17 @@ static guint signals[SPICE_DISPLAY_LAST_SIGNAL];
 static void spice_display_handle_msg(SpiceChannel *channel, spice_msg_in *msg);
 static void spice_display_channel_init(SpiceDisplayChannel *channel);
 static void spice_display_channel_up(SpiceChannel *channel);
+static void spice_display_channel_disconnect(SpiceChannel *channel);
 
 static void palette_clear(SpicePaletteCache *cache);
 static void image_clear(SpiceImageCache *cache);
 static void clear_surfaces(SpiceChannel *channel);
+static void surface_pool_clear(spice_display_channel *c);
 static void clear_streams(SpiceChannel *channel);
 static display_surface *find_surface(spice_display_channel *c, int surface_id);
 static gboolean display_stream_render(display_stream *st);
+static gboolean display_streams_redraw(gpointer data);
+static void clear_pending(SpiceChannel *channel);
 
 /* ------------------------------------------------------------------ */
 
@@ -107,10 +127,20 @@ static void spice_display_channel_finalize(GObject *obj)
 {
     spice_display_channel *c = SPICE_DISPLAY_CHANNEL(obj)->priv;
 
+    clear_pending(SPICE_CHANNEL(obj));
+    decode_pool_destroy(c->decode_pool);
+    g_queue_free(c->pending);
+    region_destroy(&c->invalid);
     palette_clear(&c->palette_cache);
     image_clear(&c->image_cache);
     clear_surfaces(SPICE_CHANNEL(obj));
     clear_streams(SPICE_CHANNEL(obj));
+    surface_pool_clear(c);
+    if (c->glz_decoder) {
+        glz_decoder_destroy(c->glz_decoder);
+        zlib_decoder_destroy(c->zlib_decoder);
+        jpeg_decoder_destroy(c->jpeg_decoder);
+    }
     glz_decoder_window_destroy(c->glz_window);
 
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize)
@@ -125,6 +155,7 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
     gobject_class->finalize     = spice_display_channel_finalize;
     channel_class->handle_msg   = spice_display_handle_msg;
     channel_class->channel_up   = spice_display_channel_up;
+    channel_class->channel_disconnect = spice_display_channel_disconnect;
 
     /**
      * SpiceDisplayChannel::display-primary-create:
@@ -248,6 +279,11 @@ struct SPICE_DISPLAY_MARK {
     gint mark;
 };
 
+struct SPICE_DISPLAY_INVALIDATE_BATCH {
+    gint n;
+    struct SPICE_DISPLAY_INVALIDATE rects[0];
+};
+
 /* main context */
 static void do_emit_main_context(GObject *object, int signum, gpointer params)
 {
@@ -279,6 +315,17 @@ static void do_emit_main_context(GObject *object, int signum, gpointer params)
     }
 }
 
+/* main context */
+static void do_emit_invalidates(GObject *object, int signum, gpointer params)
+{
+    struct SPICE_DISPLAY_INVALIDATE_BATCH *p = params;
+    int i;
+
+    for (i = 0; i < p->n; i++)
+        g_signal_emit(object, signals[signum], 0,
+                      p->rects[i].x, p->rects[i].y, p->rects[i].w, p->rects[i].h);
+}
+
 /* ------------------------------------------------------------------ */
 
 static void image_put(SpiceImageCache *cache, uint64_t id, pixman_image_t *image)
@@ -443,13 +490,32 @@ static pixman_image_t* image_get_lossless(SpiceImageCache *cache, uint64_t id)
     if (!item)
         return NULL;
 
-    /* TODO: shared_cache.hpp does wait until it is lossless..., is
-       that necessary? */
-    g_warn_if_fail(item->lossy == FALSE);
+    /* deferrable draws wait for the lossy image to be replaced, see
+       pending_is_blocked(), but only for so long, and the others can't
+       wait at all */
+    if (item->lossy)
+        SPICE_DEBUG("drawing with lossy image %" G_GUINT64_FORMAT, id);
 
     cache_used(&c->images, item);
     return pixman_image_ref(item->ptr);
 }
+
+static pixman_image_t *image_get_decoded(SpiceImageCache *cache, SpiceImage *image)
+{
+    spice_display_channel *c =
+        SPICE_CONTAINEROF(cache, spice_display_channel, image_cache);
+    int i;
+
+    if (c->drawing == NULL)
+        return NULL;
+
+    for (i = 0; i < c->drawing->nimages; i++) {
+        if (c->drawing->images[i].image == image &&
+            c->drawing->images[i].surface != NULL)
+            return pixman_image_ref(c->drawing->images[i].surface);
+    }
+    return NULL;
+}
 #endif
 
 SpiceCanvas *surfaces_get(SpiceImageSurfaces *surfaces,
@@ -472,6 +538,7 @@ static SpiceImageCacheOps image_cache_ops = {
     .put_lossy = image_put_lossy,
     .replace_lossy = image_replace_lossy,
     .get_lossless = image_get_lossless,
+    .get_decoded = image_get_decoded,
 #endif
 };
 
@@ -509,11 +576,164 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
     c->image_cache.ops = &image_cache_ops;
     c->palette_cache.ops = &palette_cache_ops;
     c->image_surfaces.ops = &image_surfaces_ops;
+    c->decode_pool = decode_pool_new();
+    c->pending = g_queue_new();
+    region_init(&c->invalid);
+    c->stream_scale_denom = 1;
 #if defined(WIN32)
     c->dc = create_compatible_dc();
 #endif
 }
 
+/**
+ * spice_display_set_view_scale:
+ * @channel: a display channel
+ * @scale: how large the guest display is shown, 1.0 for unscaled
+ *
+ * Lets video streams be decoded at 1/2 or 1/4 of their size when they
+ * are shown that much smaller anyway, the smallest size that is still at
+ * least @scale is used. Other images keep their full size. When @scale
+ * grows, the last frame of the streams decoded smaller is drawn again at
+ * the new size. May be called from any thread.
+ **/
+void spice_display_set_view_scale(SpiceDisplayChannel *channel, gdouble scale)
+{
+    spice_display_channel *c;
+    gint denom, old;
+
+    g_return_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel));
+    g_return_if_fail(scale > 0);
+
+    c = channel->priv;
+    /* the java side zooms out to 1/4 at most */
+    for (denom = 4; denom > 1; denom /= 2) {
+        if (1.0 / denom >= scale)
+            break;
+    }
+    old = g_atomic_int_get(&c->stream_scale_denom);
+    if (old == denom)
+        return;
+
+    SPICE_DEBUG("view scale %.3f, decoding streams at 1/%d", scale, denom);
+    g_atomic_int_set(&c->stream_scale_denom, denom);
+    if (denom < old)
+        g_idle_add(display_streams_redraw, g_object_ref(channel));
+}
+
+/**
+ * spice_display_set_cull_draws:
+ * @channel: a display channel
+ * @cull: whether to cull draw operations
+ *
+ * Lets draw operations on the primary surface be queued for a while, and
+ * skips the ones completely covered by later operations before they are
+ * drawn. Off by default. May be called from any thread.
+ **/
+void spice_display_set_cull_draws(SpiceDisplayChannel *channel, gboolean cull)
+{
+    g_return_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel));
+
+    g_atomic_int_set(&channel->priv->cull_draws, cull ? TRUE : FALSE);
+}
+
+/* ------------------------------------------------------------------ */
+
+/* Returns the size class of a buffer of size bytes, and the size to
+ * allocate for it, or -1 if it is too big to be pooled */
+static int surface_pool_class(size_t size, size_t *class_size)
+{
+    size_t base, step;
+    int shift, sub;
+
+    if (size <= (1 << DISPLAY_SURFACE_POOL_MIN_SHIFT)) {
+        *class_size = 1 << DISPLAY_SURFACE_POOL_MIN_SHIFT;
+        return 0;
+    }
+
+    for (shift = DISPLAY_SURFACE_POOL_MIN_SHIFT;
+         shift <= DISPLAY_SURFACE_POOL_MAX_SHIFT; shift++) {
+        base = (size_t)1 << shift;
+        if (size <= base * 2) {
+            step = base / 4;
+            sub = (size - base + step - 1) / step;
+            *class_size = base + sub * step;
+            return 1 + (shift - DISPLAY_SURFACE_POOL_MIN_SHIFT) * 4 + sub - 1;
+        }
+    }
+
+    *class_size = size;
+    return -1;
+}
+
+static void surface_pool_dump_stats(display_surface_pool *pool)
+{
+    SPICE_DEBUG("surface pool: %u/%u hits, %lu bytes retained (peak %lu)",
+                pool->hits, pool->hits + pool->misses,
+                (gulong)pool->retained, (gulong)pool->peak);
+}
+
+static uint8_t *surface_pool_alloc(spice_display_channel *c, display_surface *surface)
+{
+    display_surface_pool *pool = &c->surface_pool;
+    size_t class_size;
+    void *data;
+
+    surface->pool_class = surface_pool_class(surface->size, &class_size);
+    if (surface->pool_class >= 0 && pool->buffers[surface->pool_class] != NULL) {
+        data = pool->buffers[surface->pool_class];
+        pool->buffers[surface->pool_class] = *(void **)data;
+        pool->retained -= class_size;
+        pool->hits++;
+    } else {
+        data = spice_malloc(class_size);
+        pool->misses++;
+    }
+
+    if ((pool->hits + pool->misses) % 128 == 0)
+        surface_pool_dump_stats(pool);
+
+    return data;
+}
+
+static void surface_pool_free(spice_display_channel *c, display_surface *surface)
+{
+    display_surface_pool *pool = &c->surface_pool;
+    size_t class_size;
+
+    if (surface->pool_class < 0) {
+        free(surface->data);
+        return;
+    }
+
+    surface_pool_class(surface->size, &class_size);
+    if (pool->retained + class_size > DISPLAY_SURFACE_POOL_SIZE) {
+        free(surface->data);
+        return;
+    }
+
+    *(void **)surface->data = pool->buffers[surface->pool_class];
+    pool->buffers[surface->pool_class] = surface->data;
+    pool->retained += class_size;
+    pool->peak = MAX(pool->peak, pool->retained);
+}
+
+static void surface_pool_clear(spice_display_channel *c)
+{
+    display_surface_pool *pool = &c->surface_pool;
+    void *data;
+    int i;
+
+    surface_pool_dump_stats(pool);
+
+    for (i = 0; i < DISPLAY_SURFACE_POOL_CLASSES; i++) {
+        while ((data = pool->buffers[i]) != NULL) {
+            pool->buffers[i] = *(void **)data;
+            free(data);
+        }
+    }
+    pool->retained = 0;
+}
+
 /* ------------------------------------------------------------------ */
 
 static int create_canvas(SpiceChannel *channel, display_surface *surface)
@@ -541,21 +761,22 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
     }
 
     if (surface->shmid == -1) {
-        surface->data = spice_malloc(surface->size);
+        if (surface->primary) {
+            surface->pool_class = -1;
+            surface->data = spice_malloc(surface->size);
+        } else {
+            surface->data = surface_pool_alloc(c, surface);
+        }
     }
 
     if (!c->glz_window) {
-        c->glz_window = glz_decoder_window_new();
+        c->glz_window = glz_decoder_window_new(GLZ_WINDOW_SIZE);
+        c->glz_decoder = glz_decoder_new(c->glz_window);
+        c->zlib_decoder = zlib_decoder_new();
+        c->jpeg_decoder = jpeg_decoder_new();
     }
 
     g_warn_if_fail(surface->canvas == NULL);
-    g_warn_if_fail(surface->glz_decoder == NULL);
-    g_warn_if_fail(surface->zlib_decoder == NULL);
-    g_warn_if_fail(surface->jpeg_decoder == NULL);
-
-    surface->glz_decoder = glz_decoder_new(c->glz_window);
-    surface->zlib_decoder = zlib_decoder_new();
-    surface->jpeg_decoder = jpeg_decoder_new();
 
     surface->canvas = canvas_create_for_data(surface->width,
                                              surface->height,
@@ -567,25 +788,23 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
                                              &c->palette_cache,
 #endif
                                              &c->image_surfaces,
-                                             surface->glz_decoder,
-                                             surface->jpeg_decoder,
-                                             surface->zlib_decoder);
+                                             c->glz_decoder,
+                                             c->jpeg_decoder,
+                                             c->zlib_decoder);
 
     g_return_val_if_fail(surface->canvas != NULL, 0);
     return 0;
 }
 
-static void destroy_canvas(display_surface *surface)
+static void destroy_canvas(SpiceChannel *channel, display_surface *surface)
 {
+    spice_display_channel *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
     if (surface == NULL)
         return;
 
-    glz_decoder_destroy(surface->glz_decoder);
-    zlib_decoder_destroy(surface->zlib_decoder);
-    jpeg_decoder_destroy(surface->jpeg_decoder);
-
     if (surface->shmid == -1) {
-        free(surface->data);
+        surface_pool_free(c, surface);
     }
     /*
 #ifdef HAVE_SYS_SHM_H
@@ -626,11 +845,47 @@ static void clear_surfaces(SpiceChannel *channel)
         item = ring_get_head(&c->surfaces);
         surface = SPICE_CONTAINEROF(item, display_surface, link);
         ring_remove(&surface->link);
-        destroy_canvas(surface);
+        destroy_canvas(channel, surface);
         free(surface);
     }
 }
 
+/* coroutine context */
+/* Send the areas invalidated since the last call to the main context,
+ * without waiting for them to be handled. This must be called before
+ * emitting any other signal so that they are seen in order. */
+static void flush_invalidate(SpiceChannel *channel)
+{
+    spice_display_channel *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    struct SPICE_DISPLAY_INVALIDATE_BATCH *batch;
+    pixman_box32_t *boxes;
+    int i, n;
+
+    c->invalid_ops = 0;
+    if (region_is_empty(&c->invalid))
+        return;
+
+    boxes = pixman_region32_rectangles(&c->invalid, &n);
+    if (n > DISPLAY_INVALIDATE_MAX_RECTS) {
+        /* too fragmented, a single update is cheaper */
+        boxes = pixman_region32_extents(&c->invalid);
+        n = 1;
+    }
+
+    batch = g_malloc(sizeof(*batch) + n * sizeof(batch->rects[0]));
+    batch->n = n;
+    for (i = 0; i < n; i++) {
+        batch->rects[i].x = boxes[i].x1;
+        batch->rects[i].y = boxes[i].y1;
+        batch->rects[i].w = boxes[i].x2 - boxes[i].x1;
+        batch->rects[i].h = boxes[i].y2 - boxes[i].y1;
+    }
+    region_clear(&c->invalid);
+
+    g_signal_emit_main_context_async(G_OBJECT(channel), do_emit_invalidates,
+                                     SPICE_DISPLAY_INVALIDATE, batch, g_free);
+}
+
 /* coroutine context */
 static void emit_invalidate(SpiceChannel *channel, SpiceRect *bbox)
 {
@@ -639,14 +894,14 @@ static void emit_invalidate(SpiceChannel *channel, SpiceRect *bbox)
     /* FIXME: we shouldn't invalidate before the mark is sent, but
        server-side is not correct in this regard... */
     if (!c->mark) {
+        flush_invalidate(channel);
         c->mark = TRUE;
         emit_main_context(channel, SPICE_DISPLAY_MARK, TRUE);
     }
 
-    emit_main_context(channel, SPICE_DISPLAY_INVALIDATE,
-                      bbox->left, bbox->top,
-                      bbox->right - bbox->left,
-                      bbox->bottom - bbox->top);
+    region_add(&c->invalid, bbox);
+    if (++c->invalid_ops >= DISPLAY_INVALIDATE_MAX_OPS)
+        flush_invalidate(channel);
 }
 
 /* ------------------------------------------------------------------ */
@@ -668,6 +923,16 @@ static void spice_display_channel_up(SpiceChannel *channel)
     spice_msg_out_unref(out);
 }
 
+/* system or coroutine context, like the channel_disconnect it chains to */
+static void spice_display_channel_disconnect(SpiceChannel *channel)
+{
+    /* queued draws and their decode jobs belong to the old connection */
+    clear_pending(channel);
+
+    if (SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->channel_disconnect)
+        SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->channel_disconnect(channel);
+}
+
 #define DRAW(type) {                                                    \
         display_surface *surface =                                      \
             find_surface(SPICE_DISPLAY_CHANNEL(channel)->priv,          \
@@ -690,9 +955,10 @@ static void display_handle_mode(SpiceChannel *channel, spice_msg_in *in)
     g_warn_if_fail(c->mark == FALSE);
 
     if (surface) {
+        flush_invalidate(channel);
         emit_main_context(channel, SPICE_DISPLAY_PRIMARY_DESTROY);
         ring_remove(&surface->link);
-        destroy_canvas(surface);
+        destroy_canvas(channel, surface);
         free(surface);
     }
 
@@ -705,6 +971,7 @@ static void display_handle_mode(SpiceChannel *channel, spice_msg_in *in)
     surface->size    = surface->height * surface->stride;
     surface->primary = true;
     create_canvas(channel, surface);
+    flush_invalidate(channel);
     emit_main_context(channel, SPICE_DISPLAY_PRIMARY_CREATE,
                       surface->format, surface->width, surface->height,
                       surface->stride, surface->shmid, surface->data);
@@ -731,6 +998,7 @@ static void display_handle_mark(SpiceChannel *channel, spice_msg_in *in)
 #endif
 
     c->mark = TRUE;
+    flush_invalidate(channel);
     emit_main_context(channel, SPICE_DISPLAY_MARK, TRUE);
 }
 
@@ -742,12 +1010,17 @@ static void display_handle_reset(SpiceChannel *channel, spice_msg_in *in)
 
     SPICE_DEBUG("%s: TODO detach_from_screen", __FUNCTION__);
 
+    /* spice_display_handle_msg() drew the queue before this message,
+       nothing queued may outlive the reset anyway */
+    clear_pending(channel);
+
     if (surface != NULL)
         surface->canvas->ops->clear(surface->canvas);
 
     palette_clear(&c->palette_cache);
 
     c->mark = FALSE;
+    flush_invalidate(channel);
     emit_main_context(channel, SPICE_DISPLAY_MARK, FALSE);
 }
 
@@ -904,6 +1177,93 @@ static gboolean display_stream_schedule(display_stream *st)
     return FALSE;
 }
 
+/* main context */
+static void display_stream_put_frame(display_stream *st, spice_msg_in *in)
+{
+    st->msg_data = in;
+    st->scale_denom =
+        g_atomic_int_get(&SPICE_DISPLAY_CHANNEL(st->channel)->priv->stream_scale_denom);
+    switch (st->codec) {
+    case SPICE_VIDEO_CODEC_TYPE_MJPEG:
+        stream_mjpeg_data(st);
+        break;
+    }
+
+    if (st->out_frame) {
+        SpiceMsgDisplayStreamCreate *info = spice_msg_in_parsed(st->msg_create);
+        uint8_t *data;
+        int stride;
+        uint32_t src_width, src_height;
+
+        /* the frame may have been decoded at a reduced size, put_image
+           scales it back up to dest. The canvas and what is sent to
+           the java side stay at the guest size, and a nearest upscale
+           writes the same pixels as the unscaled copy, at about the
+           same cost, so the idct savings are kept */
+        src_width = MIN((info->src_width + st->out_scale - 1) / st->out_scale,
+                        st->out_width);
+        src_height = MIN((info->src_height + st->out_scale - 1) / st->out_scale,
+                         st->out_height);
+
+        data = st->out_frame;
+        stride = st->out_width * sizeof(uint32_t);
+        if (!(info->flags & SPICE_STREAM_FLAGS_TOP_DOWN)) {
+            data += stride * (src_height - 1);
+            stride = -stride;
+        }
+
+        st->surface->canvas->ops->put_image(
+            st->surface->canvas,
+#ifdef WIN32
+            SPICE_DISPLAY_CHANNEL(st->channel)->priv->dc,
+#endif
+            &info->dest, data,
+            src_width, src_height, stride,
+            st->have_region ? &st->region : NULL);
+
+        if (st->surface->primary)
+            g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+                info->dest.left, info->dest.top,
+                info->dest.right - info->dest.left,
+                info->dest.bottom - info->dest.top);
+    }
+
+    st->msg_data = NULL;
+
+    /* a reduced frame is decoded again at full size once the view grows */
+    if (st->msg_last)
+        spice_msg_in_unref(st->msg_last);
+    st->msg_last = NULL;
+    if (st->out_frame && st->out_scale > 1) {
+        spice_msg_in_ref(in);
+        st->msg_last = in;
+    }
+}
+
+/* main context */
+static gboolean display_streams_redraw(gpointer data)
+{
+    SpiceChannel *channel = data;
+    spice_display_channel *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    gint denom = g_atomic_int_get(&c->stream_scale_denom);
+    spice_msg_in *in;
+    int i;
+
+    for (i = 0; i < c->nstreams; i++) {
+        display_stream *st = c->streams[i];
+
+        if (st == NULL || st->msg_last == NULL || st->out_scale <= denom)
+            continue;
+        in = st->msg_last;
+        st->msg_last = NULL;
+        display_stream_put_frame(st, in);
+        spice_msg_in_unref(in);
+    }
+
+    g_object_unref(channel);
+    return FALSE;
+}
+
 /* main context */
 static gboolean display_stream_render(display_stream *st)
 {
@@ -915,42 +1275,7 @@ static gboolean display_stream_render(display_stream *st)
 
         g_return_val_if_fail(in != NULL, FALSE);
 
-        st->msg_data = in;
-        switch (st->codec) {
-        case SPICE_VIDEO_CODEC_TYPE_MJPEG:
-            stream_mjpeg_data(st);
-            break;
-        }
-
-        if (st->out_frame) {
-            SpiceMsgDisplayStreamCreate *info = spice_msg_in_parsed(st->msg_create);
-            uint8_t *data;
-            int stride;
-
-            data = st->out_frame;
-            stride = info->stream_width * sizeof(uint32_t);
-            if (!(info->flags & SPICE_STREAM_FLAGS_TOP_DOWN)) {
-                data += stride * (info->src_height - 1);
-                stride = -stride;
-            }
-
-            st->surface->canvas->ops->put_image(
-                st->surface->canvas,
-#ifdef WIN32
-                SPICE_DISPLAY_CHANNEL(st->channel)->priv->dc,
-#endif
-                &info->dest, data,
-                info->src_width, info->src_height, stride,
-                st->have_region ? &st->region : NULL);
-
-            if (st->surface->primary)
-                g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                    info->dest.left, info->dest.top,
-                    info->dest.right - info->dest.left,
-                    info->dest.bottom - info->dest.top);
-        }
-
-        st->msg_data = NULL;
+        display_stream_put_frame(st, in);
         spice_msg_in_unref(in);
 
         in = g_queue_peek_head(st->msgq);
@@ -1024,6 +1349,8 @@ static void destroy_stream(SpiceChannel *channel, int id)
     if (st->msg_clip)
         spice_msg_in_unref(st->msg_clip);
     spice_msg_in_unref(st->msg_create);
+    if (st->msg_last)
+        spice_msg_in_unref(st->msg_last);
 
     g_queue_foreach(st->msgq, _msg_in_unref_func, NULL);
     g_queue_free(st->msgq);
@@ -1164,6 +1491,7 @@ static void display_handle_surface_create(SpiceChannel *channel, spice_msg_in *i
     if (create->flags == SPICE_SURFACE_FLAGS_PRIMARY) {
         surface->primary = true;
         create_canvas(channel, surface);
+        flush_invalidate(channel);
         emit_main_context(channel, SPICE_DISPLAY_PRIMARY_CREATE,
                           surface->format, surface->width, surface->height,
                           surface->stride, surface->shmid, surface->data);
@@ -1193,11 +1521,12 @@ static void display_handle_surface_destroy(SpiceChannel *channel, spice_msg_in *
         return;
     }
     if (surface->primary) {
+        flush_invalidate(channel);
         emit_main_context(channel, SPICE_DISPLAY_PRIMARY_DESTROY);
     }
 
     ring_remove(&surface->link);
-    destroy_canvas(surface);
+    destroy_canvas(channel, surface);
     free(surface);
 }
 
@@ -1241,12 +1570,606 @@ static spice_msg_handler display_handlers[] = {
     [ SPICE_MSG_DISPLAY_SURFACE_DESTROY ]    = display_handle_surface_destroy,
 };
 
+/* ------------------------------------------------------------------ */
+/* Draw operations go through a queue. When a decode pool is available,
+ * they are kept there while the images they use are decoded by the pool,
+ * and are drawn in order as soon as they are ready. Otherwise they are
+ * drawn right away unless they have to wait, see below. Messages changing
+ * the surfaces or the caches wait for the queue to be empty, others only
+ * for the operations that are ready.
+ *
+ * While more messages are waiting on the socket, ie. when we fall behind,
+ * the queue is also used to look ahead: operations which are completely
+ * overwritten by a later one are drawn with an empty clip, so that the
+ * canvas only does the image caching side effects.
+ *
+ * Operations needing the lossless version of a cached image which is
+ * still lossy are kept queued until it is replaced, while the following
+ * operations that don't depend on them are drawn. They wait for at most
+ * DISPLAY_LOSSLESS_WAIT messages and DISPLAY_LOSSLESS_TIMEOUT ms, the
+ * channel waiting for the next message no longer than that. */
+
+static SpiceClipRects no_clip_rects = { 0 };
+
+/* Whether the message changes the surfaces or the caches that queued
+ * operations use, so that all of them must be drawn first */
+static gboolean is_ordered_msg(int type)
+{
+    switch (type) {
+    case SPICE_MSG_DISCONNECTING:
+    case SPICE_MSG_WAIT_FOR_CHANNELS:
+    case SPICE_MSG_MIGRATE:
+    case SPICE_MSG_DISPLAY_MODE:
+    case SPICE_MSG_DISPLAY_RESET:
+    case SPICE_MSG_DISPLAY_INVAL_LIST:
+    case SPICE_MSG_DISPLAY_INVAL_ALL_PIXMAPS:
+    case SPICE_MSG_DISPLAY_INVAL_PALETTE:
+    case SPICE_MSG_DISPLAY_INVAL_ALL_PALETTES:
+    case SPICE_MSG_DISPLAY_SURFACE_CREATE:
+    case SPICE_MSG_DISPLAY_SURFACE_DESTROY:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static gboolean is_queued_msg(int type)
+{
+    switch (type) {
+    case SPICE_MSG_DISPLAY_COPY_BITS:
+    case SPICE_MSG_DISPLAY_DRAW_FILL:
+    case SPICE_MSG_DISPLAY_DRAW_OPAQUE:
+    case SPICE_MSG_DISPLAY_DRAW_COPY:
+    case SPICE_MSG_DISPLAY_DRAW_BLEND:
+    case SPICE_MSG_DISPLAY_DRAW_BLACKNESS:
+    case SPICE_MSG_DISPLAY_DRAW_WHITENESS:
+    case SPICE_MSG_DISPLAY_DRAW_INVERS:
+    case SPICE_MSG_DISPLAY_DRAW_ROP3:
+    case SPICE_MSG_DISPLAY_DRAW_STROKE:
+    case SPICE_MSG_DISPLAY_DRAW_TEXT:
+    case SPICE_MSG_DISPLAY_DRAW_TRANSPARENT:
+    case SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static void pending_add_image(display_pending *p, SpiceImage *image)
+{
+    g_return_if_fail(p->nimages < DISPLAY_PENDING_MAX_IMAGES);
+
+    if (image != NULL)
+        p->images[p->nimages++].image = image;
+}
+
+static void pending_add_brush(display_pending *p, SpiceBrush *brush)
+{
+    if (brush->type == SPICE_BRUSH_TYPE_PATTERN)
+        pending_add_image(p, brush->u.pattern.pat);
+}
+
+/* Collect the images the canvas will ask for when drawing the message.
+ * Masks don't go through the image cache, so they are left out. */
+static void pending_collect_images(display_pending *p, int type, void *op)
+{
+    switch (type) {
+    case SPICE_MSG_DISPLAY_DRAW_FILL:
+        pending_add_brush(p, &((SpiceMsgDisplayDrawFill *)op)->data.brush);
+        break;
+    case SPICE_MSG_DISPLAY_DRAW_OPAQUE:
+        pending_add_image(p, ((SpiceMsgDisplayDrawOpaque *)op)->data.src_bitmap);
+        pending_add_brush(p, &((SpiceMsgDisplayDrawOpaque *)op)->data.brush);
+        break;
+    case SPICE_MSG_DISPLAY_DRAW_COPY:
+    case SPICE_MSG_DISPLAY_DRAW_BLEND:
+        pending_add_image(p, ((SpiceMsgDisplayDrawCopy *)op)->data.src_bitmap);
+        break;
+    case SPICE_MSG_DISPLAY_DRAW_TRANSPARENT:
+        pending_add_image(p, ((SpiceMsgDisplayDrawTransparent *)op)->data.src_bitmap);
+        break;
+    case SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND:
+        pending_add_image(p, ((SpiceMsgDisplayDrawAlphaBlend *)op)->data.src_bitmap);
+        break;
+    case SPICE_MSG_DISPLAY_DRAW_ROP3:
+        pending_add_image(p, ((SpiceMsgDisplayDrawRop3 *)op)->data.src_bitmap);
+        pending_add_brush(p, &((SpiceMsgDisplayDrawRop3 *)op)->data.brush);
+        break;
+    case SPICE_MSG_DISPLAY_DRAW_STROKE:
+        pending_add_brush(p, &((SpiceMsgDisplayDrawStroke *)op)->data.brush);
+        break;
+    case SPICE_MSG_DISPLAY_DRAW_TEXT:
+        pending_add_brush(p, &((SpiceMsgDisplayDrawText *)op)->data.fore_brush);
+        pending_add_brush(p, &((SpiceMsgDisplayDrawText *)op)->data.back_brush);
+        break;
+    default:
+        break;
+    }
+}
+
+static SpiceQMask *pending_get_mask(int type, void *op)
+{
+    switch (type) {
+    case SPICE_MSG_DISPLAY_DRAW_FILL:
+        return &((SpiceMsgDisplayDrawFill *)op)->data.mask;
+    case SPICE_MSG_DISPLAY_DRAW_OPAQUE:
+        return &((SpiceMsgDisplayDrawOpaque *)op)->data.mask;
+    case SPICE_MSG_DISPLAY_DRAW_COPY:
+    case SPICE_MSG_DISPLAY_DRAW_BLEND:
+        return &((SpiceMsgDisplayDrawCopy *)op)->data.mask;
+    case SPICE_MSG_DISPLAY_DRAW_ROP3:
+        return &((SpiceMsgDisplayDrawRop3 *)op)->data.mask;
+    case SPICE_MSG_DISPLAY_DRAW_BLACKNESS:
+    case SPICE_MSG_DISPLAY_DRAW_WHITENESS:
+    case SPICE_MSG_DISPLAY_DRAW_INVERS:
+        return &((SpiceMsgDisplayDrawBlackness *)op)->data.mask;
+    default:
+        return NULL;
+    }
+}
+
+/* Whether drawing the operation reads from another place than its
+ * destination area, in which case earlier operations can't be culled */
+static gboolean pending_reads_surface(display_pending *p, int type, void *op)
+{
+    SpiceQMask *mask = pending_get_mask(type, op);
+    int i;
+
+    if (type == SPICE_MSG_DISPLAY_COPY_BITS)
+        return TRUE;
+
+    if (mask != NULL && mask->bitmap != NULL &&
+        mask->bitmap->descriptor.type == SPICE_IMAGE_TYPE_SURFACE)
+        return TRUE;
+
+    for (i = 0; i < p->nimages; i++) {
+        if (p->images[i].image->descriptor.type == SPICE_IMAGE_TYPE_SURFACE)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Whether the operation overwrites every pixel of its box */
+static gboolean pending_is_opaque(int type, void *op)
+{
+    SpiceMsgDisplayBase *base = op;
+    SpiceQMask *mask = pending_get_mask(type, op);
+
+    if (base->clip.type != SPICE_CLIP_TYPE_NONE ||
+        (mask != NULL && mask->bitmap != NULL))
+        return FALSE;
+
+    switch (type) {
+    case SPICE_MSG_DISPLAY_DRAW_FILL: {
+        SpiceFill *fill = &((SpiceMsgDisplayDrawFill *)op)->data;
+        return fill->rop_descriptor == SPICE_ROPD_OP_PUT &&
+            fill->brush.type != SPICE_BRUSH_TYPE_NONE;
+    }
+    case SPICE_MSG_DISPLAY_DRAW_COPY:
+        return ((SpiceMsgDisplayDrawCopy *)op)->data.rop_descriptor == SPICE_ROPD_OP_PUT;
+    case SPICE_MSG_DISPLAY_DRAW_BLACKNESS:
+    case SPICE_MSG_DISPLAY_DRAW_WHITENESS:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* Whether the canvas can handle the operation with an empty clip by only
+ * touching its images. Rop3 still reads and writes back its destination
+ * area, so culling it doesn't save anything. */
+static gboolean pending_can_cull(int type)
+{
+    return is_queued_msg(type) &&
+        type != SPICE_MSG_DISPLAY_COPY_BITS &&
+        type != SPICE_MSG_DISPLAY_DRAW_ROP3;
+}
+
+/* Cull the queued operations on surface_id within box, or on the whole
+ * surface if box is NULL, starting from the most recent one */
+static void pending_cull(spice_display_channel *c, uint32_t surface_id, SpiceRect *box)
+{
+    display_pending *q;
+    SpiceMsgDisplayBase *base;
+    GList *l;
+
+    for (l = g_queue_peek_tail_link(c->pending); l != NULL; l = l->prev) {
+        q = l->data;
+        if (q->pinned)
+            break;
+        base = spice_msg_in_parsed(q->msg);
+        if (q->culled || base->surface_id != surface_id ||
+            !pending_can_cull(spice_msg_in_type(q->msg)))
+            continue;
+        if (box == NULL || rect_contains(box, &base->box)) {
+            q->culled = TRUE;
+            c->nculled++;
+        }
+    }
+}
+
+/* Only the primary surface is culled: offscreen surfaces are read back
+ * by later operations, and get few draws anyway */
+static gboolean pending_culls_surface(spice_display_channel *c, uint32_t surface_id)
+{
+    display_surface *surface;
+
+    if (!g_atomic_int_get(&c->cull_draws))
+        return FALSE;
+    surface = find_surface(c, surface_id);
+    return surface != NULL && surface->primary;
+}
+
+/* Whether some glz images still have to be decoded when drawing, in
+ * which case the operation must be drawn in order */
+static gboolean pending_has_glz(display_pending *p)
+{
+    int i;
+
+    for (i = 0; i < p->nimages; i++) {
+        switch (p->images[i].image->descriptor.type) {
+        case SPICE_IMAGE_TYPE_GLZ_RGB:
+        case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB:
+            if (p->images[i].surface == NULL)
+                return TRUE;
+            break;
+        }
+    }
+    return FALSE;
+}
+
+static gboolean pending_image_puts_cache(SpiceImage *image)
+{
+    if (image->descriptor.flags & (SPICE_IMAGE_FLAGS_CACHE_ME |
+                                   SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME))
+        return TRUE;
+
+    switch (image->descriptor.type) {
+    case SPICE_IMAGE_TYPE_BITMAP:
+        return (image->u.bitmap.flags & SPICE_BITMAP_FLAGS_PAL_CACHE_ME) != 0;
+    case SPICE_IMAGE_TYPE_LZ_PLT:
+        return (image->u.lz_plt.flags & SPICE_BITMAP_FLAGS_PAL_CACHE_ME) != 0;
+    default:
+        return FALSE;
+    }
+}
+
+/* Whether drawing the operation puts an image or a palette in the caches,
+ * which later operations may take from there */
+static gboolean pending_puts_cache(display_pending *p, int type, void *op)
+{
+    SpiceQMask *mask = pending_get_mask(type, op);
+    int i;
+
+    if (mask != NULL && mask->bitmap != NULL &&
+        pending_image_puts_cache(mask->bitmap))
+        return TRUE;
+
+    for (i = 0; i < p->nimages; i++) {
+        if (pending_image_puts_cache(p->images[i].image))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Whether the operation may be drawn after the ones following it. It
+ * must not read other areas, nor put anything in the caches. */
+static gboolean pending_is_deferrable(display_pending *p, int type, void *op)
+{
+    return pending_can_cull(type) && !p->puts_cache &&
+        !pending_reads_surface(p, type, op) && !pending_has_glz(p);
+}
+
+static gboolean pending_needs_lossless(spice_display_channel *c, display_pending *p)
+{
+    display_cache_item *item;
+    int i;
+
+    if (p->culled)
+        return FALSE;
+
+    for (i = 0; i < p->nimages; i++) {
+        if (p->images[i].image->descriptor.type != SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS)
+            continue;
+        item = cache_find(&c->images, p->images[i].image->descriptor.id);
+        if (item != NULL && item->lossy)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static gint64 display_now_ms(void)
+{
+    GTimeVal tv;
+
+    g_get_current_time(&tv);
+    return (gint64)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Whether p has to stay queued, either because it waits for a lossless
+ * image, or because it depends on an operation in blocked that does. Once
+ * an operation putting something in the caches is blocked, everything
+ * after it is: a later one may take that from the cache. */
+static gboolean pending_is_blocked(spice_display_channel *c, display_pending *p,
+                                   GSList *blocked, gboolean force)
+{
+    SpiceMsgDisplayBase *base = spice_msg_in_parsed(p->msg);
+    SpiceMsgDisplayBase *bbase;
+    GSList *l;
+
+    if (force)
+        return FALSE;
+
+    if (p->deferrable && pending_needs_lossless(c, p)) {
+        gint64 now = display_now_ms();
+
+        if (p->deadline == 0) {
+            SPICE_DEBUG("deferring draw until cached image is lossless");
+            p->deadline = now + DISPLAY_LOSSLESS_TIMEOUT;
+        }
+        if (c->nmsgs - p->seq < DISPLAY_LOSSLESS_WAIT && now < p->deadline)
+            return TRUE;
+        SPICE_DEBUG("lossless image didn't come, drawing lossy one");
+    }
+
+    if (blocked == NULL)
+        return FALSE;
+
+    if (pending_reads_surface(p, spice_msg_in_type(p->msg), base) ||
+        pending_has_glz(p))
+        return TRUE;
+
+    for (l = blocked; l != NULL; l = l->next) {
+        if (((display_pending *)l->data)->puts_cache)
+            return TRUE;
+        bbase = spice_msg_in_parsed(((display_pending *)l->data)->msg);
+        if (bbase->surface_id == base->surface_id &&
+            rect_intersects(&bbase->box, &base->box))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* coroutine context */
+static void pending_push(SpiceChannel *channel, spice_msg_in *in)
+{
+    spice_display_channel *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceMsgDisplayBase *base = spice_msg_in_parsed(in);
+    display_pending *p = spice_new0(display_pending, 1);
+    display_surface *surface;
+    SpiceImageDescriptor *descriptor;
+    int i, want_original;
+
+    spice_msg_in_ref(in);
+    p->msg = in;
+    pending_collect_images(p, spice_msg_in_type(in), base);
+
+    if (g_atomic_int_get(&c->cull_draws)) {
+        if (pending_reads_surface(p, spice_msg_in_type(in), base)) {
+            GList *l;
+            for (l = g_queue_peek_tail_link(c->pending); l != NULL; l = l->prev)
+                ((display_pending *)l->data)->pinned = TRUE;
+        } else if (pending_is_opaque(spice_msg_in_type(in), base) &&
+                   pending_culls_surface(c, base->surface_id)) {
+            pending_cull(c, base->surface_id, &base->box);
+        }
+    }
+
+    surface = c->decode_pool ? find_surface(c, base->surface_id) : NULL;
+    for (i = 0; surface != NULL && i < p->nimages; i++) {
+        descriptor = &p->images[i].image->descriptor;
+        switch (descriptor->type) {
+        case SPICE_IMAGE_TYPE_QUIC:
+        case SPICE_IMAGE_TYPE_LZ_RGB:
+        case SPICE_IMAGE_TYPE_JPEG:
+        case SPICE_IMAGE_TYPE_JPEG_ALPHA:
+            /* pool threads decode in the 32bpp or 16bpp surface format,
+               keep the original format for the other surfaces, and for
+               the cache, like the canvas would */
+            want_original =
+                (descriptor->flags & (SPICE_IMAGE_FLAGS_CACHE_ME |
+                                      SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME)) ||
+                (SPICE_SURFACE_FMT_DEPTH(surface->format) != 32 &&
+                 surface->format != SPICE_SURFACE_FMT_16_555);
+            p->images[i].job = decode_pool_push(c->decode_pool,
+                                                p->images[i].image,
+                                                surface->format,
+                                                want_original);
+            break;
+        case SPICE_IMAGE_TYPE_GLZ_RGB:
+        case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB:
+            /* the glz window must see images in stream order, and the
+               images it holds are shared with the canvas, so decode
+               right away instead of using the pool */
+            p->images[i].surface =
+                spice_canvas_decode_image(surface->canvas, p->images[i].image, FALSE);
+            break;
+        default:
+            /* cached images, bitmaps and palettes are resolved when
+               drawing, in order */
+            break;
+        }
+    }
+
+    p->seq = c->nmsgs;
+    p->puts_cache = pending_puts_cache(p, spice_msg_in_type(in), base);
+    p->deferrable = pending_is_deferrable(p, spice_msg_in_type(in), base);
+    g_queue_push_tail(c->pending, p);
+}
+
+static gboolean pending_is_ready(spice_display_channel *c, display_pending *p)
+{
+    int i;
+
+    for (i = 0; i < p->nimages; i++) {
+        if (p->images[i].job != NULL &&
+            !decode_job_is_done(c->decode_pool, p->images[i].job))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void pending_free(spice_display_channel *c, display_pending *p)
+{
+    int i;
+
+    for (i = 0; i < p->nimages; i++) {
+        if (p->images[i].job != NULL) {
+            p->images[i].surface =
+                decode_job_finish(c->decode_pool, p->images[i].job);
+            p->images[i].job = NULL;
+        }
+        if (p->images[i].surface != NULL)
+            pixman_image_unref(p->images[i].surface);
+    }
+    spice_msg_in_unref(p->msg);
+    free(p);
+}
+
+/* coroutine context */
+static void pending_draw(SpiceChannel *channel, display_pending *p)
+{
+    spice_display_channel *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    int i;
+
+    for (i = 0; i < p->nimages; i++) {
+        if (p->images[i].job != NULL) {
+            p->images[i].surface =
+                decode_job_finish(c->decode_pool, p->images[i].job);
+            p->images[i].job = NULL;
+        }
+    }
+
+    if (p->culled) {
+        SpiceMsgDisplayBase *base = spice_msg_in_parsed(p->msg);
+        base->clip.type = SPICE_CLIP_TYPE_RECTS;
+        base->clip.rects = &no_clip_rects;
+    }
+
+    c->drawing = p;
+    display_handlers[spice_msg_in_type(p->msg)](channel, p->msg);
+    c->drawing = NULL;
+
+    pending_free(c, p);
+}
+
+/* coroutine context */
+/* Draw queued operations in order until no more than keep are left. The
+ * remaining ones are drawn too if their images are ready, unless they are
+ * kept around to look ahead. Operations waiting for a lossless image are
+ * skipped along with those depending on them, unless force is set. */
+static void flush_pending(SpiceChannel *channel, guint keep, gboolean force)
+{
+    spice_display_channel *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_pending *p;
+    GSList *blocked = NULL;
+    GList *l, *next;
+
+    for (l = g_queue_peek_head_link(c->pending); l != NULL; l = next) {
+        next = l->next;
+        p = l->data;
+
+        if (pending_is_blocked(c, p, blocked, force)) {
+            blocked = g_slist_prepend(blocked, p);
+            continue;
+        }
+
+        if (g_queue_get_length(c->pending) <= keep &&
+            (g_atomic_int_get(&c->cull_draws) || !pending_is_ready(c, p)))
+            break;
+
+        g_queue_delete_link(c->pending, l);
+        pending_draw(channel, p);
+
+        if (blocked != NULL) {
+            /* it may have replaced the image we were waiting for */
+            g_slist_free(blocked);
+            blocked = NULL;
+            next = g_queue_peek_head_link(c->pending);
+        }
+    }
+
+    g_slist_free(blocked);
+}
+
+static void clear_pending(SpiceChannel *channel)
+{
+    spice_display_channel *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_pending *p;
+
+    while ((p = g_queue_pop_head(c->pending)) != NULL)
+        pending_free(c, p);
+}
+
+/* coroutine context */
+/* Once everything read is handled, waits for the next message while
+ * operations wait for a lossless image, drawing them when their wait is
+ * over */
+static void pending_wait(SpiceChannel *channel)
+{
+    spice_display_channel *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_pending *p;
+    gint64 deadline, now;
+    gboolean force;
+    GList *l;
+
+    while (!g_queue_is_empty(c->pending)) {
+        deadline = 0;
+        for (l = g_queue_peek_head_link(c->pending); l != NULL; l = l->next) {
+            p = l->data;
+            if (p->deadline != 0 && (deadline == 0 || p->deadline < deadline))
+                deadline = p->deadline;
+        }
+        now = display_now_ms();
+        force = deadline == 0;
+        if (deadline > now) {
+            if (spice_channel_wait_input(channel, deadline - now))
+                return;
+            /* back early with nothing to read, the channel is closing */
+            force = display_now_ms() < deadline;
+        }
+        flush_pending(channel, 0, force);
+        flush_invalidate(channel);
+    }
+}
+
 /* coroutine context */
 static void spice_display_handle_msg(SpiceChannel *channel, spice_msg_in *msg)
 {
+    spice_display_channel *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
     int type = spice_msg_in_type(msg);
+    gboolean more;
     SPICE_DEBUG("Got spice_display_handle_msg:%d",type);
     g_return_if_fail(type < SPICE_N_ELEMENTS(display_handlers));
     g_return_if_fail(display_handlers[type] != NULL);
-    display_handlers[type](channel, msg);
+
+    c->nmsgs++;
+    if (is_queued_msg(type)) {
+        pending_push(channel, msg);
+        /* keep reading ahead while there is more to read, so that the
+           pool has something to work on */
+        more = spice_channel_has_pending_input(channel);
+        flush_pending(channel, more ? DISPLAY_PENDING_MAX : 0, FALSE);
+    } else {
+        if (type == SPICE_MSG_DISPLAY_SURFACE_DESTROY) {
+            SpiceMsgSurfaceDestroy *destroy = spice_msg_in_parsed(msg);
+            if (pending_culls_surface(c, destroy->surface_id))
+                pending_cull(c, destroy->surface_id, NULL);
+        }
+        flush_pending(channel, 0, is_ordered_msg(type));
+        display_handlers[type](channel, msg);
+        more = spice_channel_has_pending_input(channel);
+    }
+
+    /* the end of a batch of messages, let the main context update. Draws
+       still waiting for a lossless image keep waiting for the next
+       messages, until their time is up */
+    if (!more) {
+        flush_pending(channel, 0, FALSE);
+        if (c->nculled > 0)
+            SPICE_DEBUG("culled %u hidden draw operations", c->nculled);
+        c->nculled = 0;
+        flush_invalidate(channel);
+        pending_wait(channel);
+    }
 }
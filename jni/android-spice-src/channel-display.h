@@ -58,6 +58,9 @@ struct _SpiceDisplayChannelClass {
 
 GType	        spice_display_channel_get_type(void);
 
+void spice_display_set_view_scale(SpiceDisplayChannel *channel, gdouble scale);
+void spice_display_set_cull_draws(SpiceDisplayChannel *channel, gboolean cull);
+
 G_END_DECLS
 
 #endif /* __SPICE_CLIENT_DISPLAY_CHANNEL_H__ */
@@ -171,13 +171,14 @@
 // TODO: separate into routines that decode to dist,len. and to a routine that
 // actually copies the data.
 
-/* returns num of bytes read from in buf.
+/* reads from d->in_now, which is left past the image data.
    size should be in PIXEL */
-static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
-                            uint8_t* in_buf, uint8_t *out_buf, int size,
-                            uint64_t image_id, SpicePalette *plt)
+static void FNAME(decode)(GlibGlzDecoder *d, uint8_t *out_buf, int size,
+                          uint64_t image_id, SpicePalette *plt)
 {
-    uint8_t      *ip = in_buf;
+    SpiceGlzDecoderWindow *window = d->window;
+    uint8_t      *ip = d->in_now;
+    uintptr_t    in_refill = d->in_refill;
     OUT_PIXEL    *out_pix_buf = (OUT_PIXEL *)out_buf;
     OUT_PIXEL    *op = out_pix_buf;
     OUT_PIXEL    *op_limit = out_pix_buf + size;
@@ -186,6 +187,7 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
     int loop = true;
 
     do {
+        GLZ_INPUT_CHECK(ip, in_refill);
         if (ctrl >= MAX_COPY) { // reference (dictionary/RLE)
             OUT_PIXEL *ref = op;
             uint32_t len = ctrl >> 5;
@@ -202,6 +204,7 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
 
             if (len == 7) { // match length is bigger than 7
                 do {
+                    GLZ_INPUT_CHECK(ip, in_refill);
                     code = *(ip++);
                     len += code;
                 } while (code == 255); // remaining of len
@@ -253,56 +256,67 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
 
             if (!image_dist) { // reference is inside the same image
                 ref -= pixel_ofs;
-                g_return_val_if_fail(ref + len <= op_limit, 0);
-                g_return_val_if_fail(ref >= out_pix_buf, 0);
+                g_return_if_fail(ref + len <= op_limit);
+                g_return_if_fail(ref >= out_pix_buf);
             } else {
                 ref = glz_decoder_window_bits(window, image_id,
                                               image_dist, pixel_ofs);
+                g_return_if_fail(ref != NULL);
             }
 
-            g_return_val_if_fail(op + len <= op_limit, 0);
+            g_return_if_fail(op + len <= op_limit);
 
             /* copying the match*/
 
+#ifndef LZ_RGB_ALPHA
+            /* whole pixels, runs and overlapping matches included */
+            if (!image_dist) {
+                lz_copy_match((uint8_t *)op, (const uint8_t *)ref, len * sizeof(OUT_PIXEL));
+            } else {
+                lz_copy_match_far((uint8_t *)op, (const uint8_t *)ref, len * sizeof(OUT_PIXEL));
+            }
+            op += len;
+#else
             if (ref == (op - 1)) { // run (this will never be called in PLT4/1_TO_RGB because the
                                   // number of pixel copied is larger then one...
                 /* optimize copy for a run */
                 OUT_PIXEL b = *ref;
                 for (; len; --len) {
                     COPY_PIXEL(b, op);
-                    g_return_val_if_fail(op <= op_limit, 0);
+                    g_return_if_fail(op <= op_limit);
                 }
             } else {
                 for (; len; --len) {
                     COPY_REF_PIXEL(ref, op);
-                    g_return_val_if_fail(op <= op_limit, 0);
+                    g_return_if_fail(op <= op_limit);
                 }
             }
+#endif
         } else { // copy
             ctrl++; // copy count is biased by 1
 #if defined(TO_RGB32) && (defined(PLT4_BE) || defined(PLT4_LE) || defined(PLT1_BE) || \
                                                                                    defined(PLT1_LE))
-            g_return_val_if_fail(op + CAST_PLT_DISTANCE(ctrl) <= op_limit, 0);
+            g_return_if_fail(op + CAST_PLT_DISTANCE(ctrl) <= op_limit);
 #else
-            g_return_val_if_fail(op + ctrl <= op_limit, 0);
+            g_return_if_fail(op + ctrl <= op_limit);
 #endif
 
 #if defined(TO_RGB32) && defined(LZ_PLT)
-            g_return_val_if_fail(plt, 0);
+            g_return_if_fail(plt);
             COPY_COMP_PIXEL(ip, op, plt);
 #else
             COPY_COMP_PIXEL(ip, op);
 #endif
-            g_return_val_if_fail(op <= op_limit, 0);
+            g_return_if_fail(op <= op_limit);
 
             for (--ctrl; ctrl; ctrl--) {
 #if defined(TO_RGB32) && defined(LZ_PLT)
-                g_return_val_if_fail(plt, 0);
+                g_return_if_fail(plt);
                 COPY_COMP_PIXEL(ip, op, plt);
 #else
                 COPY_COMP_PIXEL(ip, op);
 #endif
-                g_return_val_if_fail(op <= op_limit, 0);
+                g_return_if_fail(op <= op_limit);
             }
         } // END REF/COPY
 
@@ -313,7 +327,7 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
         }
     } while (LZ_EXPECT_CONDITIONAL(loop));
 
-    return (ip - in_buf);
+    d->in_now = ip;
 }
 #undef LZ_PLT
 #undef PLT8
@@ -26,6 +26,7 @@
 
 /* spice/common */
 #include "canvas_utils.h"
+#include "lz_copy.h"
 
 struct glz_image_hdr {
     uint64_t                id;
@@ -43,23 +44,136 @@ struct glz_image {
     uint8_t                 *data;
 };
 
-static struct glz_image *glz_image_new(struct glz_image_hdr *hdr,
+/* ------------------------------------------------------------------ */
+
+/* Pixels of window images come from storage owned by the window, and
+ * decoded images are handed to the canvas as is: the surface wrapping
+ * them is both the window entry and the source the canvas blits from.
+ * Once the last reference to an image is gone, be it the window's or a
+ * cache's, its buffer goes back to a free list for the next image
+ * instead of to malloc. The storage outlives the window as long as
+ * images from it are alive, and images may be released from any thread. */
+
+#define GLZ_STORAGE_ALIGN (4 * 1024)
+#define GLZ_STORAGE_MAX_FREE (8 * 1024 * 1024)
+
+typedef struct glz_buffer {
+    size_t                  size;
+    struct glz_buffer       *next;
+} glz_buffer;
+
+typedef struct glz_storage {
+    gint                    refs;
+    GMutex                  *lock;
+    glz_buffer              *free_list;
+    size_t                  free_bytes;
+    guint                   hits;
+    guint                   misses;
+} glz_storage;
+
+static glz_storage *glz_storage_new(void)
+{
+    glz_storage *st = spice_new0(glz_storage, 1);
+
+    if (!g_thread_supported())
+        g_thread_init(NULL);
+    st->refs = 1;
+    st->lock = g_mutex_new();
+    return st;
+}
+
+static void glz_storage_unref(glz_storage *st)
+{
+    glz_buffer *buf;
+
+    if (!g_atomic_int_dec_and_test(&st->refs))
+        return;
+
+    SPICE_DEBUG("glz storage: %u hits, %u misses", st->hits, st->misses);
+    while ((buf = st->free_list) != NULL) {
+        st->free_list = buf->next;
+        free(buf);
+    }
+    g_mutex_free(st->lock);
+    free(st);
+}
+
+/* returns the pixel area of a buffer of at least size bytes */
+static uint8_t *glz_storage_alloc(glz_storage *st, size_t size)
+{
+    glz_buffer *buf, **prev;
+
+    size = SPICE_ALIGN(size, GLZ_STORAGE_ALIGN);
+
+    g_mutex_lock(st->lock);
+    /* first fit, wasting at most a quarter of the buffer */
+    for (prev = &st->free_list; (buf = *prev) != NULL; prev = &buf->next) {
+        if (buf->size >= size && buf->size - size <= buf->size / 4) {
+            *prev = buf->next;
+            st->free_bytes -= buf->size;
+            st->hits++;
+            break;
+        }
+    }
+    if (buf == NULL)
+        st->misses++;
+    g_mutex_unlock(st->lock);
+
+    if (buf == NULL) {
+        buf = spice_malloc(sizeof(glz_buffer) + size);
+        buf->size = size;
+    }
+    g_atomic_int_inc(&st->refs);
+
+    return (uint8_t *)(buf + 1);
+}
+
+static void glz_storage_release(uint8_t *data, void *opaque)
+{
+    glz_storage *st = opaque;
+    glz_buffer *buf = (glz_buffer *)data - 1;
+
+    g_mutex_lock(st->lock);
+    if (st->free_bytes + buf->size <= GLZ_STORAGE_MAX_FREE) {
+        buf->next = st->free_list;
+        st->free_list = buf;
+        st->free_bytes += buf->size;
+        buf = NULL;
+    }
+    g_mutex_unlock(st->lock);
+
+    free(buf);
+    glz_storage_unref(st);
+}
+
+static struct glz_image *glz_image_new(glz_storage *st, struct glz_image_hdr *hdr,
                                        int type, void *opaque)
 {
+    LzDecodeUsrData *usr_data = opaque;
     struct glz_image *img;
+    uint8_t *data;
+    int stride;
 
     g_return_val_if_fail(type == LZ_IMAGE_TYPE_RGB32 || type == LZ_IMAGE_TYPE_RGBA, NULL);
 
     img = spice_new0(struct glz_image, 1);
     img->hdr = *hdr;
-    img->surface = alloc_lz_image_surface
-        (opaque, type == LZ_IMAGE_TYPE_RGBA ? PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8,
-         img->hdr.width, img->hdr.height, img->hdr.gross_pixels, img->hdr.top_down);
-    pixman_image_ref(img->surface);
-    img->data = (uint8_t *)pixman_image_get_data(img->surface);
+
+    /* decoded straight in the format the canvas composites from */
+    stride = (img->hdr.gross_pixels / img->hdr.height) * 4;
+    data = glz_storage_alloc(st, (size_t)stride * img->hdr.height);
+    img->data = data;
     if (!img->hdr.top_down) {
-        img->data = img->data - img->hdr.width * (img->hdr.height - 1) * 4;
+        data += stride * (img->hdr.height - 1);
+        stride = -stride;
     }
+    img->surface = surface_create_for_data
+        (type == LZ_IMAGE_TYPE_RGBA ? PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8,
+         img->hdr.width, img->hdr.height, stride, data, img->data,
+         glz_storage_release, st);
+
+    /* one reference for the window, one for the canvas */
+    usr_data->out_surface = pixman_image_ref(img->surface);
     return img;
 }
 
@@ -74,81 +188,238 @@ static void glz_image_destroy(struct glz_image *img)
 
 /* ------------------------------------------------------------------ */
 
-#define INIT_IMAGES_CAPACITY 100
-#define WIN_OVERFLOW_FACTOR 1.5
-#define WIN_REALLOC_FACTOR 1.5
+/* The ring is sized from the window budget, with a slot for every image
+ * of at least GLZ_MIN_IMAGE_PIXELS the server dictionary can hold: 64K
+ * slots for the 16M pixels window. Only a window filled with images
+ * smaller than that makes it grow, the images it holds may still be
+ * referenced so none is dropped to make room. */
+#define GLZ_MIN_IMAGE_PIXELS 256
+
+/* how many images are added between two dumps of the window stats */
+#define GLZ_STATS_INTERVAL 256
 
+#define GLZ_IMAGE_BYTES(img) ((size_t)(img)->hdr.gross_pixels * 4)
+
+/* Images are kept in a ring indexed by id: the server numbers them in
+ * sequence, so the live ones span [oldest, next) and id & mask never
+ * collides as long as that span fits in the ring. Slots inside the span
+ * may be empty, slots outside it always are. */
 struct SpiceGlzDecoderWindow {
+    glz_storage             *storage;
     struct glz_image        **images;
-    uint32_t                nimages;
+    uint32_t                capacity;
     uint64_t                oldest;
+    uint64_t                next;
+    uint32_t                nimages;
+    uint32_t                peak_images;
+    uint32_t                added;
+    uint32_t                grown;
+    size_t                  bytes;
+    size_t                  peak_bytes;
+    size_t                  max_bytes;
 };
 
-static void glz_decoder_window_resize(SpiceGlzDecoderWindow *w)
+#define WIN_SLOT(w, id) ((id) & ((w)->capacity - 1))
+
+static void glz_decoder_window_grow(SpiceGlzDecoderWindow *w, uint64_t span)
 {
     struct glz_image  **new_images;
-    int i, new_slot;
-
-    SPICE_DEBUG("%s: array resize %d -> %d", __FUNCTION__,
-                w->nimages, w->nimages * 2);
-    new_images = spice_new0(struct glz_image*, w->nimages * 2);
-    for (i = 0; i < w->nimages; i++) {
-        new_slot = w->images[i]->hdr.id % (w->nimages * 2);
-        new_images[new_slot] = w->images[i];
+    uint32_t new_capacity = w->capacity;
+    uint64_t id;
+
+    while (new_capacity <= span)
+        new_capacity *= 2;
+
+    SPICE_DEBUG("%s: ring resize %u -> %u", __FUNCTION__,
+                w->capacity, new_capacity);
+    new_images = spice_new0(struct glz_image*, new_capacity);
+    for (id = w->oldest; id < w->next; id++) {
+        new_images[id & (new_capacity - 1)] = w->images[WIN_SLOT(w, id)];
     }
     free(w->images);
     w->images = new_images;
-    w->nimages *= 2;
+    w->capacity = new_capacity;
+    w->grown++;
+}
+
+static void glz_decoder_window_drop_oldest(SpiceGlzDecoderWindow *w)
+{
+    struct glz_image **slot = &w->images[WIN_SLOT(w, w->oldest)];
+
+    if (*slot) {
+        w->bytes -= GLZ_IMAGE_BYTES(*slot);
+        w->nimages--;
+        glz_image_destroy(*slot);
+        *slot = NULL;
+    }
+    w->oldest++;
+}
+
+/* The server dictionary never holds more than the window size, so the
+ * encoder can't reference images older than that many bytes back even
+ * if win_head_dist still lets us keep them */
+static void glz_decoder_window_trim(SpiceGlzDecoderWindow *w)
+{
+    struct glz_image *img;
+
+    while (w->oldest < w->next) {
+        img = w->images[WIN_SLOT(w, w->oldest)];
+        if (img && w->bytes - GLZ_IMAGE_BYTES(img) < w->max_bytes)
+            break;
+        glz_decoder_window_drop_oldest(w);
+    }
+}
+
+static void glz_decoder_window_dump_stats(SpiceGlzDecoderWindow *w)
+{
+    SPICE_DEBUG("glz window: %u images, %lu/%lu bytes, "
+                "peak %u images, %lu bytes, %u slots, grown %u times",
+                w->nimages, (gulong)w->bytes, (gulong)w->max_bytes,
+                w->peak_images, (gulong)w->peak_bytes,
+                w->capacity, w->grown);
 }
 
 static void glz_decoder_window_add(SpiceGlzDecoderWindow *w,
                                    struct glz_image *img)
 {
-    int slot = img->hdr.id % w->nimages;
+    uint64_t id = img->hdr.id;
+    struct glz_image **slot;
+
+    glz_decoder_window_trim(w);
+    if (w->oldest == w->next) {
+        w->oldest = w->next = id;
+    } else if (id < w->oldest) {
+        /* out of sequence: kept like any other image as long as the ring
+           spans it, anything further back means the server restarted
+           its ids and the images we hold can't be referenced anymore */
+        if (w->next - id < w->capacity) {
+            w->oldest = id;
+        } else {
+            g_warning("glz image %" PRIu64 " far behind window at %" PRIu64
+                      ", restarting the window", id, w->next);
+            while (w->oldest < w->next)
+                glz_decoder_window_drop_oldest(w);
+            w->oldest = w->next = id;
+        }
+    }
+    if (id >= w->next) {
+        if (id - w->next >= w->capacity) {
+            /* a whole ring of ids we never got: the server restarted
+               its ids ahead of ours */
+            g_warning("glz image %" PRIu64 " far ahead of window at %" PRIu64
+                      ", restarting the window", id, w->next);
+            while (w->oldest < w->next)
+                glz_decoder_window_drop_oldest(w);
+            w->oldest = w->next = id;
+        } else if (id - w->oldest >= w->capacity) {
+            glz_decoder_window_grow(w, id - w->oldest);
+        }
+        w->next = id + 1;
+    }
 
-    if (w->images[slot]) {
-        /* need more space */
-        glz_decoder_window_resize(w);
-        slot = img->hdr.id % w->nimages;
+    /* an image sent again replaces the one we have */
+    slot = &w->images[WIN_SLOT(w, id)];
+    if (*slot) {
+        w->bytes -= GLZ_IMAGE_BYTES(*slot);
+        w->nimages--;
+        glz_image_destroy(*slot);
     }
-    w->images[slot] = img;
+    *slot = img;
+    w->nimages++;
+    w->bytes += GLZ_IMAGE_BYTES(img);
+    if (w->nimages > w->peak_images)
+        w->peak_images = w->nimages;
+    if (w->bytes > w->peak_bytes)
+        w->peak_bytes = w->bytes;
+    if (++w->added % GLZ_STATS_INTERVAL == 0)
+        glz_decoder_window_dump_stats(w);
 }
 
 static void *glz_decoder_window_bits(SpiceGlzDecoderWindow *w, uint64_t id,
                                      uint32_t dist, uint32_t offset)
 {
-    int slot = (id - dist) % w->nimages;
-    
-    g_return_val_if_fail(w->images[slot], NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.id == id - dist, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.gross_pixels >= offset, NULL);
+    struct glz_image *img;
 
-    return w->images[slot]->data + offset * 4;
+    g_return_val_if_fail(id - dist >= w->oldest && id - dist < w->next, NULL);
+    img = w->images[WIN_SLOT(w, id - dist)];
+    g_return_val_if_fail(img, NULL);
+    g_return_val_if_fail(img->hdr.gross_pixels >= offset, NULL);
+
+    return img->data + offset * 4;
 }
 
 static void glz_decoder_window_release(SpiceGlzDecoderWindow *w,
                                        uint64_t oldest)
 {
-    int slot;
-
-    while (w->oldest < oldest) {
-        slot = w->oldest % w->nimages;
-        glz_image_destroy(w->images[slot]);
-        w->images[slot] = NULL;
-        w->oldest++;
+    while (w->oldest < oldest && w->oldest < w->next) {
+        glz_decoder_window_drop_oldest(w);
     }
 }
 
 /* ------------------------------------------------------------------ */
 
+/* zlib-glz images are inflated GLZ_INPUT_CHUNK bytes at a time into
+ * in_buf while they are decoded, rather than into a buffer holding the
+ * whole glz stream. The decode loops only check for more input once per
+ * op: any op but the length bytes of a long match reads less than
+ * GLZ_INPUT_MARGIN bytes, so refilling once ip is past in_refill keeps
+ * them within in_buf. in_refill is UINTPTR_MAX when there is nothing to
+ * refill from, ie for plain glz images. Once the stream has ended the
+ * check stays armed: each op then refills nothing, and an op starting
+ * at or past in_end means the stream was truncated or corrupt, which
+ * fails the decode instead of reading on into stale memory. */
+#define GLZ_INPUT_CHUNK (64 * 1024)
+#define GLZ_INPUT_MARGIN 128
+
 typedef struct GlibGlzDecoder {
     SpiceGlzDecoder         base;
     uint8_t                 *in_start;
     uint8_t                 *in_now;
+    uintptr_t               in_refill;
+    uint8_t                 *in_end;
+    uint8_t                 *in_buf;
+    int                     in_failed;
+    SpiceZlibDecoder        *zlib;
     SpiceGlzDecoderWindow   *window;
     struct glz_image_hdr    image;
 } GlibGlzDecoder;
 
+/* Moves the unread input at ip to the start of in_buf and inflates
+ * after it. Returns where ip is now, or NULL when input is needed
+ * but there is none left, in which case in_failed is set. */
+static uint8_t *glz_input_refill(GlibGlzDecoder *d, uint8_t *ip)
+{
+    size_t left;
+    int n;
+
+    if (d->zlib == NULL) {
+        d->in_refill = UINTPTR_MAX;
+        return ip;
+    }
+
+    left = ip < d->in_end ? d->in_end - ip : 0;
+    memmove(d->in_buf, ip, left);
+    n = d->zlib->ops->decode_chunk(d->zlib, d->in_buf + left,
+                                   GLZ_INPUT_CHUNK - left);
+    if (n == 0 && left == 0) {
+        g_warning("%s: zlib-glz input ended before the image did", __FUNCTION__);
+        d->in_failed = TRUE;
+        d->in_refill = 0;
+        return NULL;
+    }
+    d->in_end = d->in_buf + left + n;
+    d->in_refill = (uintptr_t)d->in_end - GLZ_INPUT_MARGIN;
+    return d->in_buf;
+}
+
+#define GLZ_INPUT_CHECK(ip, in_refill)                                  \
+    if (LZ_UNEXPECT_CONDITIONAL((uintptr_t)(ip) > (in_refill))) {       \
+        ip = glz_input_refill(d, ip);                                   \
+        if (ip == NULL)                                                 \
+            return;                                                     \
+        in_refill = d->in_refill;                                       \
+    }
+
 /*
  * Give hints to the compiler for branch prediction optimization.
  */
@@ -242,12 +513,12 @@ typedef uint16_t rgb16_pixel_t;
 #define LZ_RGB_ALPHA
 #include "decode-glz-tmpl.c"
 
+#undef GLZ_INPUT_CHECK
 #undef LZ_UNEXPECT_CONDITIONAL
 #undef LZ_EXPECT_CONDITIONAL
 
-typedef size_t (*decode_function)(SpiceGlzDecoderWindow *window,
-                                  uint8_t* in_buf, uint8_t *out_buf, int size,
-                                  uint64_t id, SpicePalette *plt);
+typedef void (*decode_function)(GlibGlzDecoder *d, uint8_t *out_buf, int size,
+                                uint64_t id, SpicePalette *plt);
 
 // ordered according to LZ_IMAGE_TYPE
 const decode_function DECODE_TO_RGB32[] = {
@@ -278,15 +549,18 @@ const decode_function DECODE_TO_SAME[] = {
 
 static uint32_t decode_32(GlibGlzDecoder *d)
 {
-    uint32_t word = 0;
-    word |= *(d->in_now++);
-    word <<= 8;
-    word |= *(d->in_now++);
-    word <<= 8;
-    word |= *(d->in_now++);
-    word <<= 8;
-    word |= *(d->in_now++);
+    uint8_t *in = d->in_now;
+    uint32_t word;
+
+    d->in_now = in + 4;
+#ifdef LZ_COPY_UNALIGNED
+    memcpy(&word, in, 4);
+    return GUINT32_FROM_BE(word);
+#else
+    word = ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) |
+           ((uint32_t)in[2] << 8) | in[3];
     return word;
+#endif
 }
 
 static uint64_t decode_64(GlibGlzDecoder *d)
@@ -334,17 +608,11 @@ static void decode_header(GlibGlzDecoder *d)
             d->image.id - d->image.win_head_dist);
 }
 
-static void decode(SpiceGlzDecoder *decoder,
-                   uint8_t *data, SpicePalette *palette,
-                   void *usr_data)
+/* decodes the image at d->in_now */
+static void decode_image(GlibGlzDecoder *d, SpicePalette *palette, void *usr_data)
 {
-    GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
     LzImageType decoded_type;
     struct glz_image *decoded_image;
-    size_t n_in_bytes_decoded;
-
-    d->in_start = data;
-    d->in_now = data;
 
     decode_header(d);
 
@@ -354,50 +622,100 @@ static void decode(SpiceGlzDecoder *decoder,
         decoded_type = LZ_IMAGE_TYPE_RGB32;
     }
 
-    decoded_image = glz_image_new(&d->image, decoded_type, usr_data);
-
-    n_in_bytes_decoded = DECODE_TO_RGB32[d->image.type]
-        (d->window, d->in_now, decoded_image->data,
-         d->image.gross_pixels, d->image.id, palette);
+    decoded_image = glz_image_new(d->window->storage, &d->image, decoded_type, usr_data);
 
-    d->in_now += n_in_bytes_decoded;
+    DECODE_TO_RGB32[d->image.type](d, decoded_image->data,
+                                   d->image.gross_pixels, d->image.id, palette);
 
-    if (d->image.type == LZ_IMAGE_TYPE_RGBA) {
-        glz_rgb_alpha_decode(d->window, d->in_now, decoded_image->data,
+    if (d->image.type == LZ_IMAGE_TYPE_RGBA && !d->in_failed) {
+        glz_rgb_alpha_decode(d, decoded_image->data,
                              d->image.gross_pixels, d->image.id, palette);
     }
 
     glz_decoder_window_release(d->window, d->image.id - d->image.win_head_dist);
+    if (d->in_failed) {
+        /* the canvas still gets an image, blank rather than half decoded,
+           but it is kept out of the window so later images can't refer
+           to it */
+        memset(decoded_image->data, 0, (size_t)d->image.gross_pixels * 4);
+        glz_image_destroy(decoded_image);
+        return;
+    }
     glz_decoder_window_add(d->window, decoded_image);
 }
 
+static void decode(SpiceGlzDecoder *decoder,
+                   uint8_t *data, SpicePalette *palette,
+                   void *usr_data)
+{
+    GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
+
+    d->in_start = data;
+    d->in_now = data;
+    d->in_refill = UINTPTR_MAX;
+    d->in_failed = FALSE;
+
+    decode_image(d, palette, usr_data);
+}
+
+static void decode_zlib(SpiceGlzDecoder *decoder, SpiceZlibDecoder *zlib,
+                        uint8_t *data, int data_size, SpicePalette *palette,
+                        void *usr_data)
+{
+    GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
+
+    if (d->in_buf == NULL) {
+        d->in_buf = spice_malloc(GLZ_INPUT_CHUNK);
+    }
+
+    zlib->ops->begin_decode(zlib, data, data_size);
+    d->zlib = zlib;
+    d->in_end = d->in_buf;
+    d->in_failed = FALSE;
+    d->in_start = glz_input_refill(d, d->in_buf);
+    if (d->in_start == NULL) {
+        /* nothing inflated: the header magic check fails on the zeroes
+           like for any bad glz image, and the first op stops the decode */
+        memset(d->in_buf, 0, GLZ_INPUT_MARGIN);
+        d->in_start = d->in_buf;
+    }
+    d->in_now = d->in_start;
+
+    decode_image(d, palette, usr_data);
+
+    d->zlib = NULL;
+}
+
 /* ------------------------------------------------------------------ */
 
 static SpiceGlzDecoderOps glz_decoder_ops = {
     .decode = decode,
+    .decode_zlib = decode_zlib,
 };
 
-SpiceGlzDecoderWindow *glz_decoder_window_new(void)
+/* window_size is the dictionary size negotiated with the server, in
+ * pixels */
+SpiceGlzDecoderWindow *glz_decoder_window_new(uint32_t window_size)
 {
     SpiceGlzDecoderWindow *w = spice_new0(SpiceGlzDecoderWindow, 1);
 
-    w->nimages = 16;
-    w->images = spice_new0(struct glz_image*, w->nimages);
+    w->capacity = 1;
+    while (w->capacity < window_size / GLZ_MIN_IMAGE_PIXELS)
+        w->capacity *= 2;
+    w->images = spice_new0(struct glz_image*, w->capacity);
+    w->storage = glz_storage_new();
+    w->max_bytes = (size_t)window_size * 4;
     return w;
 }
 
 void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w)
 {
-    int i;
-
     if (w == NULL)
         return;
 
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i]) {
-            glz_image_destroy(w->images[i]);
-        }
-    }
+    glz_decoder_window_dump_stats(w);
+    glz_decoder_window_release(w, w->next);
+    glz_storage_unref(w->storage);
     free(w->images);
     free(w);
 }
@@ -410,7 +728,14 @@ SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w)
     return &d->base;
 }
 
-void glz_decoder_destroy(SpiceGlzDecoder *d)
+void glz_decoder_destroy(SpiceGlzDecoder *decoder)
 {
+    GlibGlzDecoder *d;
+
+    if (decoder == NULL)
+        return;
+
+    d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
+    free(d->in_buf);
     free(d);
 }
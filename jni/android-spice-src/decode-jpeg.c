@@ -26,6 +26,10 @@
 #include <stdio.h>
 #include <jpeglib.h>
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 typedef struct GlibJpegDecoder
 {
     SpiceJpegDecoder              base;
@@ -63,7 +67,6 @@ static void begin_decode(SpiceJpegDecoder *decoder,
 
     jpeg_read_header(&d->_cinfo, TRUE);
 
-    d->_cinfo.out_color_space = JCS_RGB;
     d->_width = d->_cinfo.image_width;
     d->_height = d->_cinfo.image_height;
 
@@ -71,7 +74,31 @@ static void begin_decode(SpiceJpegDecoder *decoder,
     *out_height = d->_height;
 }
 
-/* TODO: move it elsewhere and reuse it in get_pixbuf(), optimize? */
+/* Rows handed to each jpeg_read_scanlines() call, libjpeg returns less
+ * when its own output buffer is smaller but never has to be called per
+ * row */
+#define JPEG_BAND_ROWS 16
+
+#ifdef JCS_EXTENSIONS
+/* libjpeg-turbo can write our pixel layouts itself */
+static J_COLOR_SPACE jpeg_out_color_space(int format)
+{
+    switch (format) {
+    case SPICE_BITMAP_FMT_24BIT:
+        return JCS_EXT_BGR;
+    case SPICE_BITMAP_FMT_32BIT:
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+        return JCS_EXT_BGRX;
+#else
+        return JCS_EXT_XRGB;
+#endif
+    }
+    return JCS_RGB;
+}
+#endif
+
+/* The converters below are only used with plain libjpeg, which can only
+ * output packed RGB. src rows are 4 byte aligned. */
 typedef void (*converter_rgb_t)(uint8_t* src, uint8_t* dest, int width);
 
 static void convert_rgb_to_bgr(uint8_t* src, uint8_t* dest, int width)
@@ -86,51 +113,130 @@ static void convert_rgb_to_bgr(uint8_t* src, uint8_t* dest, int width)
     }
 }
 
+/* To x8r8g8b8 pixels, x is set like libjpeg-turbo does */
 static void convert_rgb_to_bgrx(uint8_t* src, uint8_t* dest, int width)
 {
-    int x;
+    uint32_t *row = (uint32_t *)dest;
+    int x = 0;
+
+#if defined(__SSSE3__)
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                          8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i xmask = _mm_set1_epi32((int)0xff000000);
+    __m128i v;
+
+    /* each load reads 16 bytes for 4 pixels, stop while 4 bytes past
+       them are still part of the row */
+    for (; x + 6 <= width; x += 4) {
+        v = _mm_loadu_si128((const __m128i *)src);
+        v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), xmask);
+        _mm_storeu_si128((__m128i *)row, v);
+        src += 12;
+        row += 4;
+    }
+#elif G_BYTE_ORDER == G_LITTLE_ENDIAN
+    /* 4 pixels from 3 aligned word loads */
+    const uint32_t *w = (const uint32_t *)src;
+    uint32_t w0, w1, w2;
+
+    for (; x + 4 <= width; x += 4) {
+        w0 = w[0];
+        w1 = w[1];
+        w2 = w[2];
+        row[0] = 0xff000000 | (w0 & 0xff) << 16 | (w0 & 0xff00) | (w0 >> 16 & 0xff);
+        row[1] = 0xff000000 | (w0 >> 24) << 16 | (w1 & 0xff) << 8 | (w1 >> 8 & 0xff);
+        row[2] = 0xff000000 | (w1 >> 16 & 0xff) << 16 | (w1 >> 24) << 8 | (w2 & 0xff);
+        row[3] = 0xff000000 | (w2 >> 8 & 0xff) << 16 | (w2 & 0xff0000) >> 8 | w2 >> 24;
+        w += 3;
+        row += 4;
+    }
+    src = (uint8_t *)w;
+#endif
 
-    for (x = 0; x < width; x++) {
-        *dest++ = src[2];
-        *dest++ = src[1];
-        *dest++ = src[0];
-        *dest++ = 0;
+    for (; x < width; x++) {
+        *row++ = 0xff000000 | src[0] << 16 | src[1] << 8 | src[2];
         src += 3;
     }
 }
 
-static void decode(SpiceJpegDecoder *decoder,
-                   uint8_t* dest, int stride, int format)
+static converter_rgb_t jpeg_rgb_converter(int format)
 {
-    //fprintf(stderr,"%s:%s:%d:%p\n",__FILE__,__FUNCTION__,__LINE__,(char*)dest);
-    GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
-    uint8_t* scan_line = g_alloca(d->_width * 3);
-    converter_rgb_t converter = NULL;
-    int row;
-
     switch (format) {
     case SPICE_BITMAP_FMT_24BIT:
-        converter = convert_rgb_to_bgr;
-        break;
+        return convert_rgb_to_bgr;
     case SPICE_BITMAP_FMT_32BIT:
-        converter = convert_rgb_to_bgrx;
-        break;
-    default:
+        return convert_rgb_to_bgrx;
+    }
+    return NULL;
+}
+
+/* Decompresses the image whose header was just read with
+ * jpeg_read_header() into dest, either 24 bit BGR or x8r8g8b8 pixels
+ * depending on format. stride may be negative. */
+void jpeg_decode_rows(struct jpeg_decompress_struct *cinfo,
+                      uint8_t *dest, int stride, int format)
+{
+    JSAMPROW rows[JPEG_BAND_ROWS];
+    converter_rgb_t converter;
+    uint8_t *band = NULL;
+    int band_stride = 0;
+    int width, height, y, n, i;
+
+    converter = jpeg_rgb_converter(format);
+    if (converter == NULL) {
         g_warning("bad bitmap format, %d", format);
         return;
     }
 
-    g_return_if_fail(converter != NULL);
+#ifdef JCS_EXTENSIONS
+    cinfo->out_color_space = jpeg_out_color_space(format);
+    if (cinfo->out_color_space != JCS_RGB)
+        converter = NULL;
+#else
+    cinfo->out_color_space = JCS_RGB;
+#endif
 
-    jpeg_start_decompress(&d->_cinfo);
+    jpeg_start_decompress(cinfo);
+    width = cinfo->output_width;
+    height = cinfo->output_height;
 
-    for (row = 0; row < d->_height; row++) {
-        jpeg_read_scanlines(&d->_cinfo, &scan_line, 1);
-        converter(scan_line, dest, d->_width);
-        dest += stride;
+    if (converter != NULL) {
+        band_stride = (width * 3 + 3) & ~3;
+        band = spice_malloc(band_stride * JPEG_BAND_ROWS);
+        for (i = 0; i < JPEG_BAND_ROWS; i++)
+            rows[i] = band + i * band_stride;
     }
 
-    jpeg_finish_decompress(&d->_cinfo);
+    while ((y = cinfo->output_scanline) < height) {
+        n = MIN(height - y, JPEG_BAND_ROWS);
+        if (converter == NULL) {
+            for (i = 0; i < n; i++)
+                rows[i] = dest + (y + i) * stride;
+        }
+        n = jpeg_read_scanlines(cinfo, rows, n);
+        if (n == 0) {
+            g_warning("jpeg data ended at row %d of %d", y, height);
+            break;
+        }
+        if (converter != NULL) {
+            for (i = 0; i < n; i++)
+                converter(rows[i], dest + (y + i) * stride, width);
+        }
+    }
+
+    if (cinfo->output_scanline == (JDIMENSION)height)
+        jpeg_finish_decompress(cinfo);
+    else
+        jpeg_abort_decompress(cinfo);
+    free(band);
+}
+
+static void decode(SpiceJpegDecoder *decoder,
+                   uint8_t* dest, int stride, int format)
+{
+    GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
+
+    jpeg_decode_rows(&d->_cinfo, dest, stride, format);
 }
 
 static SpiceJpegDecoderOps jpeg_decoder_ops = {
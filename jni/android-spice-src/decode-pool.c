@@ -0,0 +1,228 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2011  Keqisoft,Co,Ltd,Shanghai,China
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <unistd.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "decode.h"
+#include "sw_canvas.h"
+
+/* Upper bound on decode threads, more don't help on the devices we run
+ * on and each of them keeps its own quic/lz/jpeg contexts around */
+#define DECODE_POOL_MAX_THREADS 4
+
+struct SpiceDecodeJob {
+    SpiceImage               *image;
+    uint32_t                 format; /* of the surface drawn to */
+    int                      want_original;
+    pixman_image_t           *surface;
+    gboolean                 done;
+};
+
+typedef struct decode_thread {
+    SpiceDecodePool          *pool;
+    GThread                  *thread;
+    SpiceCanvas              *canvas;
+    SpiceCanvas              *canvas16; /* created for the first 16bpp job */
+    SpiceJpegDecoder         *jpeg_decoder;
+    SpiceZlibDecoder         *zlib_decoder;
+} decode_thread;
+
+struct SpiceDecodePool {
+    GAsyncQueue              *queue;
+    GMutex                   *lock;
+    GCond                    *done;
+    int                      nthreads;
+    decode_thread            threads[DECODE_POOL_MAX_THREADS];
+};
+
+/* pushed once per thread to make it exit */
+static SpiceDecodeJob quit_job;
+
+static gpointer decode_thread_run(gpointer data)
+{
+    decode_thread *t = data;
+    SpiceDecodePool *pool = t->pool;
+    SpiceDecodeJob *job;
+    SpiceCanvas *canvas;
+    pixman_image_t *surface;
+
+    for (;;) {
+        job = g_async_queue_pop(pool->queue);
+        if (job == &quit_job)
+            break;
+
+        /* decoding for a 16bpp surface converts while decoding, the
+           drawing canvas converts whatever is left over */
+        canvas = t->canvas;
+        if (job->format == SPICE_SURFACE_FMT_16_555) {
+            if (t->canvas16 == NULL)
+                t->canvas16 = canvas_create(1, 1, SPICE_SURFACE_FMT_16_555,
+                                            NULL, NULL, NULL, NULL,
+                                            t->jpeg_decoder, t->zlib_decoder);
+            if (t->canvas16 != NULL)
+                canvas = t->canvas16;
+        }
+
+        surface = spice_canvas_decode_image(canvas, job->image, job->want_original);
+
+        g_mutex_lock(pool->lock);
+        job->surface = surface;
+        job->done = TRUE;
+        g_cond_broadcast(pool->done);
+        g_mutex_unlock(pool->lock);
+    }
+
+    return NULL;
+}
+
+static int decode_pool_default_threads(void)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* leave one core to the coroutine doing the actual drawing */
+    if (ncpu <= 1)
+        return 0;
+    return MIN(ncpu - 1, DECODE_POOL_MAX_THREADS);
+}
+
+/* Returns NULL if decoding ahead of time wouldn't help, ie on single
+ * core devices, in which case images are decoded when drawn as usual */
+SpiceDecodePool *decode_pool_new(void)
+{
+    SpiceDecodePool *pool;
+    decode_thread *t;
+    int i, nthreads;
+
+    nthreads = decode_pool_default_threads();
+    if (nthreads == 0)
+        return NULL;
+
+    if (!g_thread_supported())
+        g_thread_init(NULL);
+
+    pool = spice_new0(SpiceDecodePool, 1);
+    pool->queue = g_async_queue_new();
+    pool->lock = g_mutex_new();
+    pool->done = g_cond_new();
+
+    for (i = 0; i < nthreads; i++) {
+        t = &pool->threads[i];
+        t->pool = pool;
+        t->jpeg_decoder = jpeg_decoder_new();
+        t->zlib_decoder = zlib_decoder_new();
+        /* the canvases are only used for their decoding contexts and
+           the format images are converted to, unless want_original */
+        t->canvas = canvas_create(1, 1, SPICE_SURFACE_FMT_32_xRGB,
+                                  NULL, NULL, NULL, NULL,
+                                  t->jpeg_decoder, t->zlib_decoder);
+        if (t->canvas != NULL)
+            t->thread = g_thread_create(decode_thread_run, t, TRUE, NULL);
+        if (t->thread == NULL) {
+            g_warning("failed to create decode thread");
+            if (t->canvas != NULL)
+                t->canvas->ops->destroy(t->canvas);
+            jpeg_decoder_destroy(t->jpeg_decoder);
+            zlib_decoder_destroy(t->zlib_decoder);
+            break;
+        }
+        pool->nthreads++;
+    }
+
+    if (pool->nthreads == 0) {
+        decode_pool_destroy(pool);
+        return NULL;
+    }
+
+    SPICE_DEBUG("decode pool: %d threads", pool->nthreads);
+    return pool;
+}
+
+/* All jobs must have been waited for before */
+void decode_pool_destroy(SpiceDecodePool *pool)
+{
+    decode_thread *t;
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    for (i = 0; i < pool->nthreads; i++)
+        g_async_queue_push(pool->queue, &quit_job);
+
+    for (i = 0; i < pool->nthreads; i++) {
+        t = &pool->threads[i];
+        g_thread_join(t->thread);
+        t->canvas->ops->destroy(t->canvas);
+        if (t->canvas16 != NULL)
+            t->canvas16->ops->destroy(t->canvas16);
+        jpeg_decoder_destroy(t->jpeg_decoder);
+        zlib_decoder_destroy(t->zlib_decoder);
+    }
+
+    g_async_queue_unref(pool->queue);
+    g_mutex_free(pool->lock);
+    g_cond_free(pool->done);
+    free(pool);
+}
+
+/* The image data must stay valid until the job is finished. Unless
+ * want_original is set, the image is decoded in the surface format */
+SpiceDecodeJob *decode_pool_push(SpiceDecodePool *pool, SpiceImage *image,
+                                 uint32_t format, int want_original)
+{
+    SpiceDecodeJob *job;
+
+    g_return_val_if_fail(pool != NULL, NULL);
+
+    job = spice_new0(SpiceDecodeJob, 1);
+    job->image = image;
+    job->format = format;
+    job->want_original = want_original;
+    g_async_queue_push(pool->queue, job);
+
+    return job;
+}
+
+gboolean decode_job_is_done(SpiceDecodePool *pool, SpiceDecodeJob *job)
+{
+    gboolean done;
+
+    g_mutex_lock(pool->lock);
+    done = job->done;
+    g_mutex_unlock(pool->lock);
+
+    return done;
+}
+
+/* Waits for job to finish and frees it. Returns the decoded image, or
+ * NULL if the image type can't be decoded ahead of time. */
+pixman_image_t *decode_job_finish(SpiceDecodePool *pool, SpiceDecodeJob *job)
+{
+    pixman_image_t *surface;
+
+    g_mutex_lock(pool->lock);
+    while (!job->done)
+        g_cond_wait(pool->done, pool->lock);
+    g_mutex_unlock(pool->lock);
+
+    surface = job->surface;
+    free(job);
+
+    return surface;
+}
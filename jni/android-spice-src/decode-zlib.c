@@ -27,6 +27,7 @@ typedef struct GlibZlibDecoder
 {
     SpiceZlibDecoder         base;
     z_stream                 _z_strm;
+    gboolean                 ended;
 } GlibZlibDecoder;
 
 static void decode(SpiceZlibDecoder *decoder,
@@ -49,8 +50,46 @@ static void decode(SpiceZlibDecoder *decoder,
     }
 }
 
+static void begin_decode(SpiceZlibDecoder *decoder,
+                         uint8_t *data, int data_size)
+{
+    GlibZlibDecoder *d = SPICE_CONTAINEROF(decoder, GlibZlibDecoder, base);
+
+    inflateReset(&d->_z_strm);
+    d->_z_strm.next_in = data;
+    d->_z_strm.avail_in = data_size;
+    d->ended = FALSE;
+}
+
+static int decode_chunk(SpiceZlibDecoder *decoder,
+                        uint8_t *dest, int dest_size)
+{
+    GlibZlibDecoder *d = SPICE_CONTAINEROF(decoder, GlibZlibDecoder, base);
+    int z_ret;
+
+    if (d->ended || dest_size <= 0) {
+        return 0;
+    }
+
+    d->_z_strm.next_out = dest;
+    d->_z_strm.avail_out = dest_size;
+
+    z_ret = inflate(&d->_z_strm, Z_NO_FLUSH);
+
+    if (z_ret == Z_STREAM_END) {
+        d->ended = TRUE;
+    } else if (z_ret != Z_OK) {
+        g_warning("zlib inflate failed, error %d", z_ret);
+        d->ended = TRUE;
+    }
+
+    return dest_size - d->_z_strm.avail_out;
+}
+
 static SpiceZlibDecoderOps zlib_decoder_ops = {
     .decode = decode,
+    .begin_decode = begin_decode,
+    .decode_chunk = decode_chunk,
 };
 
 SpiceZlibDecoder *zlib_decoder_new(void)
@@ -25,7 +25,7 @@ G_BEGIN_DECLS
 
 typedef struct SpiceGlzDecoderWindow SpiceGlzDecoderWindow;
 
-SpiceGlzDecoderWindow *glz_decoder_window_new(void);
+SpiceGlzDecoderWindow *glz_decoder_window_new(uint32_t window_size);
 void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w);
 
 SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w);
@@ -37,6 +37,20 @@ void zlib_decoder_destroy(SpiceZlibDecoder *d);
 SpiceJpegDecoder *jpeg_decoder_new(void);
 void jpeg_decoder_destroy(SpiceJpegDecoder *d);
 
+struct jpeg_decompress_struct;
+void jpeg_decode_rows(struct jpeg_decompress_struct *cinfo,
+                      uint8_t *dest, int stride, int format);
+
+typedef struct SpiceDecodePool SpiceDecodePool;
+typedef struct SpiceDecodeJob SpiceDecodeJob;
+
+SpiceDecodePool *decode_pool_new(void);
+void decode_pool_destroy(SpiceDecodePool *pool);
+SpiceDecodeJob *decode_pool_push(SpiceDecodePool *pool, SpiceImage *image,
+                                 uint32_t format, int want_original);
+gboolean decode_job_is_done(SpiceDecodePool *pool, SpiceDecodeJob *job);
+pixman_image_t *decode_job_finish(SpiceDecodePool *pool, SpiceDecodeJob *job);
+
 G_END_DECLS
 
 #endif // SPICEGTK_DECODE_H_
@@ -44,6 +44,35 @@ GIOCondition g_io_wait(GSocket *sock, GIOCondition cond)
     return *ret;
 }
 
+static gboolean g_io_wait_timeout_helper(gpointer data)
+{
+    static GIOCondition none = 0;
+    struct coroutine *to = data;
+    coroutine_yieldto(to, &none);
+    return FALSE;
+}
+
+/* Same as g_io_wait(), but gives up after timeout ms, returning 0 */
+GIOCondition g_io_wait_timeout(GSocket *sock, GIOCondition cond, guint timeout)
+{
+    GIOCondition *ret, res;
+    GSource *src = g_socket_create_source(sock,
+                                          cond | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+                                          NULL);
+    GSource *timer = g_timeout_source_new(timeout);
+
+    g_source_set_callback(src, (GSourceFunc)g_io_wait_helper, coroutine_self(), NULL);
+    g_source_set_callback(timer, g_io_wait_timeout_helper, coroutine_self(), NULL);
+    g_source_attach(src, NULL);
+    g_source_attach(timer, NULL);
+    ret = coroutine_yield(NULL);
+    res = *ret;
+    g_source_destroy(src);
+    g_source_destroy(timer);
+    g_source_unref(src);
+    g_source_unref(timer);
+    return res;
+}
 
 GIOCondition g_io_wait_interruptable(struct wait_queue *wait,
                                      GSocket *sock,
@@ -196,6 +225,50 @@ void g_signal_emit_main_context(GObject *object,
     coroutine_yield(NULL);
 }
 
+struct signal_async_data
+{
+    GObject *object;
+    int signum;
+    gpointer params;
+    GDestroyNotify params_free;
+    GSignalEmitMainFunc func;
+};
+
+static gboolean emit_main_context_async(gpointer opaque)
+{
+    struct signal_async_data *signal = opaque;
+
+    signal->func(signal->object, signal->signum, signal->params);
+    if (signal->params_free)
+        signal->params_free(signal->params);
+    g_object_unref(signal->object);
+    g_free(signal);
+
+    return FALSE;
+}
+
+/* coroutine -> main context */
+/* Same as g_signal_emit_main_context(), but returns without waiting for
+ * the signal to be dispatched. params is owned by the emission and is
+ * released with params_free afterwards. Since both go through idle
+ * sources of the same priority, emissions are dispatched in the order
+ * they were queued, whether they are asynchronous or not. */
+void g_signal_emit_main_context_async(GObject *object,
+                                      GSignalEmitMainFunc emit_main_func,
+                                      int signum,
+                                      gpointer params,
+                                      GDestroyNotify params_free)
+{
+    struct signal_async_data *data = g_new(struct signal_async_data, 1);
+
+    data->object = g_object_ref(object);
+    data->signum = signum;
+    data->params = params;
+    data->params_free = params_free;
+    data->func = emit_main_func;
+    g_idle_add(emit_main_context_async, data);
+}
+
 static gboolean notify_main_context(gpointer opaque)
 {
     struct signal_data *signal = opaque;
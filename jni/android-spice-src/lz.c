@@ -45,6 +45,7 @@
 */
 
 #include "lz.h"
+#include "lz_copy.h"
 
 #define DEBUG
 
@@ -473,6 +474,31 @@ typedef uint16_t rgb16_pixel_t;
 #define TO_RGB32
 #include "lz_decompress_tmpl.c"
 
+#define LZ_PLT
+#define PLT8
+#define TO_RGB16
+#include "lz_decompress_tmpl.c"
+
+#define LZ_PLT
+#define PLT4_BE
+#define TO_RGB16
+#include "lz_decompress_tmpl.c"
+
+#define LZ_PLT
+#define PLT4_LE
+#define TO_RGB16
+#include "lz_decompress_tmpl.c"
+
+#define LZ_PLT
+#define PLT1_BE
+#define TO_RGB16
+#include "lz_decompress_tmpl.c"
+
+#define LZ_PLT
+#define PLT1_LE
+#define TO_RGB16
+#include "lz_decompress_tmpl.c"
+
 
 #define LZ_RGB16
 #include "lz_compress_tmpl.c"
@@ -492,6 +518,9 @@ typedef uint16_t rgb16_pixel_t;
 #include "lz_compress_tmpl.c"
 #define LZ_RGB32
 #include "lz_decompress_tmpl.c"
+#define LZ_RGB32
+#define TO_RGB16
+#include "lz_decompress_tmpl.c"
 
 #define LZ_RGB_ALPHA
 #include "lz_compress_tmpl.c"
@@ -669,6 +698,31 @@ void lz_decode(LzContext *lz, LzImageType to_type, uint8_t *buf)
             default:
                 encoder->usr->error(encoder->usr, "bad image type\n");
             }
+        } else if (to_type == LZ_IMAGE_TYPE_RGB16) {
+            size = encoder->height * encoder->stride * PLT_PIXELS_PER_BYTE[encoder->type];
+            if (!encoder->palette) {
+                encoder->usr->error(encoder->usr,
+                                    "a palette is missing (for bpp to rgb decoding)\n");
+            }
+            switch (encoder->type) {
+            case LZ_IMAGE_TYPE_PLT1_BE:
+                out_size = lz_plt1_be_to_rgb16_decompress(encoder, (rgb16_pixel_t *)buf, size);
+                break;
+            case LZ_IMAGE_TYPE_PLT1_LE:
+                out_size = lz_plt1_le_to_rgb16_decompress(encoder, (rgb16_pixel_t *)buf, size);
+                break;
+            case LZ_IMAGE_TYPE_PLT4_BE:
+                out_size = lz_plt4_be_to_rgb16_decompress(encoder, (rgb16_pixel_t *)buf, size);
+                break;
+            case LZ_IMAGE_TYPE_PLT4_LE:
+                out_size = lz_plt4_le_to_rgb16_decompress(encoder, (rgb16_pixel_t *)buf, size);
+                break;
+            case LZ_IMAGE_TYPE_PLT8:
+                out_size = lz_plt8_to_rgb16_decompress(encoder, (rgb16_pixel_t *)buf, size);
+                break;
+            default:
+                encoder->usr->error(encoder->usr, "bad image type\n");
+            }
         } else {
             encoder->usr->error(encoder->usr, "unsupported output format\n");
         }
@@ -689,6 +743,8 @@ void lz_decode(LzContext *lz, LzImageType to_type, uint8_t *buf)
                 out_size = lz_rgb24_decompress(encoder, (rgb24_pixel_t *)buf, size);
             } else if (to_type == LZ_IMAGE_TYPE_RGB32) {
                 out_size = lz_rgb32_decompress(encoder, (rgb32_pixel_t *)buf, size);
+            } else if (to_type == LZ_IMAGE_TYPE_RGB16) {
+                out_size = lz_rgb32_to_rgb16_decompress(encoder, (rgb16_pixel_t *)buf, size);
             } else {
                 encoder->usr->error(encoder->usr, "unsupported output format\n");
             }
@@ -696,6 +752,8 @@ void lz_decode(LzContext *lz, LzImageType to_type, uint8_t *buf)
         case LZ_IMAGE_TYPE_RGB32:
             if (encoder->type == to_type) {
                 out_size = lz_rgb32_decompress(encoder, (rgb32_pixel_t *)buf, size);
+            } else if (to_type == LZ_IMAGE_TYPE_RGB16) {
+                out_size = lz_rgb32_to_rgb16_decompress(encoder, (rgb16_pixel_t *)buf, size);
             } else {
                 encoder->usr->error(encoder->usr, "unsupported output format\n");
             }
@@ -59,7 +59,10 @@ void lz_decode_begin(LzContext *lz, uint8_t *io_ptr, unsigned int num_io_bytes,
         to_type = the image output type.
         We assume the buffer is consecutive. i.e. width = stride
 
-        Important: if the image is plt1/4 and to_type is rgb32, the image
+        rgb24/rgb32 and plt images can also be decoded to rgb16 (x1r5g5b5) and
+        rgb16 ones to rgb32.
+
+        Important: if the image is plt1/4 and to_type is rgb32/rgb16, the image
         will decompressed including the last bits in each line. This means buffer should be
         larger than width*height if needed and you should use stride to fix it.
         Note: If the image is down to top, set the stride in the sw surface to negative.
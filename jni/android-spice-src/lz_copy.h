@@ -0,0 +1,112 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2011  Keqisoft,Co,Ltd,Shanghai,China
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* match copy helpers shared by the lz and glz decompressors */
+
+#ifndef _LZ_COPY_H
+#define _LZ_COPY_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz_config.h"
+
+/* Whether 8 byte loads and stores may be unaligned. Without that (eg
+ * armv5, the default android abi) memcpy of a constant size falls back
+ * to byte accesses, so only word aligned copies go wide. */
+#if defined(__i386__) || defined(__x86_64__) || defined(__aarch64__) || \
+    defined(__ARM_FEATURE_UNALIGNED)
+#define LZ_COPY_UNALIGNED
+#endif
+
+static INLINE void lz_copy_8(uint8_t *op, const uint8_t *ref)
+{
+#ifdef LZ_COPY_UNALIGNED
+    memcpy(op, ref, 8);
+#else
+    ((uint32_t *)op)[0] = ((const uint32_t *)ref)[0];
+    ((uint32_t *)op)[1] = ((const uint32_t *)ref)[1];
+#endif
+}
+
+/* Copies len bytes from ref to op, with ref at least 8 bytes behind op
+ * or in another buffer, so that each 8 bytes read are already final.
+ * Never writes past op + len. */
+static INLINE void lz_copy_wide(uint8_t *op, const uint8_t *ref, size_t len)
+{
+#ifndef LZ_COPY_UNALIGNED
+    if ((((uintptr_t)op | (uintptr_t)ref) & 3) != 0) {
+        while (len--) {
+            *op++ = *ref++;
+        }
+        return;
+    }
+#endif
+    while (len >= 16) {
+        lz_copy_8(op, ref);
+        lz_copy_8(op + 8, ref + 8);
+        op += 16;
+        ref += 16;
+        len -= 16;
+    }
+    if (len >= 8) {
+        lz_copy_8(op, ref);
+        op += 8;
+        ref += 8;
+        len -= 8;
+    }
+    while (len--) {
+        *op++ = *ref++;
+    }
+}
+
+/* Copies a match from a buffer other than the output, eg a previous glz
+ * image */
+static INLINE void lz_copy_match_far(uint8_t *op, const uint8_t *ref, size_t len)
+{
+    if (len >= 64) {
+        memcpy(op, ref, len);
+    } else {
+        lz_copy_wide(op, ref, len);
+    }
+}
+
+/* Copies a match from earlier in the output, ref < op. When they overlap
+ * the result is the same as copying a byte at a time, ie the last
+ * op - ref bytes repeat. */
+static INLINE void lz_copy_match(uint8_t *op, const uint8_t *ref, size_t len)
+{
+    size_t dist = op - ref;
+    size_t period, n;
+
+    if (dist < 8) {
+        /* write the first multiple of the period that is at least 8 bytes
+           one at a time, after which the pattern repeats at that larger
+           distance */
+        for (period = dist; period < 8; period += dist);
+        n = len < period ? len : period;
+        len -= n;
+        while (n--) {
+            *op++ = *ref++;
+        }
+        ref = op - period;
+    }
+    lz_copy_wide(op, ref, len);
+}
+
+#endif
@@ -44,9 +44,10 @@
 
 */
 
-// External defines: PLT, RGBX/PLTXX/ALPHA, TO_RGB32.
-// If PLT4/1 and TO_RGB32 are defined, we need CAST_PLT_DISTANCE (because then the number of
-// pixels differ from the units used in the compression)
+// External defines: PLT, RGBX/PLTXX/ALPHA, TO_RGB32/TO_RGB16.
+// If PLT4/1 and TO_RGB32/TO_RGB16 are defined, we need CAST_PLT_DISTANCE (because then the
+// number of pixels differ from the units used in the compression)
+// TO_RGB16 is x1r5g5b5, converted while decoding for 16 bpp canvases.
 
 /*
     For each output pixel type the following macros are defined:
@@ -65,13 +66,24 @@
 #endif
 
 
+#if defined(TO_RGB32) || defined(TO_RGB16)
+#define TO_RGB
+#endif
+
 // decompressing plt to plt
 #ifdef LZ_PLT
-#ifndef TO_RGB32
+#ifndef TO_RGB
 #define OUT_PIXEL one_byte_pixel_t
 #define FNAME(name) lz_plt_##name
 #define COPY_COMP_PIXEL(encoder, out) {out->a = decode(encoder); out++;}
-#else // TO_RGB32
+#else // TO_RGB
+#ifdef TO_RGB16
+#define OUT_PIXEL rgb16_pixel_t
+#define COPY_PLT_ENTRY(ent, out) {                                                  \
+    *(out) = ((ent >> 9) & 0x7c00) | ((ent >> 6) & 0x03e0) | ((ent >> 3) & 0x1f);  \
+}
+#define PLT_FNAME(plt, name) lz_##plt##_to_rgb16_##name
+#else
 #define OUT_PIXEL rgb32_pixel_t
 #define COPY_PLT_ENTRY(ent, out) {    \
     (out)->b = ent;                   \
@@ -79,14 +91,16 @@
     (out)->r = (ent >> 16);           \
     (out)->pad = 0;                   \
 }
+#define PLT_FNAME(plt, name) lz_##plt##_to_rgb32_##name
+#endif
 #ifdef PLT8
-#define FNAME(name) lz_plt8_to_rgb32_##name
+#define FNAME(name) PLT_FNAME(plt8, name)
 #define COPY_COMP_PIXEL(encoder, out) {                     \
     uint32_t rgb = encoder->palette->ents[decode(encoder)]; \
     COPY_PLT_ENTRY(rgb, out);                               \
     out++;}
 #elif defined(PLT4_BE)
-#define FNAME(name) lz_plt4_be_to_rgb32_##name
+#define FNAME(name) PLT_FNAME(plt4_be, name)
 #define COPY_COMP_PIXEL(encoder, out){                                                             \
     uint8_t byte = decode(encoder);                                                                \
     uint32_t rgb = encoder->palette->ents[((byte >> 4) & 0x0f) % (encoder->palette->num_ents)];    \
@@ -98,7 +112,7 @@
 }
 #define CAST_PLT_DISTANCE(dist) (dist*2)
 #elif  defined(PLT4_LE)
-#define FNAME(name) lz_plt4_le_to_rgb32_##name
+#define FNAME(name) PLT_FNAME(plt4_le, name)
 #define COPY_COMP_PIXEL(encoder, out){                                                      \
     uint8_t byte = decode(encoder);                                                         \
     uint32_t rgb = encoder->palette->ents[(byte & 0x0f) % (encoder->palette->num_ents)];    \
@@ -110,7 +124,7 @@
 }
 #define CAST_PLT_DISTANCE(dist) (dist*2)
 #elif defined(PLT1_BE) // TODO store palette entries for direct access
-#define FNAME(name) lz_plt1_be_to_rgb32_##name
+#define FNAME(name) PLT_FNAME(plt1_be, name)
 #define COPY_COMP_PIXEL(encoder, out){                                    \
     uint8_t byte = decode(encoder);                                       \
     int i;                                                                \
@@ -128,7 +142,7 @@
 }
 #define CAST_PLT_DISTANCE(dist) (dist*8)
 #elif defined(PLT1_LE)
-#define FNAME(name) lz_plt1_le_to_rgb32_##name
+#define FNAME(name) PLT_FNAME(plt1_le, name)
 #define COPY_COMP_PIXEL(encoder, out){                                    \
     uint8_t byte = decode(encoder);                                       \
     int i;                                                                \
@@ -146,7 +160,7 @@
 }
 #define CAST_PLT_DISTANCE(dist) (dist*8)
 #endif // PLT Type
-#endif // TO_RGB32
+#endif // TO_RGB
 #endif
 
 #ifdef LZ_RGB16
@@ -177,6 +191,7 @@
 #endif
 
 #ifdef LZ_RGB32
+#ifndef TO_RGB16
 #define OUT_PIXEL rgb32_pixel_t
 #define FNAME(name) lz_rgb32_##name
 #define COPY_COMP_PIXEL(e, out) {   \
@@ -186,6 +201,17 @@
     out->pad = 0;                   \
     out++;                          \
 }
+#else
+#define OUT_PIXEL rgb16_pixel_t
+#define FNAME(name) lz_rgb32_to_rgb16_##name
+#define COPY_COMP_PIXEL(e, out) {                           \
+    uint32_t b = decode(e);                                 \
+    uint32_t g = decode(e);                                 \
+    uint32_t r = decode(e);                                 \
+    *out = ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);   \
+    out++;                                                  \
+}
+#endif
 #endif
 
 #ifdef LZ_RGB_ALPHA
@@ -242,7 +268,7 @@ static size_t FNAME(decompress)(Encoder *encoder, OUT_PIXEL *out_buf, int size)
 #endif
             ofs += 1; // offset is biased by 1       (fixing bias)
 
-#if defined(TO_RGB32)
+#if defined(TO_RGB)
 #if defined(PLT4_BE) || defined(PLT4_LE) || defined(PLT1_BE) || defined(PLT1_LE)
             ofs = CAST_PLT_DISTANCE(ofs);
             len = CAST_PLT_DISTANCE(len);
@@ -259,6 +285,11 @@ static size_t FNAME(decompress)(Encoder *encoder, OUT_PIXEL *out_buf, int size)
 
             /* copying the match*/
 
+#ifndef LZ_RGB_ALPHA
+            /* whole pixels, runs and overlapping matches included */
+            lz_copy_match((uint8_t *)op, (const uint8_t *)ref, len * sizeof(OUT_PIXEL));
+            op += len;
+#else
             if (ref == (op - 1)) { // run // TODO: this will never be called in PLT4/1_TO_RGB
                                           //       because the number of pixel copied is larger
                                           //       then one...
@@ -274,10 +305,11 @@ static size_t FNAME(decompress)(Encoder *encoder, OUT_PIXEL *out_buf, int size)
                     ASSERT(encoder->usr, op <= op_limit);
                 }
             }
+#endif
         } else { // copy
             ctrl++; // copy count is biased by 1
-#if defined(TO_RGB32) && (defined(PLT4_BE) || defined(PLT4_LE) || defined(PLT1_BE) || \
-                                                                                   defined(PLT1_LE))
+#if defined(TO_RGB) && (defined(PLT4_BE) || defined(PLT4_LE) || defined(PLT1_BE) || \
+                                                                                 defined(PLT1_LE))
             ASSERT(encoder->usr, op + CAST_PLT_DISTANCE(ctrl) <= op_limit);
 #else
             ASSERT(encoder->usr, op + ctrl <= op_limit);
@@ -313,11 +345,14 @@ static size_t FNAME(decompress)(Encoder *encoder, OUT_PIXEL *out_buf, int size)
 #undef LZ_RGB32
 #undef LZ_RGB_ALPHA
 #undef TO_RGB32
+#undef TO_RGB16
+#undef TO_RGB
 #undef OUT_PIXEL
 #undef FNAME
 #undef COPY_PIXEL
 #undef COPY_REF_PIXEL
 #undef COPY_COMP_PIXEL
 #undef COPY_PLT_ENTRY
+#undef PLT_FNAME
 #undef CAST_PLT_DISTANCE
 
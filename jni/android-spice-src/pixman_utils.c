@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdio.h>
 #include "mem.h"
+#include "rop_simd.h"
 
 #ifndef ASSERT
 #define ASSERT(x) if (!(x)) {                               \
@@ -184,6 +185,423 @@ ROP_TABLE(uint8_t, 8)
 ROP_TABLE(uint16_t, 16)
 ROP_TABLE(uint32_t, 32)
 
+/* Copies the pixels of src whose rgb isn't key, key being rgb only */
+static void colorkey_32(uint32_t *dest, const uint32_t *src, int len, uint32_t key)
+{
+    for (; len > 0; len--, src++, dest++) {
+        if ((*src & 0xffffff) != key) {
+            *dest = *src;
+        }
+    }
+}
+
+#ifdef ROP_SIMD
+/* Scalar blending, for the pixels left over by the simd kernels. Without
+ * simd pixman does the blending itself. */
+
+/* x * a / 255 for each byte of x, rounded the way pixman does */
+static inline uint32_t blend_mul_un8x4(uint32_t x, uint32_t a)
+{
+    uint32_t rb, ag;
+
+    rb = (x & 0x00ff00ff) * a + 0x00800080;
+    rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+    ag = ((x >> 8) & 0x00ff00ff) * a + 0x00800080;
+    ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+    return rb | ag;
+}
+
+/* x + y for each byte, saturated */
+static inline uint32_t blend_add_un8x4(uint32_t x, uint32_t y)
+{
+    uint32_t rb, ag;
+
+    rb = (x & 0x00ff00ff) + (y & 0x00ff00ff);
+    rb |= 0x01000100 - ((rb >> 8) & 0x00010001);
+    ag = ((x >> 8) & 0x00ff00ff) + ((y >> 8) & 0x00ff00ff);
+    ag |= 0x01000100 - ((ag >> 8) & 0x00010001);
+    return (rb & 0x00ff00ff) | ((ag & 0x00ff00ff) << 8);
+}
+
+/* OVER of premultiplied argb src, times alpha, onto dest. src_or sets the
+ * alpha of sources without one and dest_and clears it in destinations
+ * without one, the results match pixman's exactly. */
+static void blend_over_32(uint32_t *dest, const uint32_t *src, int len,
+                          uint32_t src_or, uint32_t dest_and, uint32_t alpha)
+{
+    uint32_t s;
+
+    for (; len > 0; len--, src++, dest++) {
+        s = *src | src_or;
+        if (alpha != 0xff) {
+            s = blend_mul_un8x4(s, alpha);
+        }
+        *dest = blend_add_un8x4(blend_mul_un8x4(*dest, 0xff - (s >> 24)), s) & dest_and;
+    }
+}
+#endif
+
+typedef void (*colorkey_32_func_t)(uint32_t *dest, const uint32_t *src, int len, uint32_t key);
+typedef void (*blend_over_32_func_t)(uint32_t *dest, const uint32_t *src, int len,
+                                     uint32_t src_or, uint32_t dest_and, uint32_t alpha);
+
+static colorkey_32_func_t colorkey_32_func = colorkey_32;
+/* there's no point in replacing pixman's own blending with the scalar
+   loop, this is only set once the simd one can be used */
+static blend_over_32_func_t blend_over_32_func = NULL;
+
+/* SIMD versions of the raster ops, swapped into the tables above by
+ * spice_pixman_rop_init() when the cpu has the instructions. The vector
+ * kernels are in pixman_utils_simd.c, whatever doesn't fill a whole
+ * vector is left to the scalar functions. */
+#ifdef ROP_SIMD
+
+/* tiles narrower than this are left to the scalar loop, the vector one
+ * would only ever see a few bytes per call */
+#define ROP_SIMD_MIN_TILE_BYTES 32
+
+/* the pixel repeated to fill 32 bits */
+#define ROP_SIMD_PATTERN_8(src) ((uint32_t)(src) * 0x01010101)
+#define ROP_SIMD_PATTERN_16(src) ((uint32_t)(src) * 0x00010001)
+#define ROP_SIMD_PATTERN_32(src) ((uint32_t)(src))
+
+#define SIMD_RASTER_OP_SIZE(_name, _size, _type)                        \
+static void solid_rop_ ## _name ## _ ## _size ## _simd(_type *ptr, int len, _type src) \
+{                                                                       \
+    int done = solid_rop_simd_ ## _name((uint8_t *)ptr, len * sizeof(_type), \
+                                        ROP_SIMD_PATTERN_ ## _size(src)) / sizeof(_type); \
+    solid_rop_ ## _name ## _ ## _size(ptr + done, len - done, src);     \
+}                                                                       \
+                                                                        \
+static void copy_rop_ ## _name ## _ ## _size ## _simd(_type *ptr, _type *src_line, int len) \
+{                                                                       \
+    int done = 0;                                                       \
+                                                                        \
+    /* a vector at a time differs from a pixel at a time when the      \
+       destination overlaps the source from above */                    \
+    if (ptr <= src_line || ptr >= src_line + len) {                     \
+        done = copy_rop_simd_ ## _name((uint8_t *)ptr, (uint8_t *)src_line, \
+                                       len * sizeof(_type)) / sizeof(_type); \
+    }                                                                   \
+    copy_rop_ ## _name ## _ ## _size(ptr + done, src_line + done, len - done); \
+}                                                                       \
+                                                                        \
+static void tiled_rop_ ## _name ## _ ## _size ## _simd(_type *ptr, int len, _type *tile, \
+                                                       _type *tile_end, int tile_width) \
+{                                                                       \
+    int n;                                                              \
+                                                                        \
+    if (tile_width * sizeof(_type) < ROP_SIMD_MIN_TILE_BYTES) {         \
+        tiled_rop_ ## _name ## _ ## _size(ptr, len, tile, tile_end, tile_width); \
+        return;                                                         \
+    }                                                                   \
+    while (len > 0) {                                                   \
+        n = MIN(len, tile_end - tile);                                  \
+        copy_rop_ ## _name ## _ ## _size ## _simd(ptr, tile, n);        \
+        ptr += n;                                                       \
+        len -= n;                                                       \
+        tile = tile_end - tile_width;                                   \
+    }                                                                   \
+}
+
+#define SIMD_RASTER_OP(_name, _equation)        \
+    SIMD_RASTER_OP_SIZE(_name, 8, uint8_t)      \
+    SIMD_RASTER_OP_SIZE(_name, 16, uint16_t)    \
+    SIMD_RASTER_OP_SIZE(_name, 32, uint32_t)
+
+ROP_SIMD_OPS(SIMD_RASTER_OP)
+
+#define ROP_SIMD_TABLE(_kind, _type, _size)             \
+static const _kind ## _rop_ ## _size ## _func_t _kind ## _rops_simd_ ## _size[16] = { \
+    _kind ## _rop_clear_ ## _size ## _simd,             \
+    _kind ## _rop_and_ ## _size ## _simd,               \
+    _kind ## _rop_and_reverse_ ## _size ## _simd,       \
+    _kind ## _rop_copy_ ## _size ## _simd,              \
+    _kind ## _rop_and_inverted_ ## _size ## _simd,      \
+    _kind ## _rop_noop_ ## _size ## _simd,              \
+    _kind ## _rop_xor_ ## _size ## _simd,               \
+    _kind ## _rop_or_ ## _size ## _simd,                \
+    _kind ## _rop_nor_ ## _size ## _simd,               \
+    _kind ## _rop_equiv_ ## _size ## _simd,             \
+    _kind ## _rop_invert_ ## _size ## _simd,            \
+    _kind ## _rop_or_reverse_ ## _size ## _simd,        \
+    _kind ## _rop_copy_inverted_ ## _size ## _simd,     \
+    _kind ## _rop_or_inverted_ ## _size ## _simd,       \
+    _kind ## _rop_nand_ ## _size ## _simd,              \
+    _kind ## _rop_set_ ## _size ## _simd                \
+};
+
+ROP_SIMD_TABLE(solid, uint8_t, 8)
+ROP_SIMD_TABLE(solid, uint16_t, 16)
+ROP_SIMD_TABLE(solid, uint32_t, 32)
+ROP_SIMD_TABLE(tiled, uint8_t, 8)
+ROP_SIMD_TABLE(tiled, uint16_t, 16)
+ROP_SIMD_TABLE(tiled, uint32_t, 32)
+ROP_SIMD_TABLE(copy, uint8_t, 8)
+ROP_SIMD_TABLE(copy, uint16_t, 16)
+ROP_SIMD_TABLE(copy, uint32_t, 32)
+
+static void colorkey_32_simd(uint32_t *dest, const uint32_t *src, int len, uint32_t key)
+{
+    int done = colorkey_simd_32(dest, src, len, key);
+    colorkey_32(dest + done, src + done, len - done, key);
+}
+
+static void blend_over_32_simd(uint32_t *dest, const uint32_t *src, int len,
+                               uint32_t src_or, uint32_t dest_and, uint32_t alpha)
+{
+    int done = blend_over_simd_32(dest, src, len, src_or, dest_and, alpha);
+    blend_over_32(dest + done, src + done, len - done, src_or, dest_and, alpha);
+}
+
+#if defined(__SSE2__)
+#include <cpuid.h>
+
+int rop_simd_supported(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (edx & bit_SSE2) != 0;
+}
+#elif defined(__aarch64__)
+int rop_simd_supported(void)
+{
+    return 1;
+}
+#else
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+
+/* NEON is optional on armv7, ask the kernel the same way pixman does */
+int rop_simd_supported(void)
+{
+    Elf32_auxv_t aux;
+    int fd, neon = 0;
+
+    fd = open("/proc/self/auxv", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    while (read(fd, &aux, sizeof(aux)) == sizeof(aux)) {
+        if (aux.a_type == AT_HWCAP) {
+            neon = (aux.a_un.a_val & HWCAP_NEON) != 0;
+            break;
+        }
+    }
+    close(fd);
+    return neon;
+}
+#endif
+
+#ifdef PIXMAN_ROP_SELF_TEST
+#include <time.h>
+
+#define ROP_TEST_PIXELS 1024
+
+static double rop_test_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void rop_test_fill_random(uint8_t *buf, int bytes)
+{
+    while (bytes--) {
+        *(buf++) = rand();
+    }
+}
+
+/* Runs every simd op next to its scalar twin on random data, over all
+ * lengths and alignments up to a few vectors, then times both */
+#define ROP_SELF_TEST(_type, _size)                                             \
+static void rop_self_test_ ## _size(void)                                       \
+{                                                                               \
+    _type *dst_a = spice_new(_type, ROP_TEST_PIXELS + 16);                      \
+    _type *dst_b = spice_new(_type, ROP_TEST_PIXELS + 16);                      \
+    _type *src = spice_new(_type, ROP_TEST_PIXELS + 16);                        \
+    int rop, off, len, i, tile_width;                                           \
+    double t, scalar, simd;                                                     \
+                                                                                \
+    for (rop = 0; rop < 16; rop++) {                                            \
+        for (off = 0; off < 16; off++) {                                        \
+            for (len = 0; len < 80; len++) {                                    \
+                _type value = rand();                                           \
+                rop_test_fill_random((uint8_t *)src, sizeof(_type) * (ROP_TEST_PIXELS + 16)); \
+                rop_test_fill_random((uint8_t *)dst_a, sizeof(_type) * (ROP_TEST_PIXELS + 16)); \
+                memcpy(dst_b, dst_a, sizeof(_type) * (ROP_TEST_PIXELS + 16));   \
+                solid_rops_ ## _size[rop](dst_a + off, len, value);             \
+                solid_rops_simd_ ## _size[rop](dst_b + off, len, value);        \
+                copy_rops_ ## _size[rop](dst_a + off, src + 3, len);            \
+                copy_rops_simd_ ## _size[rop](dst_b + off, src + 3, len);       \
+                tile_width = 1 + len % 40;                                      \
+                tiled_rops_ ## _size[rop](dst_a + off, len * 4,                 \
+                                          src + 1 + off % tile_width,           \
+                                          src + 1 + tile_width, tile_width);    \
+                tiled_rops_simd_ ## _size[rop](dst_b + off, len * 4,            \
+                                               src + 1 + off % tile_width,      \
+                                               src + 1 + tile_width, tile_width); \
+                if (memcmp(dst_a, dst_b, sizeof(_type) * (ROP_TEST_PIXELS + 16))) { \
+                    printf("%s: rop %d, offset %d, len %d: mismatch\n",         \
+                           __FUNCTION__, rop, off, len);                        \
+                    abort();                                                    \
+                }                                                               \
+            }                                                                   \
+        }                                                                       \
+    }                                                                           \
+                                                                                \
+    for (rop = 0; rop < 16; rop++) {                                            \
+        t = rop_test_now();                                                     \
+        for (i = 0; i < 1000; i++) {                                            \
+            copy_rops_ ## _size[rop](dst_a, src, ROP_TEST_PIXELS);              \
+        }                                                                       \
+        scalar = rop_test_now() - t;                                            \
+        t = rop_test_now();                                                     \
+        for (i = 0; i < 1000; i++) {                                            \
+            copy_rops_simd_ ## _size[rop](dst_a, src, ROP_TEST_PIXELS);         \
+        }                                                                       \
+        simd = rop_test_now() - t;                                              \
+        printf("%s: rop %2d: scalar %7.1f MB/s, simd %7.1f MB/s\n",             \
+               __FUNCTION__, rop,                                               \
+               1000.0 * sizeof(_type) * ROP_TEST_PIXELS / scalar / 1e6,         \
+               1000.0 * sizeof(_type) * ROP_TEST_PIXELS / simd / 1e6);          \
+    }                                                                           \
+                                                                                \
+    free(dst_a);                                                                \
+    free(dst_b);                                                                \
+    free(src);                                                                  \
+}
+
+ROP_SELF_TEST(uint8_t, 8)
+ROP_SELF_TEST(uint16_t, 16)
+ROP_SELF_TEST(uint32_t, 32)
+
+/* Same for the colorkey and blend kernels, with keys matching about a
+ * quarter of the pixels and every kind of alpha */
+static void blend_self_test(void)
+{
+    uint32_t *dst_a = spice_new(uint32_t, ROP_TEST_PIXELS + 16);
+    uint32_t *dst_b = spice_new(uint32_t, ROP_TEST_PIXELS + 16);
+    uint32_t *src = spice_new(uint32_t, ROP_TEST_PIXELS + 16);
+    static const uint32_t alphas[] = { 0xff, 0x80, 0x01, 0 };
+    int off, len, i, a, opaque;
+    double t, scalar, simd;
+
+    for (off = 0; off < 16; off++) {
+        for (len = 0; len < 80; len++) {
+            for (a = 0; a < 4; a++) {
+                rop_test_fill_random((uint8_t *)src, 4 * (ROP_TEST_PIXELS + 16));
+                rop_test_fill_random((uint8_t *)dst_a, 4 * (ROP_TEST_PIXELS + 16));
+                for (i = 0; i < ROP_TEST_PIXELS + 16; i++) {
+                    if (rand() % 4 == 0) {
+                        src[i] = (src[i] & 0xff000000) | 0x123456;
+                    }
+                }
+                memcpy(dst_b, dst_a, 4 * (ROP_TEST_PIXELS + 16));
+                colorkey_32(dst_a + off, src + 3, len, 0x123456);
+                colorkey_32_simd(dst_b + off, src + 3, len, 0x123456);
+                opaque = a & 1;
+                blend_over_32(dst_a + off, src + 3, len, opaque ? 0xff000000 : 0,
+                              opaque ? 0x00ffffff : 0xffffffff, alphas[a]);
+                blend_over_32_simd(dst_b + off, src + 3, len, opaque ? 0xff000000 : 0,
+                                   opaque ? 0x00ffffff : 0xffffffff, alphas[a]);
+                if (memcmp(dst_a, dst_b, 4 * (ROP_TEST_PIXELS + 16))) {
+                    printf("%s: offset %d, len %d, alpha %u: mismatch\n",
+                           __FUNCTION__, off, len, alphas[a]);
+                    abort();
+                }
+            }
+        }
+    }
+
+    t = rop_test_now();
+    for (i = 0; i < 1000; i++) {
+        colorkey_32(dst_a, src, ROP_TEST_PIXELS, 0x123456);
+    }
+    scalar = rop_test_now() - t;
+    t = rop_test_now();
+    for (i = 0; i < 1000; i++) {
+        colorkey_32_simd(dst_a, src, ROP_TEST_PIXELS, 0x123456);
+    }
+    simd = rop_test_now() - t;
+    printf("%s: colorkey: scalar %7.1f MB/s, simd %7.1f MB/s\n", __FUNCTION__,
+           4000.0 * ROP_TEST_PIXELS / scalar / 1e6, 4000.0 * ROP_TEST_PIXELS / simd / 1e6);
+
+    for (a = 0; a < 2; a++) {
+        t = rop_test_now();
+        for (i = 0; i < 1000; i++) {
+            blend_over_32(dst_a, src, ROP_TEST_PIXELS, 0, 0xffffffff, alphas[a]);
+        }
+        scalar = rop_test_now() - t;
+        t = rop_test_now();
+        for (i = 0; i < 1000; i++) {
+            blend_over_32_simd(dst_a, src, ROP_TEST_PIXELS, 0, 0xffffffff, alphas[a]);
+        }
+        simd = rop_test_now() - t;
+        printf("%s: over, alpha 0x%02x: scalar %7.1f MB/s, simd %7.1f MB/s\n",
+               __FUNCTION__, alphas[a],
+               4000.0 * ROP_TEST_PIXELS / scalar / 1e6, 4000.0 * ROP_TEST_PIXELS / simd / 1e6);
+    }
+
+    free(dst_a);
+    free(dst_b);
+    free(src);
+}
+
+#endif
+
+#endif /* ROP_SIMD */
+
+/* Switches the raster op tables to the simd functions when the cpu runs
+ * them, there's no going back. Not thread safe, call it once before any
+ * drawing. */
+void spice_pixman_rop_init(void)
+{
+#ifdef ROP_SIMD
+    static int need_init = 1;
+    int i;
+
+    if (!need_init) {
+        return;
+    }
+    need_init = 0;
+
+    if (!rop_simd_supported()) {
+        return;
+    }
+
+#ifdef PIXMAN_ROP_SELF_TEST
+    rop_self_test_8();
+    rop_self_test_16();
+    rop_self_test_32();
+    blend_self_test();
+#endif
+
+    for (i = 0; i < 16; i++) {
+        solid_rops_8[i] = solid_rops_simd_8[i];
+        solid_rops_16[i] = solid_rops_simd_16[i];
+        solid_rops_32[i] = solid_rops_simd_32[i];
+        tiled_rops_8[i] = tiled_rops_simd_8[i];
+        tiled_rops_16[i] = tiled_rops_simd_16[i];
+        tiled_rops_32[i] = tiled_rops_simd_32[i];
+        copy_rops_8[i] = copy_rops_simd_8[i];
+        copy_rops_16[i] = copy_rops_simd_16[i];
+        copy_rops_32[i] = copy_rops_simd_32[i];
+    }
+    colorkey_32_func = colorkey_32_simd;
+    blend_over_32_func = blend_over_32_simd;
+#endif
+}
+
 /* We can't get the real bits per pixel info from pixman_image_t,
    only the DEPTH which is the sum of all a+r+g+b bits, which
    is e.g. 24 for 32bit xRGB. We really want the bpp, so
@@ -825,18 +1243,8 @@ void spice_pixman_blit_colorkey (pixman_image_t *dest,
         src_line = ((uint8_t *)src_bits) + src_stride * src_y + src_x * 4;
 
         while (height--) {
-            uint32_t *d = (uint32_t *)byte_line;
-            uint32_t *s = (uint32_t *)byte_line;
-
-            transparent_color &= 0xffffff;
-            s = (uint32_t *)src_line;
-            for (x = 0; x < width; x++) {
-                uint32_t val = *s;
-                if ((0xffffff & val) != transparent_color) {
-                    *d = val;
-                }
-                s++; d++;
-            }
+            colorkey_32_func((uint32_t *)byte_line, (uint32_t *)src_line, width,
+                             transparent_color & 0xffffff);
 
             byte_line += stride;
             src_line += src_stride;
@@ -844,6 +1252,85 @@ void spice_pixman_blit_colorkey (pixman_image_t *dest,
     }
 }
 
+/* Whether spice_pixman_blend_over() can draw src onto dest, faster than
+ * pixman would */
+int spice_pixman_blend_over_supported(pixman_image_t *dest, pixman_image_t *src)
+{
+    return blend_over_32_func != NULL &&
+        spice_pixman_image_get_bpp(dest) == 32 &&
+        spice_pixman_image_get_bpp(src) == 32 &&
+        pixman_image_get_data(dest) != pixman_image_get_data(src);
+}
+
+/* PIXMAN_OP_OVER of src, with its pixels scaled by overall_alpha, onto
+ * dest. Both are a8r8g8b8 or x8r8g8b8, the alpha of an x8r8g8b8 dest is
+ * written as 0. */
+void spice_pixman_blend_over(pixman_image_t *dest,
+                             pixman_image_t *src,
+                             int src_x, int src_y,
+                             int dest_x, int dest_y,
+                             int width, int height,
+                             int overall_alpha)
+{
+    uint32_t *bits, *src_bits;
+    int stride, src_stride;
+    int src_width, src_height;
+    uint32_t src_or, dest_and;
+    uint8_t *byte_line;
+    uint8_t *src_line;
+
+    ASSERT(spice_pixman_blend_over_supported(dest, src));
+
+    bits = pixman_image_get_data(dest);
+    stride = pixman_image_get_stride(dest);
+
+    src_bits = pixman_image_get_data(src);
+    src_stride = pixman_image_get_stride(src);
+    src_width = pixman_image_get_width(src);
+    src_height = pixman_image_get_height(src);
+
+    /* Clip source, pixman leaves dest as is outside of it */
+    if (src_x < 0) {
+        width += src_x;
+        dest_x -= src_x;
+        src_x = 0;
+    }
+    if (src_y < 0) {
+        height += src_y;
+        dest_y -= src_y;
+        src_y = 0;
+    }
+    if (src_x + width > src_width) {
+        width = src_width - src_x;
+    }
+    if (src_y + height > src_height) {
+        height = src_height - src_y;
+    }
+
+    if (width <= 0 || height <= 0 || overall_alpha == 0) {
+        return;
+    }
+
+    ASSERT(dest_x >= 0);
+    ASSERT(dest_y >= 0);
+    ASSERT(dest_x + width <= pixman_image_get_width(dest));
+    ASSERT(dest_y + height <= pixman_image_get_height(dest));
+
+    /* depth 24 is x8r8g8b8 */
+    src_or = pixman_image_get_depth(src) == 24 ? 0xff000000 : 0;
+    dest_and = pixman_image_get_depth(dest) == 24 ? 0x00ffffff : 0xffffffff;
+
+    byte_line = ((uint8_t *)bits) + stride * dest_y + dest_x * 4;
+    src_line = ((uint8_t *)src_bits) + src_stride * src_y + src_x * 4;
+
+    while (height--) {
+        blend_over_32_func((uint32_t *)byte_line, (uint32_t *)src_line, width,
+                           src_or, dest_and, overall_alpha);
+        byte_line += stride;
+        src_line += src_stride;
+    }
+}
+
 static void copy_bits_up(uint8_t *data, const int stride, int bpp,
                          const int src_x, const int src_y,
                          const int width, const int height,
@@ -52,6 +52,8 @@ typedef enum {
 } SpiceROP;
 
 
+void spice_pixman_rop_init(void);
+
 int spice_pixman_image_get_bpp(pixman_image_t *image);
 
 pixman_format_code_t spice_surface_format_to_pixman(uint32_t surface_format);
@@ -120,6 +122,13 @@ void spice_pixman_blit_colorkey(pixman_image_t *dest,
                                 int dest_x, int dest_y,
                                 int width, int height,
                                 uint32_t transparent_color);
+int spice_pixman_blend_over_supported(pixman_image_t *dest, pixman_image_t *src);
+void spice_pixman_blend_over(pixman_image_t *dest,
+                             pixman_image_t *src,
+                             int src_x, int src_y,
+                             int dest_x, int dest_y,
+                             int width, int height,
+                             int overall_alpha);
 void spice_pixman_copy_rect(pixman_image_t *image,
                             int src_x, int src_y,
                             int w, int h,
@@ -0,0 +1,172 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2011  Keqisoft,Co,Ltd,Shanghai,China
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* SSE2 and NEON kernels of the raster ops, colorkey and blend in
+ * pixman_utils.c. Nothing else goes in this file, it is built with NEON
+ * enabled on armv7 while the cpu may not have it. */
+
+#define ROP_SIMD_KERNELS
+#include "rop_simd.h"
+
+#ifdef ROP_SIMD
+
+#define SIMD_RASTER_OP_KERNELS(_name, _equation)                        \
+int solid_rop_simd_ ## _name(uint8_t *ptr, int bytes, uint32_t pattern) \
+{                                                                       \
+    uint8_t *start = ptr;                                               \
+    rop_vec_t src = VEC_SPLAT_32(pattern);                              \
+    rop_vec_t dst, dst2;                                                \
+                                                                        \
+    for (; bytes >= 32; bytes -= 32, ptr += 32) {                       \
+        dst = VEC_LOAD(ptr);                                            \
+        dst2 = VEC_LOAD(ptr + 16);                                      \
+        VEC_STORE(ptr, _equation);                                      \
+        dst = dst2;                                                     \
+        VEC_STORE(ptr + 16, _equation);                                 \
+    }                                                                   \
+    if (bytes >= 16) {                                                  \
+        dst = VEC_LOAD(ptr);                                            \
+        VEC_STORE(ptr, _equation);                                      \
+        ptr += 16;                                                      \
+    }                                                                   \
+    (void)src; /* avoid unused warning */                               \
+    (void)dst;                                                          \
+    return ptr - start;                                                 \
+}                                                                       \
+                                                                        \
+int copy_rop_simd_ ## _name(uint8_t *ptr, const uint8_t *src_line, int bytes) \
+{                                                                       \
+    uint8_t *start = ptr;                                               \
+    rop_vec_t src, dst;                                                 \
+                                                                        \
+    for (; bytes >= 16; bytes -= 16, ptr += 16, src_line += 16) {       \
+        src = VEC_LOAD(src_line);                                       \
+        dst = VEC_LOAD(ptr);                                            \
+        VEC_STORE(ptr, _equation);                                      \
+    }                                                                   \
+    (void)src; /* avoid unused warning */                               \
+    (void)dst;                                                          \
+    return ptr - start;                                                 \
+}
+
+ROP_SIMD_OPS(SIMD_RASTER_OP_KERNELS)
+
+int colorkey_simd_32(uint32_t *dest, const uint32_t *src, int len, uint32_t key)
+{
+    rop_vec_t rgb_mask = VEC_SPLAT_32(0xffffff);
+    rop_vec_t key_vec = VEC_SPLAT_32(key);
+    rop_vec_t s, d, transparent;
+    int done;
+
+    for (done = 0; len - done >= 4; done += 4, src += 4, dest += 4) {
+        s = VEC_LOAD(src);
+        d = VEC_LOAD(dest);
+        transparent = VEC_CMPEQ_32(VEC_AND(s, rgb_mask), key_vec);
+        VEC_STORE(dest, VEC_OR(VEC_AND(d, transparent), VEC_ANDN(s, transparent)));
+    }
+    return done;
+}
+
+/* blend_over_32 of pixman_utils.c four pixels at a time, in 16 bit
+ * lanes. The (t + 0x80 + ((t + 0x80) >> 8)) >> 8 division by 255 is
+ * pixman's. */
+#if defined(__SSE2__)
+static inline __m128i blend_div_255(__m128i t)
+{
+    t = _mm_add_epi16(t, _mm_set1_epi16(0x80));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+/* each pixel's alpha in all four of its lanes */
+static inline __m128i blend_expand_alpha(__m128i pixels)
+{
+    pixels = _mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3));
+    return _mm_shufflehi_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+int blend_over_simd_32(uint32_t *dest, const uint32_t *src, int len,
+                       uint32_t src_or, uint32_t dest_and, uint32_t alpha)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i ff = _mm_set1_epi16(0xff);
+    __m128i alpha_vec = _mm_set1_epi16(alpha);
+    __m128i src_or_vec = _mm_set1_epi32(src_or);
+    __m128i dest_and_vec = _mm_set1_epi32(dest_and);
+    __m128i s, d, s_lo, s_hi, d_lo, d_hi;
+    int done;
+
+    for (done = 0; len - done >= 4; done += 4, src += 4, dest += 4) {
+        s = _mm_or_si128(_mm_loadu_si128((const __m128i *)src), src_or_vec);
+        d = _mm_loadu_si128((const __m128i *)dest);
+        s_lo = _mm_unpacklo_epi8(s, zero);
+        s_hi = _mm_unpackhi_epi8(s, zero);
+        if (alpha != 0xff) {
+            s_lo = blend_div_255(_mm_mullo_epi16(s_lo, alpha_vec));
+            s_hi = blend_div_255(_mm_mullo_epi16(s_hi, alpha_vec));
+            s = _mm_packus_epi16(s_lo, s_hi);
+        }
+        d_lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+                               _mm_xor_si128(blend_expand_alpha(s_lo), ff));
+        d_hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+                               _mm_xor_si128(blend_expand_alpha(s_hi), ff));
+        d = _mm_packus_epi16(blend_div_255(d_lo), blend_div_255(d_hi));
+        d = _mm_and_si128(_mm_adds_epu8(d, s), dest_and_vec);
+        _mm_storeu_si128((__m128i *)dest, d);
+    }
+    return done;
+}
+
+#else
+/* vraddhn(t, vrshr(t, 8)) is exactly the division above */
+static inline uint8x8_t blend_div_255(uint16x8_t t)
+{
+    return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+int blend_over_simd_32(uint32_t *dest, const uint32_t *src, int len,
+                       uint32_t src_or, uint32_t dest_and, uint32_t alpha)
+{
+    uint8x8_t alpha_vec = vdup_n_u8(alpha);
+    uint32x4_t src_or_vec = vdupq_n_u32(src_or);
+    uint32x4_t dest_and_vec = vdupq_n_u32(dest_and);
+    uint8x16_t s, d, inv_alpha;
+    uint16x8_t lo, hi;
+    int done;
+
+    for (done = 0; len - done >= 4; done += 4, src += 4, dest += 4) {
+        s = vreinterpretq_u8_u32(vorrq_u32(vld1q_u32(src), src_or_vec));
+        d = vld1q_u8((const uint8_t *)dest);
+        if (alpha != 0xff) {
+            lo = vmull_u8(vget_low_u8(s), alpha_vec);
+            hi = vmull_u8(vget_high_u8(s), alpha_vec);
+            s = vcombine_u8(blend_div_255(lo), blend_div_255(hi));
+        }
+        /* each pixel's alpha in all four of its bytes */
+        inv_alpha = vmvnq_u8(vreinterpretq_u8_u32(
+            vmulq_n_u32(vshrq_n_u32(vreinterpretq_u32_u8(s), 24), 0x01010101)));
+        lo = vmull_u8(vget_low_u8(d), vget_low_u8(inv_alpha));
+        hi = vmull_u8(vget_high_u8(d), vget_high_u8(inv_alpha));
+        d = vqaddq_u8(vcombine_u8(blend_div_255(lo), blend_div_255(hi)), s);
+        vst1q_u32(dest, vandq_u32(vreinterpretq_u32_u8(d), dest_and_vec));
+    }
+    return done;
+}
+
+#endif
+
+#endif /* ROP_SIMD */
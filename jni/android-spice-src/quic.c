@@ -32,6 +32,14 @@
 //#define RLE_PRED_3
 #define QUIC_RGB
 
+/* On 64 bit cpus the decoder keeps a 64 bit reservoir of input bits behind
+ * io_word, which is refilled a whole word at a time and only has to be
+ * looked at once per eaten symbol. 64 bit shifts are too costly on 32 bit
+ * arm, which keeps reading one word ahead. */
+#if defined(__LP64__) || defined(_WIN64)
+#define QUIC_WIDE_BITS
+#endif
+
 #define QUIC_MAGIC (*(uint32_t *)"QUIC")
 #define QUIC_VERSION_MAJOR 0U
 #define QUIC_VERSION_MINOR 1U
@@ -92,8 +100,51 @@ typedef struct QuicFamily {
     unsigned int xlatL2U[256];
 } QuicFamily;
 
-static QuicFamily family_8bpc;
-static QuicFamily family_5bpc;
+/* The family tables only depend on bpc and on DEFmaxclen (26), so they are
+ * computed by the compiler and live in read only data instead of being
+ * built by quic_init(). */
+
+#define QUIC_REPEAT_4(f, bpc_mask, s) \
+    f(bpc_mask, (s)) f(bpc_mask, (s) + 1) f(bpc_mask, (s) + 2) f(bpc_mask, (s) + 3)
+#define QUIC_REPEAT_16(f, bpc_mask, s)                                      \
+    QUIC_REPEAT_4(f, bpc_mask, (s)) QUIC_REPEAT_4(f, bpc_mask, (s) + 4)     \
+    QUIC_REPEAT_4(f, bpc_mask, (s) + 8) QUIC_REPEAT_4(f, bpc_mask, (s) + 12)
+#define QUIC_REPEAT_64(f, bpc_mask, s)                                        \
+    QUIC_REPEAT_16(f, bpc_mask, (s)) QUIC_REPEAT_16(f, bpc_mask, (s) + 16)    \
+    QUIC_REPEAT_16(f, bpc_mask, (s) + 32) QUIC_REPEAT_16(f, bpc_mask, (s) + 48)
+#define QUIC_REPEAT_256(f, bpc_mask)                                \
+    QUIC_REPEAT_64(f, bpc_mask, 0) QUIC_REPEAT_64(f, bpc_mask, 64)  \
+    QUIC_REPEAT_64(f, bpc_mask, 128) QUIC_REPEAT_64(f, bpc_mask, 192)
+
+/* translating distribution U to L and back, 0 past the depth */
+#define XLAT_U2L(bpc_mask, s)                                 \
+    ((s) > (bpc_mask) ? 0 :                                   \
+     (s) <= ((bpc_mask) >> 1) ? (s) << 1 : (((bpc_mask) - (s)) << 1) + 1),
+#define XLAT_L2U(bpc_mask, s)                                 \
+    ((s) > (bpc_mask) ? 0 :                                   \
+     ((s) & 0x01) ? (bpc_mask) - ((s) >> 1) : (s) >> 1),
+
+static const QuicFamily family_8bpc = {
+    .nGRcodewords = { 18, 36, 72, 144, 240, 224, 192, 128 },
+    .notGRcwlen = { 26, 26, 26, 25, 19, 12, 9, 8 },
+    .notGRprefixmask = { 0x00003fff, 0x00003fff, 0x00003fff, 0x00003fff,
+                         0x0001ffff, 0x01ffffff, 0x1fffffff, 0x7fffffff },
+    .notGRsuffixlen = { 8, 8, 8, 7, 4, 5, 6, 7 },
+    .xlatU2L = { QUIC_REPEAT_256(XLAT_U2L, 0xffU) },
+    .xlatL2U = { QUIC_REPEAT_256(XLAT_L2U, 0xffU) },
+};
+
+static const QuicFamily family_5bpc = {
+    .nGRcodewords = { 21, 30, 28, 24, 16 },
+    .notGRcwlen = { 25, 16, 9, 6, 5 },
+    .notGRprefixmask = { 0x000007ff, 0x0001ffff, 0x01ffffff, 0x1fffffff, 0x7fffffff },
+    .notGRsuffixlen = { 4, 1, 2, 3, 4 },
+    .xlatU2L = { QUIC_REPEAT_256(XLAT_U2L, 0x1fU) },
+    .xlatL2U = { QUIC_REPEAT_256(XLAT_L2U, 0x1fU) },
+};
+
+#undef XLAT_U2L
+#undef XLAT_L2U
 
 typedef unsigned COUNTER;   /* counter in the array of counters in bucket of the data model */
 
@@ -162,13 +213,21 @@ struct Encoder {
 
     unsigned int io_available_bits;
     uint32_t io_word;
+#ifdef QUIC_WIDE_BITS
+    uint64_t io_bits;       /* decoding: the bits after io_word, msb first */
+#else
     uint32_t io_next_word;
+#endif
     uint32_t *io_now;
     uint32_t *io_end;
     uint32_t io_words_count;
 
     int rows_completed;
 
+    /* decoding rgb to rgb16: the last two rows at full depth */
+    uint8_t *conv_rows;
+    unsigned int conv_rows_width;
+
     Channel channels[MAX_CHANNELS];
 
     CommonState rgb_state;
@@ -282,25 +341,7 @@ static void set_wm_trigger(CommonState *state)
     ASSERT(state->encoder->usr, state->wm_trigger >= 1);
 }
 
-static int ceil_log_2(int val) /* ceil(log_2(val)) */
-{
-    int result;
-
-    //ASSERT(val>0);
-
-    if (val == 1) {
-        return 0;
-    }
-
-    result = 1;
-    val -= 1;
-    while (val >>= 1) {
-        result++;
-    }
-
-    return result;
-}
-
+#ifndef __GNUC__
 /* number of leading zeroes in the byte, used by cntlzeroes(uint)*/
 static const BYTE lzeroes[256] = {
     8, 7, 6, 6, 5, 5, 5, 5, 4, 4, 4, 4, 4, 4, 4, 4, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
@@ -312,10 +353,14 @@ static const BYTE lzeroes[256] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
+#endif
 
-/* count leading zeroes */
-static unsigned int cnt_l_zeroes(const unsigned int bits)
+/* count leading zeroes, bits must not be 0 */
+static INLINE unsigned int cnt_l_zeroes(const unsigned int bits)
 {
+#ifdef __GNUC__
+    return __builtin_clz(bits);
+#else
     if (bits & 0xff800000) {
         return lzeroes[bits >> 24];
     } else if (bits & 0xffff8000) {
@@ -325,6 +370,7 @@ static unsigned int cnt_l_zeroes(const unsigned int bits)
     } else {
         return 24 + lzeroes[bits & 0x000000ff];
     }
+#endif
 }
 
 #define QUIC_FAMILY_8BPC
@@ -335,63 +381,6 @@ static unsigned int cnt_l_zeroes(const unsigned int bits)
 #include "quic_family_tmpl.c"
 #endif
 
-static void decorelate_init(QuicFamily *family, int bpc)
-{
-    const unsigned int pixelbitmask = bppmask[bpc];
-    const unsigned int pixelbitmaskshr = pixelbitmask >> 1;
-    unsigned int s;
-
-    //ASSERT(bpc <= 8);
-
-    for (s = 0; s <= pixelbitmask; s++) {
-        if (s <= pixelbitmaskshr) {
-            family->xlatU2L[s] = s << 1;
-        } else {
-            family->xlatU2L[s] = ((pixelbitmask - s) << 1) + 1;
-        }
-    }
-}
-
-static void corelate_init(QuicFamily *family, int bpc)
-{
-    const unsigned long int pixelbitmask = bppmask[bpc];
-    unsigned long int s;
-
-    //ASSERT(bpc <= 8);
-
-    for (s = 0; s <= pixelbitmask; s++) {
-        if (s & 0x01) {
-            family->xlatL2U[s] = pixelbitmask - (s >> 1);
-        } else {
-            family->xlatL2U[s] = (s >> 1);
-        }
-    }
-}
-
-static void family_init(QuicFamily *family, int bpc, int limit)
-{
-    int l;
-
-    for (l = 0; l < bpc; l++) { /* fill arrays indexed by code number */
-        int altprefixlen, altcodewords;
-
-        altprefixlen = limit - bpc;
-        if (altprefixlen > (int)(bppmask[bpc - l])) {
-            altprefixlen = bppmask[bpc - l];
-        }
-
-        altcodewords = bppmask[bpc] + 1 - (altprefixlen << l);
-
-        family->nGRcodewords[l] = (altprefixlen << l);
-        family->notGRcwlen[l] = altprefixlen + ceil_log_2(altcodewords);
-        family->notGRprefixmask[l] = bppmask[32 - altprefixlen]; /* needed for decoding only */
-        family->notGRsuffixlen[l] = ceil_log_2(altcodewords); /* needed for decoding only */
-    }
-
-    decorelate_init(family, bpc);
-    corelate_init(family, bpc);
-}
-
 static void more_io_words(Encoder *encoder)
 {
     uint32_t *io_ptr;
@@ -458,18 +447,67 @@ static INLINE void flush(Encoder *encoder)
     encode(encoder, 0, 1);
 }
 
-static void __read_io_word(Encoder *encoder)
+static INLINE uint32_t load_io_word(Encoder *encoder)
 {
-    more_io_words(encoder);
+    uint32_t word;
 /*
  * FIXME: This will cause SIGBUS on some ARM,some maybe avoided by '-O0'
  * while some cannot.Hence comes the stupid way.Is there any cute way?
  */
 #ifdef ANDROID
-    memcpy(&encoder->io_next_word, encoder->io_now++,sizeof(uint32_t));
+    memcpy(&word, encoder->io_now++, sizeof(uint32_t));
 #else
-    encoder->io_next_word = *(encoder->io_now++);
+    word = *(encoder->io_now++);
 #endif
+    return word;
+}
+
+#ifdef QUIC_WIDE_BITS
+
+/* appends one input word to the reservoir, io_available_bits <= 32 */
+static INLINE void append_io_word(Encoder *encoder, uint32_t word)
+{
+    encoder->io_bits |= (uint64_t)word << (32 - encoder->io_available_bits);
+    encoder->io_available_bits += 32;
+}
+
+static void __read_io_word(Encoder *encoder)
+{
+    more_io_words(encoder);
+    append_io_word(encoder, load_io_word(encoder));
+}
+
+static void (*__read_io_word_ptr)(Encoder *encoder) = __read_io_word;
+
+/* Tops the reservoir up from the current input chunk. The next chunk is
+   only asked for once its bits are actually needed, as the stream may
+   end here. */
+static INLINE void read_io_word(Encoder *encoder)
+{
+    if (encoder->io_available_bits < 32 && encoder->io_now < encoder->io_end) {
+        append_io_word(encoder, load_io_word(encoder));
+    }
+}
+
+static INLINE void decode_eatbits(Encoder *encoder, int len)
+{
+    ASSERT(encoder->usr, len > 0 && len < 32);
+
+    if (encoder->io_available_bits < (unsigned int)len) {
+        __read_io_word_ptr(encoder); //disable inline optimizations
+    }
+    encoder->io_word = (encoder->io_word << len) | (uint32_t)(encoder->io_bits >> (64 - len));
+    encoder->io_bits <<= len;
+    encoder->io_available_bits -= len;
+    read_io_word(encoder);
+}
+
+#else
+
+static void __read_io_word(Encoder *encoder)
+{
+    more_io_words(encoder);
+    encoder->io_next_word = load_io_word(encoder);
 }
 
 static void (*__read_io_word_ptr)(Encoder *encoder) = __read_io_word;
@@ -482,11 +520,7 @@ static INLINE void read_io_word(Encoder *encoder)
         return;
     }
     ASSERT(encoder->usr, encoder->io_now < encoder->io_end);
-#ifdef ANDROID
-    memcpy(&encoder->io_next_word, encoder->io_now++,sizeof(uint32_t));
-#else
-    encoder->io_next_word = *(encoder->io_now++);
-#endif
+    encoder->io_next_word = load_io_word(encoder);
 }
 
 static INLINE void decode_eatbits(Encoder *encoder, int len)
@@ -509,6 +543,8 @@ static INLINE void decode_eatbits(Encoder *encoder, int len)
     encoder->io_word |= (encoder->io_next_word >> encoder->io_available_bits);
 }
 
+#endif
+
 static INLINE void decode_eat32bits(Encoder *encoder)
 {
     decode_eatbits(encoder, 16);
@@ -534,29 +570,19 @@ static INLINE void encode_ones(Encoder *encoder, unsigned int n)
 
 #define MELCSTATES 32 /* number of melcode states */
 
-static int zeroLUT[256]; /* table to find out number of leading zeros */
-
-static int J[MELCSTATES] = {
+static const int J[MELCSTATES] = {
     0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 5, 5, 6, 6, 7,
     7, 8, 9, 10, 11, 12, 13, 14, 15
 };
 
-/* creates the bit counting look-up table. */
-static void init_zeroLUT()
+/* number of leading ones in the input stream, up to 8 */
+static INLINE int cnt_l_ones_8(uint32_t bits)
 {
-    int i, j, k, l;
-
-    j = k = 1;
-    l = 8;
-    for (i = 0; i < 256; ++i) {
-        zeroLUT[i] = l;
-        --k;
-        if (k == 0) {
-            k = j;
-            --l;
-            j *= 2;
-        }
-    }
+#ifdef __GNUC__
+    return __builtin_clz(~bits | 0x00ffffff);
+#else
+    return lzeroes[(BYTE)(~(bits >> 24))];
+#endif
 }
 
 static void encoder_init_rle(CommonState *state)
@@ -639,8 +665,7 @@ static int decode_run(Encoder *encoder)
 
     do {
         register int temp, hits;
-        temp = zeroLUT[(BYTE)(~(encoder->io_word >> 24))];/* number of leading ones in the
-                                                                      input stream, up to 8 */
+        temp = cnt_l_ones_8(encoder->io_word);
         for (hits = 1; hits <= temp; hits++) {
             runlen += encoder->rgb_state.melcorder;
 
@@ -680,8 +705,7 @@ static int decode_channel_run(Encoder *encoder, Channel *channel)
 
     do {
         register int temp, hits;
-        temp = zeroLUT[(BYTE)(~(encoder->io_word >> 24))];/* number of leading ones in the
-                                                                      input stream, up to 8 */
+        temp = cnt_l_ones_8(encoder->io_word);
         for (hits = 1; hits <= temp; hits++) {
             runlen += channel->state.melcorder;
 
@@ -771,13 +795,14 @@ static INLINE unsigned int decode_run(Encoder *encoder)
 
 static INLINE void init_decode_io(Encoder *encoder)
 {
-#ifdef ANDROID
-    memcpy(&encoder->io_word, encoder->io_now++,sizeof(uint32_t));
-    encoder->io_next_word = encoder->io_word;
+    encoder->io_word = load_io_word(encoder);
+    encoder->io_available_bits = 0;
+#ifdef QUIC_WIDE_BITS
+    encoder->io_bits = 0;
+    read_io_word(encoder);
 #else
-    encoder->io_next_word = encoder->io_word = *(encoder->io_now++);
+    encoder->io_next_word = encoder->io_word;
 #endif
-    encoder->io_available_bits = 0;
 }
 
 #ifdef __GNUC__
@@ -1098,6 +1123,8 @@ static int init_encoder(Encoder *encoder, QuicUsrContext *usr)
 
     encoder->usr = usr;
     encoder->rgb_state.encoder = encoder;
+    encoder->conv_rows = NULL;
+    encoder->conv_rows_width = 0;
 
     for (i = 0; i < MAX_CHANNELS; i++) {
         if (!init_channel(encoder, &encoder->channels[i])) {
@@ -1469,6 +1496,16 @@ static void clear_row(four_bytes_t *row, int width)
 
 #ifdef QUIC_RGB
 
+static INLINE void convert_rgb32_to_16(const rgb32_pixel_t *src, rgb16_pixel_t *dest,
+                                       unsigned int width)
+{
+    const rgb32_pixel_t *end = src + width;
+
+    for (; src < end; src++) {
+        *dest++ = ((src->r >> 3) << 10) | ((src->g >> 3) << 5) | (src->b >> 3);
+    }
+}
+
 static void uncompress_rgba(Encoder *encoder, uint8_t *buf, int stride)
 {
     unsigned int row;
@@ -1502,6 +1539,51 @@ static void uncompress_rgba(Encoder *encoder, uint8_t *buf, int stride)
     }
 }
 
+/* rgb24/rgb32 to x1r5g5b5. Each row is predicted from the previous one
+ * at full depth, so rows are decoded into a pair of 32 bpp rows and
+ * converted as soon as they are complete */
+static int uncompress_rgb32_to_16(Encoder *encoder, uint8_t *buf, int stride)
+{
+    rgb32_pixel_t *prev, *cur, *tmp;
+    unsigned int row;
+
+    if (encoder->conv_rows_width < encoder->width) {
+        encoder->conv_rows_width = 0;
+        if (encoder->conv_rows) {
+            encoder->usr->free(encoder->usr, encoder->conv_rows);
+        }
+        if (!(encoder->conv_rows = (uint8_t *)encoder->usr->malloc(encoder->usr,
+                                                    encoder->width * 2 * sizeof(rgb32_pixel_t)))) {
+            return FALSE;
+        }
+        encoder->conv_rows_width = encoder->width;
+    }
+    prev = (rgb32_pixel_t *)encoder->conv_rows;
+    cur = prev + encoder->conv_rows_width;
+
+    encoder->channels[0].correlate_row[-1] = 0;
+    encoder->channels[1].correlate_row[-1] = 0;
+    encoder->channels[2].correlate_row[-1] = 0;
+    quic_rgb32_uncompress_row0(encoder, cur, encoder->width);
+    convert_rgb32_to_16(cur, (rgb16_pixel_t *)buf, encoder->width);
+    encoder->rows_completed++;
+
+    for (row = 1; row < encoder->height; row++) {
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+        buf += stride;
+        encoder->channels[0].correlate_row[-1] = encoder->channels[0].correlate_row[0];
+        encoder->channels[1].correlate_row[-1] = encoder->channels[1].correlate_row[0];
+        encoder->channels[2].correlate_row[-1] = encoder->channels[2].correlate_row[0];
+        quic_rgb32_uncompress_row(encoder, prev, cur, encoder->width);
+        convert_rgb32_to_16(cur, (rgb16_pixel_t *)buf, encoder->width);
+        encoder->rows_completed++;
+    }
+
+    return TRUE;
+}
+
 #endif
 
 static void uncompress_gray(Encoder *encoder, uint8_t *buf, int stride)
@@ -1562,6 +1644,13 @@ int quic_decode(QuicContext *quic, QuicImageType type, uint8_t *buf, int stride)
             ASSERT(encoder->usr, ABS(stride) >= (int)encoder->width * 3);
             QUIC_UNCOMPRESS_RGB(24, rgb24_pixel_t);
             break;
+        } else if (type == QUIC_IMAGE_TYPE_RGB16) {
+            ASSERT(encoder->usr, ABS(stride) >= (int)encoder->width * 2);
+            if (!uncompress_rgb32_to_16(encoder, buf, stride)) {
+                encoder->usr->warn(encoder->usr, "out of memory\n");
+                return QUIC_ERROR;
+            }
+            break;
         }
         encoder->usr->warn(encoder->usr, "unsupported output format\n");
         return QUIC_ERROR;
@@ -1670,13 +1759,11 @@ int quic_decode(QuicContext *quic, QuicImageType type, uint8_t *buf, int stride)
     return QUIC_OK;
 }
 
-static int need_init = TRUE;
-
 QuicContext *quic_create(QuicUsrContext *usr)
 {
     Encoder *encoder;
 
-    if (!usr || need_init || !usr->error || !usr->warn || !usr->info || !usr->malloc ||
+    if (!usr || !usr->error || !usr->warn || !usr->info || !usr->malloc ||
         !usr->free || !usr->more_space || !usr->more_lines) {
         return NULL;
     }
@@ -1704,20 +1791,13 @@ void quic_destroy(QuicContext *quic)
     for (i = 0; i < MAX_CHANNELS; i++) {
         destroy_channel(&encoder->channels[i]);
     }
+    if (encoder->conv_rows) {
+        encoder->usr->free(encoder->usr, encoder->conv_rows);
+    }
     encoder->usr->free(encoder->usr, encoder);
 }
 
+/* kept for api compatibility, all tables are static */
 void quic_init()
 {
-    if (!need_init) {
-        return;
-    }
-    need_init = FALSE;
-
-    family_init(&family_8bpc, 8, DEFmaxclen);
-    family_init(&family_5bpc, 5, DEFmaxclen);
-#if defined(RLE) && defined(RLE_STAT)
-    init_zeroLUT();
-#endif
 }
-
@@ -52,6 +52,12 @@ static inline int rect_intersects(const SpiceRect* r1, const SpiceRect* r2)
            r1->top < r2->bottom && r1->bottom > r2->top;
 }
 
+static inline int rect_contains(const SpiceRect *r, const SpiceRect *other)
+{
+    return r->left <= other->left && r->right >= other->right &&
+           r->top <= other->top && r->bottom >= other->bottom;
+}
+
 static inline int rect_is_equal(const SpiceRect *r1, const SpiceRect *r2)
 {
     return r1->top == r2->top && r1->left == r2->left &&
@@ -17,8 +17,12 @@
 */
 
 #include <stdio.h>
+#include <spice/macros.h>
 
 #include "rop3.h"
+#include "rop_simd.h"
+#include "mem.h"
+#include "spice-util.h"
 
 #ifndef ASSERT
 #define ASSERT(x) if (!(x)) {                               \
@@ -27,113 +31,35 @@
 }
 #endif
 
-#ifndef WARN
-#define WARN(x) printf("warning: %s\n", x)
-#endif
-
-typedef void (*rop3_with_pattern_handler_t)(pixman_image_t *d, pixman_image_t *s,
-                                            SpicePoint *src_pos, pixman_image_t *p,
-                                            SpicePoint *pat_pos);
-
-typedef void (*rop3_with_color_handler_t)(pixman_image_t *d, pixman_image_t *s,
-                                          SpicePoint *src_pos, uint32_t rgb);
+/* A handler computes one row of the result: dest, src and pat all point
+ * at width pixels. The pattern, or the brush color, is expanded to a
+ * whole row beforehand so that handlers are plain loops over spans. */
+typedef void (*rop3_handler_t)(uint8_t *dest, uint8_t *src, uint8_t *pat, int width);
 
 typedef void (*rop3_test_handler_t)();
 
 #define ROP3_NUM_OPS 256
 
-static rop3_with_pattern_handler_t rop3_with_pattern_handlers_32[ROP3_NUM_OPS];
-static rop3_with_pattern_handler_t rop3_with_pattern_handlers_16[ROP3_NUM_OPS];
-static rop3_with_color_handler_t rop3_with_color_handlers_32[ROP3_NUM_OPS];
-static rop3_with_color_handler_t rop3_with_color_handlers_16[ROP3_NUM_OPS];
-static rop3_test_handler_t rop3_test_handlers_32[ROP3_NUM_OPS];
-static rop3_test_handler_t rop3_test_handlers_16[ROP3_NUM_OPS];
+/* rows up to this many pixels expand the pattern on the stack */
+#define ROP3_PAT_ROW_STACK_PIXELS 1024
 
+#ifdef ROP3_SELF_TEST
+/* how many times each code was drawn, logged every ROP3_USAGE_LOG_PERIOD
+ * draws to see which codes guests actually use */
+#define ROP3_USAGE_LOG_PERIOD 1024
 
-static void default_rop3_with_pattern_handler(pixman_image_t *d, pixman_image_t *s,
-                                              SpicePoint *src_pos, pixman_image_t *p,
-                                              SpicePoint *pat_pos)
-{
-    WARN("not implemented 0x%x");
-}
-
-static void default_rop3_withe_color_handler(pixman_image_t *d, pixman_image_t *s, SpicePoint *src_pos,
-                                             uint32_t rgb)
-{
-    WARN("not implemented 0x%x");
-}
+static uint32_t rop3_usage[ROP3_NUM_OPS];
+static uint32_t rop3_draws;
 
 static void default_rop3_test_handler()
 {
 }
+#endif
 
-#define ROP3_HANDLERS_DEPTH(name, formula, index, depth)                            \
-static void rop3_handle_p##depth##_##name(pixman_image_t *d, pixman_image_t *s,                 \
-                                          SpicePoint *src_pos,                                  \
-                                          pixman_image_t *p, SpicePoint *pat_pos)               \
-{                                                                                               \
-    int width = pixman_image_get_width(d);                                                      \
-    int height = pixman_image_get_height(d);                                                    \
-    uint8_t *dest_line = (uint8_t *)pixman_image_get_data(d);                                   \
-    int dest_stride = pixman_image_get_stride(d);                                               \
-    uint8_t *end_line = dest_line + height * dest_stride;                                       \
-                                                                                                \
-    int pat_width = pixman_image_get_width(p);                                                  \
-    int pat_height = pixman_image_get_height(p);                                                \
-    uint8_t *pat_base = (uint8_t *)pixman_image_get_data(p);                                    \
-    int pat_stride = pixman_image_get_stride(p);                                                \
-    int pat_v_offset = pat_pos->y;                                                              \
-                                                                                                \
-    int src_stride = pixman_image_get_stride(s);                                                \
-    uint8_t *src_line;                                                                          \
-    src_line = (uint8_t *)pixman_image_get_data(s) + src_pos->y * src_stride + (src_pos->x * depth / 8); \
-                                                                                                \
-    for (; dest_line < end_line; dest_line += dest_stride, src_line += src_stride) {            \
-        uint##depth##_t *dest = (uint##depth##_t *)dest_line;                                   \
-        uint##depth##_t *end = dest + width;                                                    \
-        uint##depth##_t *src = (uint##depth##_t *)src_line;                                     \
-                                                                                                \
-        int pat_h_offset = pat_pos->x;                                                          \
-                                                                                                \
-        for (; dest < end; dest++, src++) {                                                     \
-            uint##depth##_t *pat;                                                               \
-            pat  = (uint##depth##_t *)                                                          \
-                        (pat_base + pat_v_offset * pat_stride + (pat_h_offset * depth / 8));    \
-            *dest = formula;                                                                    \
-            pat_h_offset = (pat_h_offset + 1) % pat_width;                                      \
-        }                                                                                       \
-                                                                                                \
-        pat_v_offset = (pat_v_offset + 1) % pat_height;                                         \
-    }                                                                                           \
-}                                                                                               \
-                                                                                                \
-static void rop3_handle_c##depth##_##name(pixman_image_t *d, pixman_image_t *s,                 \
-                                          SpicePoint *src_pos,                                  \
-                                          uint32_t rgb)                                         \
-{                                                                                               \
-    int width = pixman_image_get_width(d);                                                      \
-    int height = pixman_image_get_height(d);                                                    \
-    uint8_t *dest_line = (uint8_t *)pixman_image_get_data(d);                                   \
-    int dest_stride = pixman_image_get_stride(d);                                               \
-    uint8_t *end_line = dest_line + height * dest_stride;                                       \
-    uint##depth##_t _pat = rgb;                                                                \
-    uint##depth##_t *pat = &_pat;                                                               \
-                                                                                                \
-    int src_stride = pixman_image_get_stride(s);                                                \
-    uint8_t *src_line;                                                                          \
-    src_line = (uint8_t *)                                                                      \
-        pixman_image_get_data(s) + src_pos->y * src_stride + (src_pos->x * depth / 8);          \
-                                                                                                \
-    for (; dest_line < end_line; dest_line += dest_stride, src_line += src_stride) {            \
-        uint##depth##_t *dest = (uint##depth##_t *)dest_line;                                   \
-        uint##depth##_t *end = dest + width;                                                    \
-        uint##depth##_t *src = (uint##depth##_t *)src_line;                                     \
-        for (; dest < end; dest++, src++) {                                                     \
-            *dest = formula;                                                                    \
-        }                                                                                       \
-    }                                                                                           \
-}                                                                                               \
-                                                                                                \
+/* checks at startup that each formula gives its own rop3 code, only
+ * built in when debugging the table */
+#ifdef ROP3_SELF_TEST
+#define ROP3_TEST_HANDLER(name, formula, index, depth)                                          \
 static void rop3_test##depth##_##name()                                                         \
 {                                                                                               \
     uint8_t d = 0xaa;                                                                           \
@@ -143,27 +69,56 @@ static void rop3_test##depth##_##name()
     uint8_t *src = &s;                                                                          \
     uint8_t *dest = &d;                                                                         \
                                                                                                 \
+    (void)pat; /* avoid unused warning */                                                       \
+    (void)src;                                                                                  \
+    (void)dest;                                                                                 \
     d = formula;                                                                                \
     if (d != index) {                                                                           \
         printf("%s: failed, result is 0x%x expect 0x%x\n", __FUNCTION__, d, index);             \
     }                                                                                           \
 }
+#else
+#define ROP3_TEST_HANDLER(name, formula, index, depth)
+#endif
+
+#define ROP3_HANDLERS_DEPTH(name, formula, index, depth)                                        \
+static void rop3_handle##depth##_##name(uint8_t *dest_line, uint8_t *src_line,                  \
+                                        uint8_t *pat_line, int width)                           \
+{                                                                                               \
+    uint##depth##_t *dest = (uint##depth##_t *)dest_line;                                       \
+    uint##depth##_t *end = dest + width;                                                        \
+    uint##depth##_t *src = (uint##depth##_t *)src_line;                                         \
+    uint##depth##_t *pat = (uint##depth##_t *)pat_line;                                         \
+                                                                                                \
+    for (; dest < end; dest++, src++, pat++) {                                                  \
+        *dest = formula;                                                                        \
+    }                                                                                           \
+}                                                                                               \
+                                                                                                \
+ROP3_TEST_HANDLER(name, formula, index, depth)
 
 #define ROP3_HANDLERS(name, formula, index) \
     ROP3_HANDLERS_DEPTH(name, formula, index, 32)  \
     ROP3_HANDLERS_DEPTH(name, formula, index, 16)
 
+ROP3_HANDLERS(BLACKNESS, 0, 0x00);
 ROP3_HANDLERS(DPSoon, ~(*pat | *src | *dest), 0x01);
 ROP3_HANDLERS(DPSona, ~(*pat | *src) & *dest, 0x02);
+ROP3_HANDLERS(PSon, ~(*pat | *src), 0x03);
 ROP3_HANDLERS(SDPona, ~(*pat | *dest) & *src, 0x04);
+ROP3_HANDLERS(DPon, ~(*pat | *dest), 0x05);
 ROP3_HANDLERS(PDSxnon, ~(~(*src ^ *dest) | *pat), 0x06);
 ROP3_HANDLERS(PDSaon, ~((*src & *dest) | *pat), 0x07);
 ROP3_HANDLERS(SDPnaa, ~*pat & *dest & *src, 0x08);
 ROP3_HANDLERS(PDSxon, ~((*src ^ *dest) | *pat), 0x09);
+ROP3_HANDLERS(DPna, ~*pat & *dest, 0x0a);
 ROP3_HANDLERS(PSDnaon, ~((~*dest & *src) | *pat), 0x0b);
+ROP3_HANDLERS(SPna, ~*pat & *src, 0x0c);
 ROP3_HANDLERS(PDSnaon, ~((~*src & *dest) | *pat), 0x0d);
 ROP3_HANDLERS(PDSonon, ~(~(*src | *dest) | *pat), 0x0e);
+ROP3_HANDLERS(Pn, ~*pat, 0x0f);
 ROP3_HANDLERS(PDSona, ~(*src | *dest) & *pat, 0x10);
+ROP3_HANDLERS(DSon, ~(*src | *dest), 0x11);
 ROP3_HANDLERS(SDPxnon, ~(~(*pat ^ *dest) | *src), 0x12);
 ROP3_HANDLERS(SDPaon, ~((*pat & *dest) | *src), 0x13);
 ROP3_HANDLERS(DPSxnon, ~(~(*pat ^ *src) | *dest), 0x14);
@@ -180,6 +135,7 @@ ROP3_HANDLERS(PDSox, (*dest | *src) ^ *pat, 0x1e);
 ROP3_HANDLERS(PDSoan, ~((*src | *dest) & *pat), 0x1f);
 ROP3_HANDLERS(DPSnaa, ~*src & *pat & *dest, 0x20);
 ROP3_HANDLERS(SDPxon, ~((*pat ^ *dest) | *src), 0x21);
+ROP3_HANDLERS(DSna, ~*src & *dest, 0x22);
 ROP3_HANDLERS(SPDnaon, ~((~*dest & *pat) | *src), 0x23);
 ROP3_HANDLERS(SPxDSxa, (*src ^ *pat) & (*dest ^ *src), 0x24);
 ROP3_HANDLERS(PDSPanaxn, ~((~(*src & *pat) & *dest) ^ *pat), 0x25);
@@ -193,8 +149,10 @@ ROP3_HANDLERS(SPDSoax, ((*src | *dest) & *pat) ^ *src, 0x2c);
 ROP3_HANDLERS(PSDnox, (~*dest | *src) ^ *pat, 0x2d);
 ROP3_HANDLERS(PSDPxox, ((*pat ^ *dest) | *src) ^ *pat, 0x2e);
 ROP3_HANDLERS(PSDnoan, ~((~*dest | *src) & *pat), 0x2f);
+ROP3_HANDLERS(PSna, ~*src & *pat, 0x30);
 ROP3_HANDLERS(SDPnaon, ~((~*pat & *dest) | *src), 0x31);
 ROP3_HANDLERS(SDPSoox, (*src | *pat | *dest) ^ *src, 0x32);
+ROP3_HANDLERS(Sn, ~*src, 0x33);
 ROP3_HANDLERS(SPDSaox, ((*src & *dest) | *pat) ^ *src, 0x34);
 ROP3_HANDLERS(SPDSxnox, (~(*src ^ *dest) | *pat) ^ *src, 0x35);
 ROP3_HANDLERS(SDPox, (*pat | *dest) ^ *src, 0x36);
@@ -203,12 +161,15 @@ ROP3_HANDLERS(PSDPoax, ((*pat | *dest) & *src) ^ *pat, 0x38);
 ROP3_HANDLERS(SPDnox, (~*dest | *pat) ^ *src, 0x39);
 ROP3_HANDLERS(SPDSxox, ((*src ^ *dest) | *pat) ^ *src, 0x3a);
 ROP3_HANDLERS(SPDnoan, ~((~*dest | *pat) & *src), 0x3b);
+ROP3_HANDLERS(PSx, *pat ^ *src, 0x3c);
 ROP3_HANDLERS(SPDSonox, (~(*src | *dest) | *pat) ^ *src, 0x3d);
 ROP3_HANDLERS(SPDSnaox, ((~*src & *dest) | *pat) ^ *src, 0x3e);
+ROP3_HANDLERS(PSan, ~(*pat & *src), 0x3f);
 ROP3_HANDLERS(PSDnaa, ~*dest & *src & *pat, 0x40);
 ROP3_HANDLERS(DPSxon, ~((*src ^ *pat) | *dest), 0x41);
 ROP3_HANDLERS(SDxPDxa, (*src ^ *dest) & (*pat ^ *dest), 0x42);
 ROP3_HANDLERS(SPDSanaxn, ~((~(*src & *dest) & *pat) ^ *src), 0x43);
+ROP3_HANDLERS(SDna, ~*dest & *src, 0x44);
 ROP3_HANDLERS(DPSnaon, ~((~*src & *pat) | *dest), 0x45);
 ROP3_HANDLERS(DSPDaox, ((*dest & *pat) | *src) ^ *dest, 0x46);
 ROP3_HANDLERS(PSDPxaxn, ~(((*pat ^ *dest) & *src) ^ *pat), 0x47);
@@ -220,24 +181,29 @@ ROP3_HANDLERS(SDPana, ~(*pat & *dest) & *src, 0x4c);
 ROP3_HANDLERS(SSPxDSxoxn, ~(((*src ^ *dest) | (*src ^ *pat)) ^ *src), 0x4d);
 ROP3_HANDLERS(PDSPxox, ((*pat ^ *src) | *dest) ^ *pat, 0x4e);
 ROP3_HANDLERS(PDSnoan, ~((~*src | *dest) & *pat), 0x4f);
+ROP3_HANDLERS(PDna, ~*dest & *pat, 0x50);
 ROP3_HANDLERS(DSPnaon, ~((~*pat & *src) | *dest), 0x51);
 ROP3_HANDLERS(DPSDaox, ((*dest & *src) | *pat) ^ *dest, 0x52);
 ROP3_HANDLERS(SPDSxaxn, ~(((*src ^ *dest) & *pat) ^ *src), 0x53);
 ROP3_HANDLERS(DPSonon, ~(~(*src | *pat) | *dest), 0x54);
+ROP3_HANDLERS(Dn, ~*dest, 0x55);
 ROP3_HANDLERS(DPSox, (*src | *pat) ^ *dest, 0x56);
 ROP3_HANDLERS(DPSoan, ~((*src | *pat) & *dest), 0x57);
 ROP3_HANDLERS(PDSPoax, ((*pat | *src) & *dest) ^ *pat, 0x58);
 ROP3_HANDLERS(DPSnox, (~*src | *pat) ^ *dest, 0x59);
+ROP3_HANDLERS(DPx, *dest ^ *pat, 0x5a);
 ROP3_HANDLERS(DPSDonox, (~(*dest | *src) | *pat) ^ *dest, 0x5b);
 ROP3_HANDLERS(DPSDxox, ((*dest ^ *src) | *pat) ^ *dest, 0x5c);
 ROP3_HANDLERS(DPSnoan, ~((~*src | *pat) & *dest), 0x5d);
 ROP3_HANDLERS(DPSDnaox, ((~*dest & *src) | *pat) ^ *dest, 0x5e);
+ROP3_HANDLERS(DPan, ~(*dest & *pat), 0x5f);
 ROP3_HANDLERS(PDSxa, (*src ^ *dest) & *pat, 0x60);
 ROP3_HANDLERS(DSPDSaoxxn, ~(((*src & *dest) | *pat) ^ *src ^ *dest), 0x61);
 ROP3_HANDLERS(DSPDoax, ((*dest | *pat) & *src) ^ *dest, 0x62);
 ROP3_HANDLERS(SDPnox, (~*pat | *dest) ^ *src, 0x63);
 ROP3_HANDLERS(SDPSoax, ((*src | *pat) & *dest) ^ *src, 0x64);
 ROP3_HANDLERS(DSPnox, (~*pat | *src) ^ *dest, 0x65);
+ROP3_HANDLERS(DSx, *dest ^ *src, 0x66);
 ROP3_HANDLERS(SDPSonox, (~(*src | *pat) | *dest) ^ *src, 0x67);
 ROP3_HANDLERS(DSPDSonoxxn, ~((~(*src | *dest) | *pat) ^ *src ^ *dest), 0x68);
 ROP3_HANDLERS(PDSxxn, ~(*src ^ *dest ^ *pat), 0x69);
@@ -254,6 +220,7 @@ ROP3_HANDLERS(SDPnoan, ~((~*pat | *dest) & *src), 0x73);
 ROP3_HANDLERS(DSPDxox, ((*dest ^ *pat) | *src) ^ *dest, 0x74);
 ROP3_HANDLERS(DSPnoan, ~((~*pat | *src) & *dest), 0x75);
 ROP3_HANDLERS(SDPSnaox, ((~*src & *pat) | *dest) ^ *src, 0x76);
+ROP3_HANDLERS(DSan, ~(*dest & *src), 0x77);
 ROP3_HANDLERS(PDSax, (*src & *dest) ^ *pat, 0x78);
 ROP3_HANDLERS(DSPDSoaxxn, ~(((*src | *dest) & *pat) ^ *src ^ *dest), 0x79);
 ROP3_HANDLERS(DPSDnoax, ((~*dest | *src) & *pat) ^ *dest, 0x7a);
@@ -270,6 +237,7 @@ ROP3_HANDLERS(SDPxna, ~(*pat ^ *dest) & *src, 0x84);
 ROP3_HANDLERS(PDSPnoaxn, ~(((~*pat | *src) & *dest) ^ *pat), 0x85);
 ROP3_HANDLERS(DSPDSoaxx, ((*src | *dest) & *pat) ^ *src ^ *dest, 0x86);
 ROP3_HANDLERS(PDSaxn, ~((*src & *dest) ^ *pat), 0x87);
+ROP3_HANDLERS(DSa, *dest & *src, 0x88);
 ROP3_HANDLERS(SDPSnaoxn, ~(((~*src & *pat) | *dest) ^ *src), 0x89);
 ROP3_HANDLERS(DSPnoa, (~*pat | *src) & *dest, 0x8a);
 ROP3_HANDLERS(DSPDxoxn, ~(((*dest ^ *pat) | *src) ^ *dest), 0x8b);
@@ -286,24 +254,29 @@ ROP3_HANDLERS(DPSaxn, ~((*src & *pat) ^ *dest), 0x95);
 ROP3_HANDLERS(DPSxx, *src ^ *pat ^ *dest, 0x96);
 ROP3_HANDLERS(PSDPSonoxx, (~(*src | *pat) | *dest) ^ *src ^ *pat, 0x97);
 ROP3_HANDLERS(SDPSonoxn, ~((~(*src | *pat) | *dest) ^ *src), 0x98);
+ROP3_HANDLERS(DSxn, ~(*dest ^ *src), 0x99);
 ROP3_HANDLERS(DPSnax, (~*src & *pat) ^ *dest, 0x9a);
 ROP3_HANDLERS(SDPSoaxn, ~(((*src | *pat) & *dest) ^ *src), 0x9b);
 ROP3_HANDLERS(SPDnax, (~*dest & *pat) ^ *src, 0x9c);
 ROP3_HANDLERS(DSPDoaxn, ~(((*dest | *pat) & *src) ^ *dest), 0x9d);
 ROP3_HANDLERS(DSPDSaoxx, ((*src & *dest) | *pat) ^ *src ^ *dest, 0x9e);
 ROP3_HANDLERS(PDSxan, ~((*src ^ *dest) & *pat), 0x9f);
+ROP3_HANDLERS(DPa, *dest & *pat, 0xa0);
 ROP3_HANDLERS(PDSPnaoxn, ~(((~*pat & *src) | *dest) ^ *pat), 0xa1);
 ROP3_HANDLERS(DPSnoa, (~*src | *pat) & *dest, 0xa2);
 ROP3_HANDLERS(DPSDxoxn, ~(((*dest ^ *src) | *pat) ^ *dest), 0xa3);
 ROP3_HANDLERS(PDSPonoxn, ~((~(*pat | *src) | *dest) ^ *pat), 0xa4);
+ROP3_HANDLERS(PDxn, ~(*pat ^ *dest), 0xa5);
 ROP3_HANDLERS(DSPnax, (~*pat & *src) ^ *dest, 0xa6);
 ROP3_HANDLERS(PDSPoaxn, ~(((*pat | *src) & *dest) ^ *pat), 0xa7);
 ROP3_HANDLERS(DPSoa, (*src | *pat) & *dest, 0xa8);
 ROP3_HANDLERS(DPSoxn, ~((*src | *pat) ^ *dest), 0xa9);
+ROP3_HANDLERS(D, *dest, 0xaa);
 ROP3_HANDLERS(DPSono, ~(*src | *pat) | *dest, 0xab);
 ROP3_HANDLERS(SPDSxax, ((*src ^ *dest) & *pat) ^ *src, 0xac);
 ROP3_HANDLERS(DPSDaoxn, ~(((*dest & *src) | *pat) ^ *dest), 0xad);
 ROP3_HANDLERS(DSPnao, (~*pat & *src) | *dest, 0xae);
+ROP3_HANDLERS(DPno, ~*pat | *dest, 0xaf);
 ROP3_HANDLERS(PDSnoa, (~*src | *dest) & *pat, 0xb0);
 ROP3_HANDLERS(PDSPxoxn, ~(((*pat ^ *src) | *dest) ^ *pat), 0xb1);
 ROP3_HANDLERS(SSPxDSxox, ((*src ^ *dest) | (*pat ^ *src)) ^ *src, 0xb2);
@@ -315,12 +288,15 @@ ROP3_HANDLERS(SDPxan, ~((*pat ^ *dest) & *src), 0xb7);
 ROP3_HANDLERS(PSDPxax, ((*dest ^ *pat) & *src) ^ *pat, 0xb8);
 ROP3_HANDLERS(DSPDaoxn, ~(((*dest & *pat) | *src) ^ *dest), 0xb9);
 ROP3_HANDLERS(DPSnao, (~*src & *pat) | *dest, 0xba);
+ROP3_HANDLERS(DSno, ~*src | *dest, 0xbb);
 ROP3_HANDLERS(SPDSanax, (~(*src & *dest) & *pat) ^ *src, 0xbc);
 ROP3_HANDLERS(SDxPDxan, ~((*dest ^ *pat) & (*dest ^ *src)), 0xbd);
 ROP3_HANDLERS(DPSxo, (*src ^ *pat) | *dest, 0xbe);
 ROP3_HANDLERS(DPSano, ~(*src & *pat) | *dest, 0xbf);
+ROP3_HANDLERS(PSa, *pat & *src, 0xc0);
 ROP3_HANDLERS(SPDSnaoxn, ~(((~*src & *dest) | *pat) ^ *src), 0xc1);
 ROP3_HANDLERS(SPDSonoxn, ~((~(*src | *dest) | *pat) ^ *src), 0xc2);
+ROP3_HANDLERS(PSxn, ~(*pat ^ *src), 0xc3);
 ROP3_HANDLERS(SPDnoa, (~*dest | *pat) & *src, 0xc4);
 ROP3_HANDLERS(SPDSxoxn, ~(((*src ^ *dest) | *pat) ^ *src), 0xc5);
 ROP3_HANDLERS(SDPnax, (~*pat & *dest) ^ *src, 0xc6);
@@ -329,8 +305,10 @@ ROP3_HANDLERS(SDPoa, (*pat | *dest) & *src, 0xc8);
 ROP3_HANDLERS(SPDoxn, ~((*dest | *pat) ^ *src), 0xc9);
 ROP3_HANDLERS(DPSDxax, ((*dest ^ *src) & *pat) ^ *dest, 0xca);
 ROP3_HANDLERS(SPDSaoxn, ~(((*src & *dest) | *pat) ^ *src), 0xcb);
+ROP3_HANDLERS(S, *src, 0xcc);
 ROP3_HANDLERS(SDPono, ~(*pat | *dest) | *src, 0xcd);
 ROP3_HANDLERS(SDPnao, (~*pat & *dest) | *src, 0xce);
+ROP3_HANDLERS(SPno, ~*pat | *src, 0xcf);
 ROP3_HANDLERS(PSDnoa, (~*dest | *src) & *pat, 0xd0);
 ROP3_HANDLERS(PSDPxoxn, ~(((*pat ^ *dest) | *src) ^ *pat), 0xd1);
 ROP3_HANDLERS(PDSnax, (~*src & *dest) ^ *pat, 0xd2);
@@ -344,6 +322,7 @@ ROP3_HANDLERS(SDPSaoxn, ~(((*src & *pat) | *dest) ^ *src), 0xd9);
 ROP3_HANDLERS(DPSDanax, (~(*dest & *src) & *pat) ^ *dest, 0xda);
 ROP3_HANDLERS(SPxDSxan, ~((*src ^ *dest) & (*pat ^ *src)), 0xdb);
 ROP3_HANDLERS(SPDnao, (~*dest & *pat) | *src, 0xdc);
+ROP3_HANDLERS(SDno, ~*dest | *src, 0xdd);
 ROP3_HANDLERS(SDPxo, (*pat ^ *dest) | *src, 0xde);
 ROP3_HANDLERS(SDPano, ~(*pat & *dest) | *src, 0xdf);
 ROP3_HANDLERS(PDSoa, (*src | *dest) & *pat, 0xe0);
@@ -360,268 +339,494 @@ ROP3_HANDLERS(DPSao, (*src & *pat) | *dest, 0xea);
 ROP3_HANDLERS(DPSxno, ~(*src ^ *pat) | *dest, 0xeb);
 ROP3_HANDLERS(SDPao, (*pat & *dest) | *src, 0xec);
 ROP3_HANDLERS(SDPxno, ~(*pat ^ *dest) | *src, 0xed);
+ROP3_HANDLERS(DSo, *dest | *src, 0xee);
 ROP3_HANDLERS(SDPnoo, ~*pat | *dest | *src, 0xef);
+ROP3_HANDLERS(P, *pat, 0xf0);
 ROP3_HANDLERS(PDSono, ~(*src | *dest) | *pat, 0xf1);
 ROP3_HANDLERS(PDSnao, (~*src & *dest) | *pat, 0xf2);
+ROP3_HANDLERS(PSno, ~*src | *pat, 0xf3);
 ROP3_HANDLERS(PSDnao, (~*dest & *src) | *pat, 0xf4);
+ROP3_HANDLERS(PDno, ~*dest | *pat, 0xf5);
 ROP3_HANDLERS(PDSxo, (*src ^ *dest) | *pat, 0xf6);
 ROP3_HANDLERS(PDSano, ~(*src & *dest) | *pat, 0xf7);
 ROP3_HANDLERS(PDSao, (*src & *dest) | *pat, 0xf8);
 ROP3_HANDLERS(PDSxno, ~(*src ^ *dest) | *pat, 0xf9);
+ROP3_HANDLERS(DPo, *dest | *pat, 0xfa);
 ROP3_HANDLERS(DPSnoo, ~*src | *pat | *dest, 0xfb);
+ROP3_HANDLERS(PSo, *pat | *src, 0xfc);
 ROP3_HANDLERS(PSDnoo, ~*dest | *src | *pat, 0xfd);
 ROP3_HANDLERS(DPSoo, *src | *pat | *dest, 0xfe);
+ROP3_HANDLERS(WHITENESS, ~0, 0xff);
+
+
+/* every implemented rop3, with its code */
+#define ROP3_OPS(OP) \
+    OP(BLACKNESS, 0x00) \
+    OP(DPSoon, 0x01) \
+    OP(DPSona, 0x02) \
+    OP(PSon, 0x03) \
+    OP(SDPona, 0x04) \
+    OP(DPon, 0x05) \
+    OP(PDSxnon, 0x06) \
+    OP(PDSaon, 0x07) \
+    OP(SDPnaa, 0x08) \
+    OP(PDSxon, 0x09) \
+    OP(DPna, 0x0a) \
+    OP(PSDnaon, 0x0b) \
+    OP(SPna, 0x0c) \
+    OP(PDSnaon, 0x0d) \
+    OP(PDSonon, 0x0e) \
+    OP(Pn, 0x0f) \
+    OP(PDSona, 0x10) \
+    OP(DSon, 0x11) \
+    OP(SDPxnon, 0x12) \
+    OP(SDPaon, 0x13) \
+    OP(DPSxnon, 0x14) \
+    OP(DPSaon, 0x15) \
+    OP(PSDPSanaxx, 0x16) \
+    OP(SSPxDSxaxn, 0x17) \
+    OP(SPxPDxa, 0x18) \
+    OP(SDPSanaxn, 0x19) \
+    OP(PDSPaox, 0x1a) \
+    OP(SDPSxaxn, 0x1b) \
+    OP(PSDPaox, 0x1c) \
+    OP(DSPDxaxn, 0x1d) \
+    OP(PDSox, 0x1e) \
+    OP(PDSoan, 0x1f) \
+    OP(DPSnaa, 0x20) \
+    OP(SDPxon, 0x21) \
+    OP(DSna, 0x22) \
+    OP(SPDnaon, 0x23) \
+    OP(SPxDSxa, 0x24) \
+    OP(PDSPanaxn, 0x25) \
+    OP(SDPSaox, 0x26) \
+    OP(SDPSxnox, 0x27) \
+    OP(DPSxa, 0x28) \
+    OP(PSDPSaoxxn, 0x29) \
+    OP(DPSana, 0x2a) \
+    OP(SSPxPDxaxn, 0x2b) \
+    OP(SPDSoax, 0x2c) \
+    OP(PSDnox, 0x2d) \
+    OP(PSDPxox, 0x2e) \
+    OP(PSDnoan, 0x2f) \
+    OP(PSna, 0x30) \
+    OP(SDPnaon, 0x31) \
+    OP(SDPSoox, 0x32) \
+    OP(Sn, 0x33) \
+    OP(SPDSaox, 0x34) \
+    OP(SPDSxnox, 0x35) \
+    OP(SDPox, 0x36) \
+    OP(SDPoan, 0x37) \
+    OP(PSDPoax, 0x38) \
+    OP(SPDnox, 0x39) \
+    OP(SPDSxox, 0x3a) \
+    OP(SPDnoan, 0x3b) \
+    OP(PSx, 0x3c) \
+    OP(SPDSonox, 0x3d) \
+    OP(SPDSnaox, 0x3e) \
+    OP(PSan, 0x3f) \
+    OP(PSDnaa, 0x40) \
+    OP(DPSxon, 0x41) \
+    OP(SDxPDxa, 0x42) \
+    OP(SPDSanaxn, 0x43) \
+    OP(SDna, 0x44) \
+    OP(DPSnaon, 0x45) \
+    OP(DSPDaox, 0x46) \
+    OP(PSDPxaxn, 0x47) \
+    OP(SDPxa, 0x48) \
+    OP(PDSPDaoxxn, 0x49) \
+    OP(DPSDoax, 0x4a) \
+    OP(PDSnox, 0x4b) \
+    OP(SDPana, 0x4c) \
+    OP(SSPxDSxoxn, 0x4d) \
+    OP(PDSPxox, 0x4e) \
+    OP(PDSnoan, 0x4f) \
+    OP(PDna, 0x50) \
+    OP(DSPnaon, 0x51) \
+    OP(DPSDaox, 0x52) \
+    OP(SPDSxaxn, 0x53) \
+    OP(DPSonon, 0x54) \
+    OP(Dn, 0x55) \
+    OP(DPSox, 0x56) \
+    OP(DPSoan, 0x57) \
+    OP(PDSPoax, 0x58) \
+    OP(DPSnox, 0x59) \
+    OP(DPx, 0x5a) \
+    OP(DPSDonox, 0x5b) \
+    OP(DPSDxox, 0x5c) \
+    OP(DPSnoan, 0x5d) \
+    OP(DPSDnaox, 0x5e) \
+    OP(DPan, 0x5f) \
+    OP(PDSxa, 0x60) \
+    OP(DSPDSaoxxn, 0x61) \
+    OP(DSPDoax, 0x62) \
+    OP(SDPnox, 0x63) \
+    OP(SDPSoax, 0x64) \
+    OP(DSPnox, 0x65) \
+    OP(DSx, 0x66) \
+    OP(SDPSonox, 0x67) \
+    OP(DSPDSonoxxn, 0x68) \
+    OP(PDSxxn, 0x69) \
+    OP(DPSax, 0x6a) \
+    OP(PSDPSoaxxn, 0x6b) \
+    OP(SDPax, 0x6c) \
+    OP(PDSPDoaxxn, 0x6d) \
+    OP(SDPSnoax, 0x6e) \
+    OP(PDSxnan, 0x6f) \
+    OP(PDSana, 0x70) \
+    OP(SSDxPDxaxn, 0x71) \
+    OP(SDPSxox, 0x72) \
+    OP(SDPnoan, 0x73) \
+    OP(DSPDxox, 0x74) \
+    OP(DSPnoan, 0x75) \
+    OP(SDPSnaox, 0x76) \
+    OP(DSan, 0x77) \
+    OP(PDSax, 0x78) \
+    OP(DSPDSoaxxn, 0x79) \
+    OP(DPSDnoax, 0x7a) \
+    OP(SDPxnan, 0x7b) \
+    OP(SPDSnoax, 0x7c) \
+    OP(DPSxnan, 0x7d) \
+    OP(SPxDSxo, 0x7e) \
+    OP(DPSaan, 0x7f) \
+    OP(DPSaa, 0x80) \
+    OP(SPxDSxon, 0x81) \
+    OP(DPSxna, 0x82) \
+    OP(SPDSnoaxn, 0x83) \
+    OP(SDPxna, 0x84) \
+    OP(PDSPnoaxn, 0x85) \
+    OP(DSPDSoaxx, 0x86) \
+    OP(PDSaxn, 0x87) \
+    OP(DSa, 0x88) \
+    OP(SDPSnaoxn, 0x89) \
+    OP(DSPnoa, 0x8a) \
+    OP(DSPDxoxn, 0x8b) \
+    OP(SDPnoa, 0x8c) \
+    OP(SDPSxoxn, 0x8d) \
+    OP(SSDxPDxax, 0x8e) \
+    OP(PDSanan, 0x8f) \
+    OP(PDSxna, 0x90) \
+    OP(SDPSnoaxn, 0x91) \
+    OP(DPSDPoaxx, 0x92) \
+    OP(SPDaxn, 0x93) \
+    OP(PSDPSoaxx, 0x94) \
+    OP(DPSaxn, 0x95) \
+    OP(DPSxx, 0x96) \
+    OP(PSDPSonoxx, 0x97) \
+    OP(SDPSonoxn, 0x98) \
+    OP(DSxn, 0x99) \
+    OP(DPSnax, 0x9a) \
+    OP(SDPSoaxn, 0x9b) \
+    OP(SPDnax, 0x9c) \
+    OP(DSPDoaxn, 0x9d) \
+    OP(DSPDSaoxx, 0x9e) \
+    OP(PDSxan, 0x9f) \
+    OP(DPa, 0xa0) \
+    OP(PDSPnaoxn, 0xa1) \
+    OP(DPSnoa, 0xa2) \
+    OP(DPSDxoxn, 0xa3) \
+    OP(PDSPonoxn, 0xa4) \
+    OP(PDxn, 0xa5) \
+    OP(DSPnax, 0xa6) \
+    OP(PDSPoaxn, 0xa7) \
+    OP(DPSoa, 0xa8) \
+    OP(DPSoxn, 0xa9) \
+    OP(D, 0xaa) \
+    OP(DPSono, 0xab) \
+    OP(SPDSxax, 0xac) \
+    OP(DPSDaoxn, 0xad) \
+    OP(DSPnao, 0xae) \
+    OP(DPno, 0xaf) \
+    OP(PDSnoa, 0xb0) \
+    OP(PDSPxoxn, 0xb1) \
+    OP(SSPxDSxox, 0xb2) \
+    OP(SDPanan, 0xb3) \
+    OP(PSDnax, 0xb4) \
+    OP(DPSDoaxn, 0xb5) \
+    OP(DPSDPaoxx, 0xb6) \
+    OP(SDPxan, 0xb7) \
+    OP(PSDPxax, 0xb8) \
+    OP(DSPDaoxn, 0xb9) \
+    OP(DPSnao, 0xba) \
+    OP(DSno, 0xbb) \
+    OP(SPDSanax, 0xbc) \
+    OP(SDxPDxan, 0xbd) \
+    OP(DPSxo, 0xbe) \
+    OP(DPSano, 0xbf) \
+    OP(PSa, 0xc0) \
+    OP(SPDSnaoxn, 0xc1) \
+    OP(SPDSonoxn, 0xc2) \
+    OP(PSxn, 0xc3) \
+    OP(SPDnoa, 0xc4) \
+    OP(SPDSxoxn, 0xc5) \
+    OP(SDPnax, 0xc6) \
+    OP(PSDPoaxn, 0xc7) \
+    OP(SDPoa, 0xc8) \
+    OP(SPDoxn, 0xc9) \
+    OP(DPSDxax, 0xca) \
+    OP(SPDSaoxn, 0xcb) \
+    OP(S, 0xcc) \
+    OP(SDPono, 0xcd) \
+    OP(SDPnao, 0xce) \
+    OP(SPno, 0xcf) \
+    OP(PSDnoa, 0xd0) \
+    OP(PSDPxoxn, 0xd1) \
+    OP(PDSnax, 0xd2) \
+    OP(SPDSoaxn, 0xd3) \
+    OP(SSPxPDxax, 0xd4) \
+    OP(DPSanan, 0xd5) \
+    OP(PSDPSaoxx, 0xd6) \
+    OP(DPSxan, 0xd7) \
+    OP(PDSPxax, 0xd8) \
+    OP(SDPSaoxn, 0xd9) \
+    OP(DPSDanax, 0xda) \
+    OP(SPxDSxan, 0xdb) \
+    OP(SPDnao, 0xdc) \
+    OP(SDno, 0xdd) \
+    OP(SDPxo, 0xde) \
+    OP(SDPano, 0xdf) \
+    OP(PDSoa, 0xe0) \
+    OP(PDSoxn, 0xe1) \
+    OP(DSPDxax, 0xe2) \
+    OP(PSDPaoxn, 0xe3) \
+    OP(SDPSxax, 0xe4) \
+    OP(PDSPaoxn, 0xe5) \
+    OP(SDPSanax, 0xe6) \
+    OP(SPxPDxan, 0xe7) \
+    OP(SSPxDSxax, 0xe8) \
+    OP(DSPDSanaxxn, 0xe9) \
+    OP(DPSao, 0xea) \
+    OP(DPSxno, 0xeb) \
+    OP(SDPao, 0xec) \
+    OP(SDPxno, 0xed) \
+    OP(DSo, 0xee) \
+    OP(SDPnoo, 0xef) \
+    OP(P, 0xf0) \
+    OP(PDSono, 0xf1) \
+    OP(PDSnao, 0xf2) \
+    OP(PSno, 0xf3) \
+    OP(PSDnao, 0xf4) \
+    OP(PDno, 0xf5) \
+    OP(PDSxo, 0xf6) \
+    OP(PDSano, 0xf7) \
+    OP(PDSao, 0xf8) \
+    OP(PDSxno, 0xf9) \
+    OP(DPo, 0xfa) \
+    OP(DPSnoo, 0xfb) \
+    OP(PSo, 0xfc) \
+    OP(PSDnoo, 0xfd) \
+    OP(DPSoo, 0xfe) \
+    OP(WHITENESS, 0xff)
+
+/* The dispatch tables are initialized at compile time, rop3_init()
+ * swaps in the SIMD handlers of the common codes when the cpu has them */
+#define ROP3_32_ENTRY(op, index) [index] = rop3_handle32_##op,
+#define ROP3_16_ENTRY(op, index) [index] = rop3_handle16_##op,
+
+static rop3_handler_t rop3_handlers_32[ROP3_NUM_OPS] = {
+    ROP3_OPS(ROP3_32_ENTRY)
+};
+
+static rop3_handler_t rop3_handlers_16[ROP3_NUM_OPS] = {
+    ROP3_OPS(ROP3_16_ENTRY)
+};
+
+#ifdef ROP3_SELF_TEST
+#define ROP3_T32_ENTRY(op, index) [index] = rop3_test32_##op,
+#define ROP3_T16_ENTRY(op, index) [index] = rop3_test16_##op,
+
+static const rop3_test_handler_t rop3_test_handlers_32[ROP3_NUM_OPS] = {
+    [0 ... ROP3_NUM_OPS - 1] = default_rop3_test_handler,
+    ROP3_OPS(ROP3_T32_ENTRY)
+};
+
+static const rop3_test_handler_t rop3_test_handlers_16[ROP3_NUM_OPS] = {
+    [0 ... ROP3_NUM_OPS - 1] = default_rop3_test_handler,
+    ROP3_OPS(ROP3_T16_ENTRY)
+};
+#endif
+
+#ifdef ROP_SIMD
+/* The vector kernels of the common codes are in rop3_simd.c, the pixels
+ * left over at the end of a row go to the scalar handler */
+#define ROP3_SIMD_HANDLERS(name, index, equation)                                               \
+static void rop3_simd32_##name(uint8_t *dest, uint8_t *src, uint8_t *pat, int width)            \
+{                                                                                               \
+    int done = rop3_simd_##name(dest, src, pat, width * 4);                                     \
+    rop3_handle32_##name(dest + done, src + done, pat + done, width - done / 4);                \
+}                                                                                               \
+                                                                                                \
+static void rop3_simd16_##name(uint8_t *dest, uint8_t *src, uint8_t *pat, int width)            \
+{                                                                                               \
+    int done = rop3_simd_##name(dest, src, pat, width * 2);                                     \
+    rop3_handle16_##name(dest + done, src + done, pat + done, width - done / 2);                \
+}
+
+ROP3_SIMD_OPS(ROP3_SIMD_HANDLERS)
 
+#ifdef ROP3_SELF_TEST
+#define ROP3_SIMD_TEST_WIDTH 77
 
-#define ROP3_FILL_HANDLERS(op, index)                       \
-    rop3_with_pattern_handlers_32[index] = rop3_handle_p32_##op; \
-    rop3_with_pattern_handlers_16[index] = rop3_handle_p16_##op; \
-    rop3_with_color_handlers_32[index] = rop3_handle_c32_##op;   \
-    rop3_with_color_handlers_16[index] = rop3_handle_c16_##op;   \
-    rop3_test_handlers_32[index] = rop3_test32_##op;             \
-    rop3_test_handlers_16[index] = rop3_test16_##op;
+/* compares each SIMD handler with the scalar one on random rows */
+#define ROP3_SIMD_TEST(name, index, equation)                                                   \
+    for (i = 0; i < ROP3_SIMD_TEST_WIDTH * 4; i++) {                                            \
+        dest_a[i] = dest_b[i] = rand();                                                         \
+        src[i] = rand();                                                                        \
+        pat[i] = rand();                                                                        \
+    }                                                                                           \
+    rop3_handle32_##name(dest_a, src, pat, ROP3_SIMD_TEST_WIDTH);                               \
+    rop3_simd32_##name(dest_b, src, pat, ROP3_SIMD_TEST_WIDTH);                                 \
+    rop3_handle16_##name(dest_a + 2, src + 2, pat + 2, ROP3_SIMD_TEST_WIDTH - 1);               \
+    rop3_simd16_##name(dest_b + 2, src + 2, pat + 2, ROP3_SIMD_TEST_WIDTH - 1);                 \
+    if (memcmp(dest_a, dest_b, ROP3_SIMD_TEST_WIDTH * 4)) {                                     \
+        printf("%s: simd 0x%x failed\n", __FUNCTION__, index);                                  \
+    }
+
+static void rop3_simd_test()
+{
+    uint8_t dest_a[ROP3_SIMD_TEST_WIDTH * 4];
+    uint8_t dest_b[ROP3_SIMD_TEST_WIDTH * 4];
+    uint8_t src[ROP3_SIMD_TEST_WIDTH * 4];
+    uint8_t pat[ROP3_SIMD_TEST_WIDTH * 4];
+    int i;
+
+    ROP3_SIMD_OPS(ROP3_SIMD_TEST)
+}
+#endif
+#endif
 
 void rop3_init()
 {
     static int need_init = 1;
-    int i;
 
     if (!need_init) {
         return;
     }
     need_init = 0;
 
-    for (i = 0; i < ROP3_NUM_OPS; i++) {
-        rop3_with_pattern_handlers_32[i] = default_rop3_with_pattern_handler;
-        rop3_with_pattern_handlers_16[i] = default_rop3_with_pattern_handler;
-        rop3_with_color_handlers_32[i] = default_rop3_withe_color_handler;
-        rop3_with_color_handlers_16[i] = default_rop3_withe_color_handler;
-        rop3_test_handlers_32[i] = default_rop3_test_handler;
-        rop3_test_handlers_16[i] = default_rop3_test_handler;
+#ifdef ROP3_SELF_TEST
+    {
+        int i;
+
+        for (i = 0; i < ROP3_NUM_OPS; i++) {
+            rop3_test_handlers_32[i]();
+            rop3_test_handlers_16[i]();
+        }
+    }
+#endif
+
+#ifdef ROP_SIMD
+    if (rop_simd_supported()) {
+#ifdef ROP3_SELF_TEST
+        rop3_simd_test();
+#endif
+#define ROP3_SIMD_ENTRY(name, index, equation)          \
+        rop3_handlers_32[index] = rop3_simd32_##name;   \
+        rop3_handlers_16[index] = rop3_simd16_##name;
+
+        ROP3_SIMD_OPS(ROP3_SIMD_ENTRY)
     }
+#endif
+}
 
-    ROP3_FILL_HANDLERS(DPSoon, 0x01);
-    ROP3_FILL_HANDLERS(DPSona, 0x02);
-    ROP3_FILL_HANDLERS(SDPona, 0x04);
-    ROP3_FILL_HANDLERS(PDSxnon, 0x06);
-    ROP3_FILL_HANDLERS(PDSaon, 0x07);
-    ROP3_FILL_HANDLERS(SDPnaa, 0x08);
-    ROP3_FILL_HANDLERS(PDSxon, 0x09);
-    ROP3_FILL_HANDLERS(PSDnaon, 0x0b);
-    ROP3_FILL_HANDLERS(PDSnaon, 0x0d);
-    ROP3_FILL_HANDLERS(PDSonon, 0x0e);
-    ROP3_FILL_HANDLERS(PDSona, 0x10);
-    ROP3_FILL_HANDLERS(SDPxnon, 0x12);
-    ROP3_FILL_HANDLERS(SDPaon, 0x13);
-    ROP3_FILL_HANDLERS(DPSxnon, 0x14);
-    ROP3_FILL_HANDLERS(DPSaon, 0x15);
-    ROP3_FILL_HANDLERS(PSDPSanaxx, 0x16);
-    ROP3_FILL_HANDLERS(SSPxDSxaxn, 0x17);
-    ROP3_FILL_HANDLERS(SPxPDxa, 0x18);
-    ROP3_FILL_HANDLERS(SDPSanaxn, 0x19);
-    ROP3_FILL_HANDLERS(PDSPaox, 0x1a);
-    ROP3_FILL_HANDLERS(SDPSxaxn, 0x1b);
-    ROP3_FILL_HANDLERS(PSDPaox, 0x1c);
-    ROP3_FILL_HANDLERS(DSPDxaxn, 0x1d);
-    ROP3_FILL_HANDLERS(PDSox, 0x1e);
-    ROP3_FILL_HANDLERS(PDSoan, 0x1f);
-    ROP3_FILL_HANDLERS(DPSnaa, 0x20);
-    ROP3_FILL_HANDLERS(SDPxon, 0x21);
-    ROP3_FILL_HANDLERS(SPDnaon, 0x23);
-    ROP3_FILL_HANDLERS(SPxDSxa, 0x24);
-    ROP3_FILL_HANDLERS(PDSPanaxn, 0x25);
-    ROP3_FILL_HANDLERS(SDPSaox, 0x26);
-    ROP3_FILL_HANDLERS(SDPSxnox, 0x27);
-    ROP3_FILL_HANDLERS(DPSxa, 0x28);
-    ROP3_FILL_HANDLERS(PSDPSaoxxn, 0x29);
-    ROP3_FILL_HANDLERS(DPSana, 0x2a);
-    ROP3_FILL_HANDLERS(SSPxPDxaxn, 0x2b);
-    ROP3_FILL_HANDLERS(SPDSoax, 0x2c);
-    ROP3_FILL_HANDLERS(PSDnox, 0x2d);
-    ROP3_FILL_HANDLERS(PSDPxox, 0x2e);
-    ROP3_FILL_HANDLERS(PSDnoan, 0x2f);
-    ROP3_FILL_HANDLERS(SDPnaon, 0x31);
-    ROP3_FILL_HANDLERS(SDPSoox, 0x32);
-    ROP3_FILL_HANDLERS(SPDSaox, 0x34);
-    ROP3_FILL_HANDLERS(SPDSxnox, 0x35);
-    ROP3_FILL_HANDLERS(SDPox, 0x36);
-    ROP3_FILL_HANDLERS(SDPoan, 0x37);
-    ROP3_FILL_HANDLERS(PSDPoax, 0x38);
-    ROP3_FILL_HANDLERS(SPDnox, 0x39);
-    ROP3_FILL_HANDLERS(SPDSxox, 0x3a);
-    ROP3_FILL_HANDLERS(SPDnoan, 0x3b);
-    ROP3_FILL_HANDLERS(SPDSonox, 0x3d);
-    ROP3_FILL_HANDLERS(SPDSnaox, 0x3e);
-    ROP3_FILL_HANDLERS(PSDnaa, 0x40);
-    ROP3_FILL_HANDLERS(DPSxon, 0x41);
-    ROP3_FILL_HANDLERS(SDxPDxa, 0x42);
-    ROP3_FILL_HANDLERS(SPDSanaxn, 0x43);
-    ROP3_FILL_HANDLERS(DPSnaon, 0x45);
-    ROP3_FILL_HANDLERS(DSPDaox, 0x46);
-    ROP3_FILL_HANDLERS(PSDPxaxn, 0x47);
-    ROP3_FILL_HANDLERS(SDPxa, 0x48);
-    ROP3_FILL_HANDLERS(PDSPDaoxxn, 0x49);
-    ROP3_FILL_HANDLERS(DPSDoax, 0x4a);
-    ROP3_FILL_HANDLERS(PDSnox, 0x4b);
-    ROP3_FILL_HANDLERS(SDPana, 0x4c);
-    ROP3_FILL_HANDLERS(SSPxDSxoxn, 0x4d);
-    ROP3_FILL_HANDLERS(PDSPxox, 0x4e);
-    ROP3_FILL_HANDLERS(PDSnoan, 0x4f);
-    ROP3_FILL_HANDLERS(DSPnaon, 0x51);
-    ROP3_FILL_HANDLERS(DPSDaox, 0x52);
-    ROP3_FILL_HANDLERS(SPDSxaxn, 0x53);
-    ROP3_FILL_HANDLERS(DPSonon, 0x54);
-    ROP3_FILL_HANDLERS(DPSox, 0x56);
-    ROP3_FILL_HANDLERS(DPSoan, 0x57);
-    ROP3_FILL_HANDLERS(PDSPoax, 0x58);
-    ROP3_FILL_HANDLERS(DPSnox, 0x59);
-    ROP3_FILL_HANDLERS(DPSDonox, 0x5b);
-    ROP3_FILL_HANDLERS(DPSDxox, 0x5c);
-    ROP3_FILL_HANDLERS(DPSnoan, 0x5d);
-    ROP3_FILL_HANDLERS(DPSDnaox, 0x5e);
-    ROP3_FILL_HANDLERS(PDSxa, 0x60);
-    ROP3_FILL_HANDLERS(DSPDSaoxxn, 0x61);
-    ROP3_FILL_HANDLERS(DSPDoax, 0x62);
-    ROP3_FILL_HANDLERS(SDPnox, 0x63);
-    ROP3_FILL_HANDLERS(SDPSoax, 0x64);
-    ROP3_FILL_HANDLERS(DSPnox, 0x65);
-    ROP3_FILL_HANDLERS(SDPSonox, 0x67);
-    ROP3_FILL_HANDLERS(DSPDSonoxxn, 0x68);
-    ROP3_FILL_HANDLERS(PDSxxn, 0x69);
-    ROP3_FILL_HANDLERS(DPSax, 0x6a);
-    ROP3_FILL_HANDLERS(PSDPSoaxxn, 0x6b);
-    ROP3_FILL_HANDLERS(SDPax, 0x6c);
-    ROP3_FILL_HANDLERS(PDSPDoaxxn, 0x6d);
-    ROP3_FILL_HANDLERS(SDPSnoax, 0x6e);
-    ROP3_FILL_HANDLERS(PDSxnan, 0x6f);
-    ROP3_FILL_HANDLERS(PDSana, 0x70);
-    ROP3_FILL_HANDLERS(SSDxPDxaxn, 0x71);
-    ROP3_FILL_HANDLERS(SDPSxox, 0x72);
-    ROP3_FILL_HANDLERS(SDPnoan, 0x73);
-    ROP3_FILL_HANDLERS(DSPDxox, 0x74);
-    ROP3_FILL_HANDLERS(DSPnoan, 0x75);
-    ROP3_FILL_HANDLERS(SDPSnaox, 0x76);
-    ROP3_FILL_HANDLERS(PDSax, 0x78);
-    ROP3_FILL_HANDLERS(DSPDSoaxxn, 0x79);
-    ROP3_FILL_HANDLERS(DPSDnoax, 0x7a);
-    ROP3_FILL_HANDLERS(SDPxnan, 0x7b);
-    ROP3_FILL_HANDLERS(SPDSnoax, 0x7c);
-    ROP3_FILL_HANDLERS(DPSxnan, 0x7d);
-    ROP3_FILL_HANDLERS(SPxDSxo, 0x7e);
-    ROP3_FILL_HANDLERS(DPSaan, 0x7f);
-    ROP3_FILL_HANDLERS(DPSaa, 0x80);
-    ROP3_FILL_HANDLERS(SPxDSxon, 0x81);
-    ROP3_FILL_HANDLERS(DPSxna, 0x82);
-    ROP3_FILL_HANDLERS(SPDSnoaxn, 0x83);
-    ROP3_FILL_HANDLERS(SDPxna, 0x84);
-    ROP3_FILL_HANDLERS(PDSPnoaxn, 0x85);
-    ROP3_FILL_HANDLERS(DSPDSoaxx, 0x86);
-    ROP3_FILL_HANDLERS(PDSaxn, 0x87);
-    ROP3_FILL_HANDLERS(SDPSnaoxn, 0x89);
-    ROP3_FILL_HANDLERS(DSPnoa, 0x8a);
-    ROP3_FILL_HANDLERS(DSPDxoxn, 0x8b);
-    ROP3_FILL_HANDLERS(SDPnoa, 0x8c);
-    ROP3_FILL_HANDLERS(SDPSxoxn, 0x8d);
-    ROP3_FILL_HANDLERS(SSDxPDxax, 0x8e);
-    ROP3_FILL_HANDLERS(PDSanan, 0x8f);
-    ROP3_FILL_HANDLERS(PDSxna, 0x90);
-    ROP3_FILL_HANDLERS(SDPSnoaxn, 0x91);
-    ROP3_FILL_HANDLERS(DPSDPoaxx, 0x92);
-    ROP3_FILL_HANDLERS(SPDaxn, 0x93);
-    ROP3_FILL_HANDLERS(PSDPSoaxx, 0x94);
-    ROP3_FILL_HANDLERS(DPSaxn, 0x95);
-    ROP3_FILL_HANDLERS(DPSxx, 0x96);
-    ROP3_FILL_HANDLERS(PSDPSonoxx, 0x97);
-    ROP3_FILL_HANDLERS(SDPSonoxn, 0x98);
-    ROP3_FILL_HANDLERS(DPSnax, 0x9a);
-    ROP3_FILL_HANDLERS(SDPSoaxn, 0x9b);
-    ROP3_FILL_HANDLERS(SPDnax, 0x9c);
-    ROP3_FILL_HANDLERS(DSPDoaxn, 0x9d);
-    ROP3_FILL_HANDLERS(DSPDSaoxx, 0x9e);
-    ROP3_FILL_HANDLERS(PDSxan, 0x9f);
-    ROP3_FILL_HANDLERS(PDSPnaoxn, 0xa1);
-    ROP3_FILL_HANDLERS(DPSnoa, 0xa2);
-    ROP3_FILL_HANDLERS(DPSDxoxn, 0xa3);
-    ROP3_FILL_HANDLERS(PDSPonoxn, 0xa4);
-    ROP3_FILL_HANDLERS(DSPnax, 0xa6);
-    ROP3_FILL_HANDLERS(PDSPoaxn, 0xa7);
-    ROP3_FILL_HANDLERS(DPSoa, 0xa8);
-    ROP3_FILL_HANDLERS(DPSoxn, 0xa9);
-    ROP3_FILL_HANDLERS(DPSono, 0xab);
-    ROP3_FILL_HANDLERS(SPDSxax, 0xac);
-    ROP3_FILL_HANDLERS(DPSDaoxn, 0xad);
-    ROP3_FILL_HANDLERS(DSPnao, 0xae);
-    ROP3_FILL_HANDLERS(PDSnoa, 0xb0);
-    ROP3_FILL_HANDLERS(PDSPxoxn, 0xb1);
-    ROP3_FILL_HANDLERS(SSPxDSxox, 0xb2);
-    ROP3_FILL_HANDLERS(SDPanan, 0xb3);
-    ROP3_FILL_HANDLERS(PSDnax, 0xb4);
-    ROP3_FILL_HANDLERS(DPSDoaxn, 0xb5);
-    ROP3_FILL_HANDLERS(DPSDPaoxx, 0xb6);
-    ROP3_FILL_HANDLERS(SDPxan, 0xb7);
-    ROP3_FILL_HANDLERS(PSDPxax, 0xb8);
-    ROP3_FILL_HANDLERS(DSPDaoxn, 0xb9);
-    ROP3_FILL_HANDLERS(DPSnao, 0xba);
-    ROP3_FILL_HANDLERS(SPDSanax, 0xbc);
-    ROP3_FILL_HANDLERS(SDxPDxan, 0xbd);
-    ROP3_FILL_HANDLERS(DPSxo, 0xbe);
-    ROP3_FILL_HANDLERS(DPSano, 0xbf);
-    ROP3_FILL_HANDLERS(SPDSnaoxn, 0xc1);
-    ROP3_FILL_HANDLERS(SPDSonoxn, 0xc2);
-    ROP3_FILL_HANDLERS(SPDnoa, 0xc4);
-    ROP3_FILL_HANDLERS(SPDSxoxn, 0xc5);
-    ROP3_FILL_HANDLERS(SDPnax, 0xc6);
-    ROP3_FILL_HANDLERS(PSDPoaxn, 0xc7);
-    ROP3_FILL_HANDLERS(SDPoa, 0xc8);
-    ROP3_FILL_HANDLERS(SPDoxn, 0xc9);
-    ROP3_FILL_HANDLERS(DPSDxax, 0xca);
-    ROP3_FILL_HANDLERS(SPDSaoxn, 0xcb);
-    ROP3_FILL_HANDLERS(SDPono, 0xcd);
-    ROP3_FILL_HANDLERS(SDPnao, 0xce);
-    ROP3_FILL_HANDLERS(PSDnoa, 0xd0);
-    ROP3_FILL_HANDLERS(PSDPxoxn, 0xd1);
-    ROP3_FILL_HANDLERS(PDSnax, 0xd2);
-    ROP3_FILL_HANDLERS(SPDSoaxn, 0xd3);
-    ROP3_FILL_HANDLERS(SSPxPDxax, 0xd4);
-    ROP3_FILL_HANDLERS(DPSanan, 0xd5);
-    ROP3_FILL_HANDLERS(PSDPSaoxx, 0xd6);
-    ROP3_FILL_HANDLERS(DPSxan, 0xd7);
-    ROP3_FILL_HANDLERS(PDSPxax, 0xd8);
-    ROP3_FILL_HANDLERS(SDPSaoxn, 0xd9);
-    ROP3_FILL_HANDLERS(DPSDanax, 0xda);
-    ROP3_FILL_HANDLERS(SPxDSxan, 0xdb);
-    ROP3_FILL_HANDLERS(SPDnao, 0xdc);
-    ROP3_FILL_HANDLERS(SDPxo, 0xde);
-    ROP3_FILL_HANDLERS(SDPano, 0xdf);
-    ROP3_FILL_HANDLERS(PDSoa, 0xe0);
-    ROP3_FILL_HANDLERS(PDSoxn, 0xe1);
-    ROP3_FILL_HANDLERS(DSPDxax, 0xe2);
-    ROP3_FILL_HANDLERS(PSDPaoxn, 0xe3);
-    ROP3_FILL_HANDLERS(SDPSxax, 0xe4);
-    ROP3_FILL_HANDLERS(PDSPaoxn, 0xe5);
-    ROP3_FILL_HANDLERS(SDPSanax, 0xe6);
-    ROP3_FILL_HANDLERS(SPxPDxan, 0xe7);
-    ROP3_FILL_HANDLERS(SSPxDSxax, 0xe8);
-    ROP3_FILL_HANDLERS(DSPDSanaxxn, 0xe9);
-    ROP3_FILL_HANDLERS(DPSao, 0xea);
-    ROP3_FILL_HANDLERS(DPSxno, 0xeb);
-    ROP3_FILL_HANDLERS(SDPao, 0xec);
-    ROP3_FILL_HANDLERS(SDPxno, 0xed);
-    ROP3_FILL_HANDLERS(SDPnoo, 0xef);
-    ROP3_FILL_HANDLERS(PDSono, 0xf1);
-    ROP3_FILL_HANDLERS(PDSnao, 0xf2);
-    ROP3_FILL_HANDLERS(PSDnao, 0xf4);
-    ROP3_FILL_HANDLERS(PDSxo, 0xf6);
-    ROP3_FILL_HANDLERS(PDSano, 0xf7);
-    ROP3_FILL_HANDLERS(PDSao, 0xf8);
-    ROP3_FILL_HANDLERS(PDSxno, 0xf9);
-    ROP3_FILL_HANDLERS(DPSnoo, 0xfb);
-    ROP3_FILL_HANDLERS(PSDnoo, 0xfd);
-    ROP3_FILL_HANDLERS(DPSoo, 0xfe);
+#ifdef ROP3_SELF_TEST
+static void rop3_log_usage(void)
+{
+    char buf[ROP3_NUM_OPS * 16];
+    int i, len = 0;
 
     for (i = 0; i < ROP3_NUM_OPS; i++) {
-        rop3_test_handlers_32[i]();
-        rop3_test_handlers_16[i]();
+        if (rop3_usage[i] != 0) {
+            len += snprintf(buf + len, sizeof(buf) - len, " 0x%02x:%u", i, rop3_usage[i]);
+        }
+    }
+    buf[len] = '\0';
+    SPICE_DEBUG("rop3 usage after %u draws:%s", rop3_draws, buf);
+}
+
+static void rop3_count(uint8_t rop3)
+{
+    rop3_usage[rop3]++;
+    if (++rop3_draws % ROP3_USAGE_LOG_PERIOD == 0) {
+        rop3_log_usage();
+    }
+}
+#else
+#define rop3_count(rop3)
+#endif
+
+/* Runs handler over the rows of d, with the pattern tiled from pat_pos
+ * or, when p is NULL, the color rgb */
+static void rop3_draw(rop3_handler_t handler, int bpp, pixman_image_t *d, pixman_image_t *s,
+                      SpicePoint *src_pos, pixman_image_t *p, SpicePoint *pat_pos, uint32_t rgb)
+{
+    int bytes_per_pixel = bpp / 8;
+    int width = pixman_image_get_width(d);
+    int height = pixman_image_get_height(d);
+    uint8_t *dest_line = (uint8_t *)pixman_image_get_data(d);
+    int dest_stride = pixman_image_get_stride(d);
+    int src_stride = pixman_image_get_stride(s);
+    uint8_t *src_line = (uint8_t *)pixman_image_get_data(s) + src_pos->y * src_stride +
+                        src_pos->x * bytes_per_pixel;
+    uint32_t pat_buf[ROP3_PAT_ROW_STACK_PIXELS];
+    uint8_t *pat_row = (uint8_t *)pat_buf;
+    int pat_width = 0, pat_height = 0, pat_stride = 0;
+    int pat_h_offset = 0, pat_v_offset = 0, expanded = -1;
+    uint8_t *pat_base = NULL;
+    int i, n;
+
+    if (width > ROP3_PAT_ROW_STACK_PIXELS) {
+        pat_row = spice_malloc(width * bytes_per_pixel);
+    }
+
+    if (p != NULL) {
+        pat_width = pixman_image_get_width(p);
+        pat_height = pixman_image_get_height(p);
+        pat_stride = pixman_image_get_stride(p);
+        pat_base = (uint8_t *)pixman_image_get_data(p);
+        pat_h_offset = pat_pos->x % pat_width;
+        if (pat_h_offset < 0) {
+            pat_h_offset += pat_width;
+        }
+        pat_v_offset = pat_pos->y % pat_height;
+        if (pat_v_offset < 0) {
+            pat_v_offset += pat_height;
+        }
+    } else if (bpp == 32) {
+        for (i = 0; i < width; i++) {
+            ((uint32_t *)pat_row)[i] = rgb;
+        }
+    } else {
+        for (i = 0; i < width; i++) {
+            ((uint16_t *)pat_row)[i] = rgb;
+        }
+    }
+
+    for (; height; height--, dest_line += dest_stride, src_line += src_stride) {
+        /* pattern rows are laid out over the whole width once, and again
+           only when the next row of the pattern is needed */
+        if (p != NULL && expanded != pat_v_offset) {
+            uint8_t *pat_line = pat_base + pat_v_offset * pat_stride;
+            uint8_t *out = pat_row;
+            int x = pat_h_offset;
+
+            for (i = width; i; i -= n, x = 0) {
+                n = MIN(i, pat_width - x);
+                memcpy(out, pat_line + x * bytes_per_pixel, n * bytes_per_pixel);
+                out += n * bytes_per_pixel;
+            }
+            expanded = pat_v_offset;
+        }
+
+        handler(dest_line, src_line, pat_row, width);
+
+        if (p != NULL && ++pat_v_offset == pat_height) {
+            pat_v_offset = 0;
+        }
+    }
+
+    if (pat_row != (uint8_t *)pat_buf) {
+        free(pat_row);
     }
 }
 
@@ -634,11 +839,9 @@ void do_rop3_with_pattern(uint8_t rop3, pixman_image_t *d, pixman_image_t *s, Sp
     ASSERT (bpp == spice_pixman_image_get_bpp(s));
     ASSERT (bpp == spice_pixman_image_get_bpp(p));
 
-    if (bpp == 32) {
-        rop3_with_pattern_handlers_32[rop3](d, s, src_pos, p, pat_pos);
-    } else {
-        rop3_with_pattern_handlers_16[rop3](d, s, src_pos, p, pat_pos);
-    }
+    rop3_count(rop3);
+    rop3_draw(bpp == 32 ? rop3_handlers_32[rop3] : rop3_handlers_16[rop3], bpp,
+              d, s, src_pos, p, pat_pos, 0);
 }
 
 void do_rop3_with_color(uint8_t rop3, pixman_image_t *d, pixman_image_t *s, SpicePoint *src_pos,
@@ -649,9 +852,7 @@ void do_rop3_with_color(uint8_t rop3, pixman_image_t *d, pixman_image_t *s, Spic
     bpp = spice_pixman_image_get_bpp(d);
     ASSERT (bpp == spice_pixman_image_get_bpp(s));
 
-    if (bpp == 32) {
-        rop3_with_color_handlers_32[rop3](d, s, src_pos, rgb);
-    } else {
-        rop3_with_color_handlers_16[rop3](d, s, src_pos, rgb);
-    }
+    rop3_count(rop3);
+    rop3_draw(bpp == 32 ? rop3_handlers_32[rop3] : rop3_handlers_16[rop3], bpp,
+              d, s, src_pos, NULL, NULL, rgb);
 }
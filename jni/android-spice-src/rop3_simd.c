@@ -0,0 +1,49 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2011  Keqisoft,Co,Ltd,Shanghai,China
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* SSE2 and NEON kernels of the common rop3 codes of rop3.c. Nothing
+ * else goes in this file, it is built with NEON enabled on armv7 while
+ * the cpu may not have it. */
+
+#define ROP_SIMD_KERNELS
+#include "rop_simd.h"
+
+#ifdef ROP_SIMD
+
+#define ROP3_SIMD_KERNEL(name, index, equation)                                                 \
+int rop3_simd_##name(uint8_t *dest, uint8_t *src, uint8_t *pat, int bytes)                      \
+{                                                                                               \
+    uint8_t *start = dest;                                                                      \
+    rop_vec_t d, s, p;                                                                          \
+                                                                                                \
+    for (; bytes >= 16; bytes -= 16, dest += 16, src += 16, pat += 16) {                        \
+        d = VEC_LOAD(dest);                                                                     \
+        s = VEC_LOAD(src);                                                                      \
+        p = VEC_LOAD(pat);                                                                      \
+        VEC_STORE(dest, equation);                                                              \
+    }                                                                                           \
+    (void)d; /* avoid unused warning */                                                         \
+    (void)s;                                                                                    \
+    (void)p;                                                                                    \
+    return dest - start;                                                                        \
+}
+
+ROP3_SIMD_OPS(ROP3_SIMD_KERNEL)
+
+#endif /* ROP_SIMD */
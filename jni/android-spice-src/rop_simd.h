@@ -0,0 +1,140 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2011  Keqisoft,Co,Ltd,Shanghai,China
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* SIMD kernels for the raster op, colorkey, blend and rop3 code in
+ * pixman_utils.c and rop3.c. The kernels themselves live in
+ * pixman_utils_simd.c and rop3_simd.c, the only files built with NEON
+ * enabled on armv7 (see Android.mk), so that the compiler can't slip
+ * vector instructions into code run on cpus without NEON. Each kernel
+ * does as much of a row as fills whole vectors and returns how much it
+ * did, the callers finish the row with their scalar code.
+ * ROP_SIMD is defined when the kernels are built for the target, they
+ * must still only be used once rop_simd_supported() said so. */
+
+#ifndef _H_ROP_SIMD
+#define _H_ROP_SIMD
+
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(__aarch64__) || defined(__ARM_ARCH_7A__)
+#define ROP_SIMD
+#endif
+
+#ifdef ROP_SIMD_KERNELS
+/* vector helpers, only for the files built with the instructions on */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128i rop_vec_t;
+#define VEC_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define VEC_STORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define VEC_ZERO _mm_setzero_si128()
+#define VEC_ONES _mm_set1_epi32(-1)
+#define VEC_AND(a, b) _mm_and_si128(a, b)
+#define VEC_OR(a, b) _mm_or_si128(a, b)
+#define VEC_XOR(a, b) _mm_xor_si128(a, b)
+#define VEC_NOT(a) _mm_xor_si128(a, VEC_ONES)
+#define VEC_ANDN(a, b) _mm_andnot_si128(b, a) /* a AND NOT b */
+#define VEC_ORN(a, b) _mm_or_si128(a, VEC_NOT(b)) /* a OR NOT b */
+#define VEC_SPLAT_32(v) _mm_set1_epi32((int)(v))
+#define VEC_CMPEQ_32(a, b) _mm_cmpeq_epi32(a, b) /* all ones where equal */
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+typedef uint8x16_t rop_vec_t;
+#define VEC_LOAD(p) vld1q_u8((const uint8_t *)(p))
+#define VEC_STORE(p, v) vst1q_u8((uint8_t *)(p), v)
+#define VEC_ZERO vdupq_n_u8(0)
+#define VEC_ONES vdupq_n_u8(0xff)
+#define VEC_AND(a, b) vandq_u8(a, b)
+#define VEC_OR(a, b) vorrq_u8(a, b)
+#define VEC_XOR(a, b) veorq_u8(a, b)
+#define VEC_NOT(a) vmvnq_u8(a)
+#define VEC_ANDN(a, b) vbicq_u8(a, b)
+#define VEC_ORN(a, b) vornq_u8(a, b)
+#define VEC_SPLAT_32(v) vreinterpretq_u8_u32(vdupq_n_u32(v))
+#define VEC_CMPEQ_32(a, b) vreinterpretq_u8_u32(vceqq_u32(vreinterpretq_u32_u8(a), \
+                                                      vreinterpretq_u32_u8(b)))
+#elif defined(ROP_SIMD)
+#error "the simd kernels have to be built with SSE2 or NEON enabled"
+#endif
+#endif /* ROP_SIMD_KERNELS */
+
+#ifdef ROP_SIMD
+int rop_simd_supported(void);
+
+/* The 16 raster ops of pixman_utils.c. Being bitwise, one byte kernel
+ * per op serves every depth: solid fills get the pixel repeated to 32
+ * bits, copies and tiles walk bytes. src and dst are the source and
+ * destination vectors. The kernels return how many bytes they did, a
+ * multiple of 16. */
+#define ROP_SIMD_OPS(OP)                                \
+    OP(clear, VEC_ZERO)                                 \
+    OP(and, VEC_AND(src, dst))                          \
+    OP(and_reverse, VEC_ANDN(src, dst))                 \
+    OP(copy, src)                                       \
+    OP(and_inverted, VEC_ANDN(dst, src))                \
+    OP(noop, dst)                                       \
+    OP(xor, VEC_XOR(src, dst))                          \
+    OP(or, VEC_OR(src, dst))                            \
+    OP(nor, VEC_NOT(VEC_OR(src, dst)))                  \
+    OP(equiv, VEC_NOT(VEC_XOR(src, dst)))               \
+    OP(invert, VEC_NOT(dst))                            \
+    OP(or_reverse, VEC_ORN(src, dst))                   \
+    OP(copy_inverted, VEC_NOT(src))                     \
+    OP(or_inverted, VEC_ORN(dst, src))                  \
+    OP(nand, VEC_NOT(VEC_AND(src, dst)))                \
+    OP(set, VEC_ONES)
+
+#define ROP_SIMD_DECLARE(_name, _equation)                                      \
+int solid_rop_simd_ ## _name(uint8_t *ptr, int bytes, uint32_t pattern);        \
+int copy_rop_simd_ ## _name(uint8_t *ptr, const uint8_t *src_line, int bytes);
+
+ROP_SIMD_OPS(ROP_SIMD_DECLARE)
+
+/* The colorkey and OVER blend of pixman_utils.c on 32 bpp rows, they
+ * return how many pixels they did */
+int colorkey_simd_32(uint32_t *dest, const uint32_t *src, int len, uint32_t key);
+int blend_over_simd_32(uint32_t *dest, const uint32_t *src, int len,
+                       uint32_t src_or, uint32_t dest_and, uint32_t alpha);
+
+/* The rop3 codes windows guests draw with most, see the usage log of
+ * ROP3_SELF_TEST builds. Like the raster ops each works on bytes
+ * whatever the depth. d, s and p are the dest, src and pat vectors. */
+#define ROP3_SIMD_OPS(OP)                                               \
+    OP(BLACKNESS, 0x00, VEC_ZERO)                                       \
+    OP(Sn, 0x33, VEC_NOT(s))                                            \
+    OP(Dn, 0x55, VEC_NOT(d))                                            \
+    OP(DPx, 0x5a, VEC_XOR(d, p))                                        \
+    OP(DSx, 0x66, VEC_XOR(d, s))                                        \
+    OP(DSa, 0x88, VEC_AND(d, s))                                        \
+    OP(DPSxx, 0x96, VEC_XOR(VEC_XOR(s, p), d))                          \
+    OP(PSDPxax, 0xb8, VEC_XOR(VEC_AND(VEC_XOR(d, p), s), p))            \
+    OP(PSa, 0xc0, VEC_AND(p, s))                                        \
+    OP(DPSDxax, 0xca, VEC_XOR(VEC_AND(VEC_XOR(d, s), p), d))            \
+    OP(S, 0xcc, s)                                                      \
+    OP(DSPDxax, 0xe2, VEC_XOR(VEC_AND(VEC_XOR(d, p), s), d))            \
+    OP(DSo, 0xee, VEC_OR(d, s))                                         \
+    OP(P, 0xf0, p)                                                      \
+    OP(WHITENESS, 0xff, VEC_ONES)
+
+#define ROP3_SIMD_DECLARE(_name, _index, _equation)                             \
+int rop3_simd_ ## _name(uint8_t *dest, uint8_t *src, uint8_t *pat, int bytes);
+
+ROP3_SIMD_OPS(ROP3_SIMD_DECLARE)
+#endif
+
+#endif
@@ -134,6 +134,8 @@ SpiceSession* spice_channel_get_session(SpiceChannel *channel);
 /* coroutine context */
 typedef void (*handler_msg_in)(SpiceChannel *channel, spice_msg_in *msg, gpointer data);
 void spice_channel_recv_msg(SpiceChannel *channel, handler_msg_in handler, gpointer data);
+gboolean spice_channel_has_pending_input(SpiceChannel *channel);
+gboolean spice_channel_wait_input(SpiceChannel *channel, guint timeout);
 
 /* channel-base.c */
 /* coroutine context */
@@ -1006,6 +1006,41 @@ static void spice_channel_send_msg(SpiceChannel *channel, spice_msg_out *out, gb
     }
 }
 
+/* coroutine context */
+/* Returns TRUE if more data can be read from the channel without waiting,
+ * so that message handlers can decide whether to defer work until the
+ * next message is processed */
+G_GNUC_INTERNAL
+gboolean spice_channel_has_pending_input(SpiceChannel *channel)
+{
+    spice_channel *c = channel->priv;
+
+    if (c->sock == NULL || c->has_error)
+        return FALSE;
+
+    if (c->tls && SSL_pending(c->ssl) > 0)
+        return TRUE;
+
+    return (g_socket_condition_check(c->sock, G_IO_IN) & G_IO_IN) != 0;
+}
+
+/* coroutine context */
+/* Waits up to timeout ms for something to read, returns whether there is.
+ * Buffered messages, eg acks, are sent before waiting. */
+G_GNUC_INTERNAL
+gboolean spice_channel_wait_input(SpiceChannel *channel, guint timeout)
+{
+    spice_channel *c = channel->priv;
+
+    if (spice_channel_has_pending_input(channel))
+        return TRUE;
+    if (c->sock == NULL || c->has_error)
+        return FALSE;
+
+    SPICE_CHANNEL_GET_CLASS(channel)->iterate_write(channel);
+    return (g_io_wait_timeout(c->sock, G_IO_IN, timeout) & G_IO_IN) != 0;
+}
+
 /* coroutine context */
 G_GNUC_INTERNAL
 void spice_channel_recv_msg(SpiceChannel *channel,
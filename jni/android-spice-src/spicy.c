@@ -67,6 +67,19 @@ pthread_cond_t android_cond = PTHREAD_COND_INITIALIZER;
 
 static GMainLoop     *mainloop;
 static int           connections;
+static gboolean      cull_draws = TRUE;
+
+static GOptionEntry cmd_entries[] = {
+    {
+        .long_name        = "no-cull-draws",
+        .flags            = G_OPTION_FLAG_REVERSE,
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &cull_draws,
+        .description      = N_("Draw every operation, even those hidden by later ones"),
+    },{
+        /* end of list */
+    }
+};
 
 static spice_connection *connection_new(void);
 static void connection_connect(spice_connection *conn);
@@ -89,6 +102,7 @@ static spice_window *create_spice_window(spice_connection *conn, int id)
     g_message("create window (#%d)", win->id);
 
     win->spice = (spice_display_new(conn->session, id));
+    spice_display_set_culling(win->spice, cull_draws);
     return win;
 }
 
@@ -355,6 +369,7 @@ jint Java_com_keqisoft_android_spice_socket_Connector_AndroidSpicec(JNIEnv *env,
     textdomain(GETTEXT_PACKAGE);
     /* parse opts */
     context = g_option_context_new(_("- spice client application"));
+    g_option_context_add_main_entries(context, cmd_entries, NULL);
     g_option_context_add_group(context, spice_cmdline_get_option_group());
     if (!g_option_context_parse (context, &argc, &argv, &error)) {
 	g_print (_("option parsing failed: %s\n"), error->message);
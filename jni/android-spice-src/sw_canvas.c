@@ -25,6 +25,7 @@
 #include "rect.h"
 #include "region.h"
 #include "pixman_utils.h"
+#include "canvas-bands.h"
 
 typedef struct SwCanvas SwCanvas;
 
@@ -62,7 +63,7 @@ static pixman_image_t *canvas_get_pixman_brush(SwCanvas *canvas,
             surface = surface_canvas->image;
             surface = pixman_image_ref(surface);
         } else {
-            surface = canvas_get_image(&canvas->base, brush->u.pattern.pat, FALSE);
+            surface = canvas_get_brush_image(&canvas->base, brush->u.pattern.pat);
         }
         pixman_transform_init_translate(&t,
                                         pixman_int_to_fixed(-brush->u.pattern.pos.x),
@@ -161,6 +162,154 @@ static void copy_region(SpiceCanvas *spice_canvas,
     }
 }
 
+/* A fill or blit over a list of rects, drawn in row bands by several
+ * threads when there are enough pixels */
+typedef struct SwRectsOp SwRectsOp;
+
+struct SwRectsOp {
+    pixman_image_t *dest;
+    pixman_box32_t *rects;
+    int n_rects;
+    void (*draw_rect)(SwRectsOp *op, int x, int y, int width, int height);
+    uint32_t color;
+    pixman_image_t *src;
+    int offset_x, offset_y;
+    SpiceROP rop;
+    int pixel_bytes;
+    int overall_alpha;
+};
+
+static void rects_op_band(void *opaque, int y1, int y2)
+{
+    SwRectsOp *op = opaque;
+    int i, top, bottom;
+
+    for (i = 0; i < op->n_rects; i++) {
+        top = MAX(op->rects[i].y1, y1);
+        bottom = MIN(op->rects[i].y2, y2);
+        if (top < bottom) {
+            op->draw_rect(op, op->rects[i].x1, top,
+                          op->rects[i].x2 - op->rects[i].x1, bottom - top);
+        }
+    }
+}
+
+static void rects_op_run(SwRectsOp *op)
+{
+    int i, pixels, y1, y2;
+
+    if (op->n_rects == 0) {
+        return;
+    }
+
+    pixels = 0;
+    y1 = op->rects[0].y1;
+    y2 = op->rects[0].y2;
+    for (i = 0; i < op->n_rects; i++) {
+        pixels += (op->rects[i].x2 - op->rects[i].x1) * (op->rects[i].y2 - op->rects[i].y1);
+        y1 = MIN(y1, op->rects[i].y1);
+        y2 = MAX(y2, op->rects[i].y2);
+    }
+
+    /* bands of a blit within the canvas would read rows another band
+       is writing */
+    if (canvas_bands_worth_it(pixels) &&
+        (op->src == NULL || pixman_image_get_data(op->src) != pixman_image_get_data(op->dest))) {
+        canvas_bands_run(rects_op_band, op, y1, y2);
+    } else {
+        rects_op_band(op, y1, y2);
+    }
+}
+
+static void rects_op_fill(SwRectsOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_fill_rect(op->dest, x, y, width, height, op->color);
+}
+
+static void rects_op_fill_rop(SwRectsOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_fill_rect_rop(op->dest, x, y, width, height, op->color, op->rop);
+}
+
+static void rects_op_tile(SwRectsOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_tile_rect(op->dest, x, y, width, height,
+                           op->src, op->offset_x, op->offset_y);
+}
+
+static void rects_op_tile_rop(SwRectsOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_tile_rect_rop(op->dest, x, y, width, height,
+                               op->src, op->offset_x, op->offset_y, op->rop);
+}
+
+static void rects_op_blit(SwRectsOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_blit(op->dest, op->src,
+                      x - op->offset_x, y - op->offset_y,
+                      x, y, width, height);
+}
+
+static void rects_op_blend(SwRectsOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_blend_over(op->dest, op->src,
+                            x - op->offset_x, y - op->offset_y,
+                            x, y, width, height, op->overall_alpha);
+}
+
+/* Plain row copies, for blits between images of the same depth with all
+ * rects inside the source. That is what spice_pixman_blit ends up doing
+ * as well, but its clipping and pixman_blt attempt cost more than the
+ * copy itself for the small rects most copies are made of, eg icons and
+ * text cells. */
+static void rects_op_blit_rows(SwRectsOp *op, int x, int y, int width, int height)
+{
+    int stride = pixman_image_get_stride(op->dest);
+    int src_stride = pixman_image_get_stride(op->src);
+    int byte_width = width * op->pixel_bytes;
+    uint8_t *line, *src_line;
+
+    line = (uint8_t *)pixman_image_get_data(op->dest) + y * stride + x * op->pixel_bytes;
+    src_line = (uint8_t *)pixman_image_get_data(op->src) +
+               (y - op->offset_y) * src_stride + (x - op->offset_x) * op->pixel_bytes;
+    for (; height > 0; height--) {
+        memcpy(line, src_line, byte_width);
+        line += stride;
+        src_line += src_stride;
+    }
+}
+
+static int rects_op_blit_rows_ok(SwRectsOp *op)
+{
+    int src_width, src_height, depth, i;
+
+    depth = spice_pixman_image_get_bpp(op->dest);
+    if (depth < 8 || depth != spice_pixman_image_get_bpp(op->src) ||
+        pixman_image_get_data(op->src) == pixman_image_get_data(op->dest)) {
+        return FALSE;
+    }
+
+    src_width = pixman_image_get_width(op->src);
+    src_height = pixman_image_get_height(op->src);
+    for (i = 0; i < op->n_rects; i++) {
+        if (op->rects[i].x1 - op->offset_x < 0 || op->rects[i].y1 - op->offset_y < 0 ||
+            op->rects[i].x2 - op->offset_x > src_width ||
+            op->rects[i].y2 - op->offset_y > src_height) {
+            return FALSE;
+        }
+    }
+
+    op->pixel_bytes = depth / 8;
+    return TRUE;
+}
+
+static void rects_op_blit_rop(SwRectsOp *op, int x, int y, int width, int height)
+{
+    spice_pixman_blit_rop(op->dest, op->src,
+                          x - op->offset_x, y - op->offset_y,
+                          x, y, width, height, op->rop);
+}
+
 static void fill_solid_spans(SpiceCanvas *spice_canvas,
                              SpicePoint *points,
                              int *widths,
@@ -185,15 +334,14 @@ static void fill_solid_rects(SpiceCanvas *spice_canvas,
                              uint32_t color)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
-    int i;
-
-   for (i = 0; i < n_rects; i++) {
-        spice_pixman_fill_rect(canvas->image,
-                               rects[i].x1, rects[i].y1,
-                               rects[i].x2 - rects[i].x1,
-                               rects[i].y2 - rects[i].y1,
-                               color);
-    }
+    SwRectsOp op = { 0 };
+
+    op.dest = canvas->image;
+    op.rects = rects;
+    op.n_rects = n_rects;
+    op.draw_rect = rects_op_fill;
+    op.color = color;
+    rects_op_run(&op);
 }
 
 static void fill_solid_rects_rop(SpiceCanvas *spice_canvas,
@@ -203,15 +351,15 @@ static void fill_solid_rects_rop(SpiceCanvas *spice_canvas,
                                  SpiceROP rop)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
-    int i;
-
-   for (i = 0; i < n_rects; i++) {
-        spice_pixman_fill_rect_rop(canvas->image,
-                                   rects[i].x1, rects[i].y1,
-                                   rects[i].x2 - rects[i].x1,
-                                   rects[i].y2 - rects[i].y1,
-                                   color, rop);
-    }
+    SwRectsOp op = { 0 };
+
+    op.dest = canvas->image;
+    op.rects = rects;
+    op.n_rects = n_rects;
+    op.draw_rect = rects_op_fill_rop;
+    op.color = color;
+    op.rop = rop;
+    rects_op_run(&op);
 }
 
 static void __fill_tiled_rects(SpiceCanvas *spice_canvas,
@@ -221,15 +369,16 @@ static void __fill_tiled_rects(SpiceCanvas *spice_canvas,
                                int offset_x, int offset_y)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
-    int i;
-
-    for (i = 0; i < n_rects; i++) {
-        spice_pixman_tile_rect(canvas->image,
-                               rects[i].x1, rects[i].y1,
-                               rects[i].x2 - rects[i].x1,
-                               rects[i].y2 - rects[i].y1,
-                               tile, offset_x, offset_y);
-    }
+    SwRectsOp op = { 0 };
+
+    op.dest = canvas->image;
+    op.rects = rects;
+    op.n_rects = n_rects;
+    op.draw_rect = rects_op_tile;
+    op.src = tile;
+    op.offset_x = offset_x;
+    op.offset_y = offset_y;
+    rects_op_run(&op);
 }
 
 static void fill_tiled_rects(SpiceCanvas *spice_canvas,
@@ -260,16 +409,17 @@ static void __fill_tiled_rects_rop(SpiceCanvas *spice_canvas,
                                    SpiceROP rop)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
-    int i;
-
-    for (i = 0; i < n_rects; i++) {
-        spice_pixman_tile_rect_rop(canvas->image,
-                                   rects[i].x1, rects[i].y1,
-                                   rects[i].x2 - rects[i].x1,
-                                   rects[i].y2 - rects[i].y1,
-                                   tile, offset_x, offset_y,
-                                   rop);
-    }
+    SwRectsOp op = { 0 };
+
+    op.dest = canvas->image;
+    op.rects = rects;
+    op.n_rects = n_rects;
+    op.draw_rect = rects_op_tile_rop;
+    op.src = tile;
+    op.offset_x = offset_x;
+    op.offset_y = offset_y;
+    op.rop = rop;
+    rects_op_run(&op);
 }
 static void fill_tiled_rects_rop(SpiceCanvas *spice_canvas,
                                  pixman_box32_t *rects,
@@ -344,34 +494,114 @@ static void clear_dest_alpha(pixman_image_t *dest,
     }
 }
 
-static void __blit_image(SpiceCanvas *spice_canvas,
-                         pixman_region32_t *region,
-                         pixman_image_t *src_image,
-                         int offset_x, int offset_y)
+/* A pixman composite drawn in row bands by several threads when it
+ * covers enough pixels. Compositing validates the images, writing to
+ * them, so the bands can't share them and each one wraps the same bits
+ * in images of its own. */
+typedef struct {
+    pixman_op_t op;
+    pixman_region32_t *region;
+    pixman_image_t *dest;
+    pixman_image_t *src;
+    pixman_transform_t *transform;
+    pixman_filter_t filter;
+    int overall_alpha;
+    int src_x, src_y;
+    int dest_x, dest_y;
+    int width, height;
+    int clear_alpha;
+} SwCompositeOp;
+
+static pixman_image_t *composite_op_wrap(pixman_image_t *image)
 {
-    SwCanvas *canvas = (SwCanvas *)spice_canvas;
-    pixman_box32_t *rects;
-    int n_rects, i;
+    pixman_image_t *wrap;
+
+    wrap = pixman_image_create_bits(spice_pixman_image_get_format(image),
+                                    pixman_image_get_width(image),
+                                    pixman_image_get_height(image),
+                                    pixman_image_get_data(image),
+                                    pixman_image_get_stride(image));
+    if (wrap == NULL) {
+        CANVAS_ERROR("create surface failed");
+    }
+    return wrap;
+}
 
-    rects = pixman_region32_rectangles(region, &n_rects);
+static void composite_op_band(void *opaque, int y1, int y2)
+{
+    SwCompositeOp *op = opaque;
+    pixman_box32_t *extents = pixman_region32_extents(op->region);
+    pixman_image_t *dest, *src, *mask;
+    pixman_region32_t clip;
+    int top, bottom;
+
+    pixman_region32_init_rect(&clip, extents->x1, y1, extents->x2 - extents->x1, y2 - y1);
+    pixman_region32_intersect(&clip, &clip, op->region);
+
+    dest = composite_op_wrap(op->dest);
+    pixman_image_set_clip_region32(dest, &clip);
+    src = composite_op_wrap(op->src);
+    if (op->transform) {
+        pixman_image_set_transform(src, op->transform);
+        pixman_image_set_filter(src, op->filter, NULL, 0);
+    }
 
-    for (i = 0; i < n_rects; i++) {
-        int src_x, src_y, dest_x, dest_y, width, height;
+    mask = NULL;
+    if (op->overall_alpha != 0xff) {
+        pixman_color_t color = { 0 };
+        color.alpha = op->overall_alpha * 0x101;
+        mask = pixman_image_create_solid_fill(&color);
+    }
 
-        dest_x = rects[i].x1;
-        dest_y = rects[i].y1;
-        width = rects[i].x2 - rects[i].x1;
-        height = rects[i].y2 - rects[i].y1;
+    pixman_image_composite32(op->op,
+                             src, mask, dest,
+                             op->src_x, op->src_y, /* src */
+                             0, 0, /* mask */
+                             op->dest_x, op->dest_y, /* dst */
+                             op->width, op->height);
 
-        src_x = rects[i].x1 - offset_x;
-        src_y = rects[i].y1 - offset_y;
+    top = MAX(op->dest_y, y1);
+    bottom = MIN(op->dest_y + op->height, y2);
+    if (op->clear_alpha && top < bottom) {
+        clear_dest_alpha(dest, op->dest_x, top, op->width, bottom - top);
+    }
+
+    if (mask) {
+        pixman_image_unref(mask);
+    }
+    pixman_image_unref(src);
+    pixman_image_unref(dest);
+    pixman_region32_fini(&clip);
+}
 
-        spice_pixman_blit(canvas->image,
-                          src_image,
-                          src_x, src_y,
-                          dest_x, dest_y,
-                          width, height);
+/* Returns FALSE, without drawing anything, when op isn't worth splitting */
+static int composite_op_run(SwCompositeOp *op)
+{
+    pixman_box32_t *extents = pixman_region32_extents(op->region);
+
+    if (!canvas_bands_worth_it((extents->x2 - extents->x1) * (extents->y2 - extents->y1)) ||
+        pixman_image_get_data(op->src) == pixman_image_get_data(op->dest)) {
+        return FALSE;
     }
+    canvas_bands_run(composite_op_band, op, extents->y1, extents->y2);
+    return TRUE;
+}
+
+static void __blit_image(SpiceCanvas *spice_canvas,
+                         pixman_region32_t *region,
+                         pixman_image_t *src_image,
+                         int offset_x, int offset_y)
+{
+    SwCanvas *canvas = (SwCanvas *)spice_canvas;
+    SwRectsOp op = { 0 };
+
+    op.dest = canvas->image;
+    op.rects = pixman_region32_rectangles(region, &op.n_rects);
+    op.src = src_image;
+    op.offset_x = offset_x;
+    op.offset_y = offset_y;
+    op.draw_rect = rects_op_blit_rows_ok(&op) ? rects_op_blit_rows : rects_op_blit;
+    rects_op_run(&op);
 }
 
 static void blit_image(SpiceCanvas *spice_canvas,
@@ -398,28 +628,16 @@ static void __blit_image_rop(SpiceCanvas *spice_canvas,
                              SpiceROP rop)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
-    pixman_box32_t *rects;
-    int n_rects, i;
-
-    rects = pixman_region32_rectangles(region, &n_rects);
-
-    for (i = 0; i < n_rects; i++) {
-        int src_x, src_y, dest_x, dest_y, width, height;
-
-        dest_x = rects[i].x1;
-        dest_y = rects[i].y1;
-        width = rects[i].x2 - rects[i].x1;
-        height = rects[i].y2 - rects[i].y1;
-
-        src_x = rects[i].x1 - offset_x;
-        src_y = rects[i].y1 - offset_y;
-
-        spice_pixman_blit_rop(canvas->image,
-                              src_image,
-                              src_x, src_y,
-                              dest_x, dest_y,
-                              width, height, rop);
-    }
+    SwRectsOp op = { 0 };
+
+    op.dest = canvas->image;
+    op.rects = pixman_region32_rectangles(region, &op.n_rects);
+    op.draw_rect = rects_op_blit_rop;
+    op.src = src_image;
+    op.offset_x = offset_x;
+    op.offset_y = offset_y;
+    op.rop = rop;
+    rects_op_run(&op);
 }
 
 static void blit_image_rop(SpiceCanvas *spice_canvas,
@@ -453,19 +671,36 @@ static void __scale_image(SpiceCanvas *spice_canvas,
                           int scale_mode)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
+    SwCompositeOp op = { 0 };
     pixman_transform_t transform;
     pixman_fixed_t fsx, fsy;
 
     fsx = ((pixman_fixed_48_16_t) src_width * 65536) / dest_width;
     fsy = ((pixman_fixed_48_16_t) src_height * 65536) / dest_height;
 
-    pixman_image_set_clip_region32(canvas->image, region);
-
     pixman_transform_init_scale(&transform, fsx, fsy);
     pixman_transform_translate(&transform, NULL,
 			       pixman_int_to_fixed (src_x),
 			       pixman_int_to_fixed (src_y));
 
+    op.op = PIXMAN_OP_SRC;
+    op.region = region;
+    op.dest = canvas->image;
+    op.src = src;
+    op.transform = &transform;
+    op.filter = (scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST) ?
+                PIXMAN_FILTER_NEAREST : PIXMAN_FILTER_GOOD;
+    op.overall_alpha = 0xff;
+    op.dest_x = dest_x;
+    op.dest_y = dest_y;
+    op.width = dest_width;
+    op.height = dest_height;
+    if (composite_op_run(&op)) {
+        return;
+    }
+
+    pixman_image_set_clip_region32(canvas->image, region);
+
     pixman_image_set_transform(src, &transform);
     pixman_image_set_repeat(src, PIXMAN_REPEAT_NONE);
     ASSERT(scale_mode == SPICE_IMAGE_SCALE_MODE_INTERPOLATE ||
@@ -625,6 +860,8 @@ static pixman_image_t *canvas_get_as_surface(SwCanvas *canvas,
                                           pixman_image_get_height(canvas->image),
                                           pixman_image_get_data(canvas->image),
                                           pixman_image_get_stride(canvas->image));
+        /* banded composites wrap the image again in its own format */
+        spice_pixman_image_set_format(target, PIXMAN_a8r8g8b8);
     } else {
         target = pixman_image_ref(canvas->image);
     }
@@ -642,10 +879,43 @@ static void __blend_image(SpiceCanvas *spice_canvas,
                           int overall_alpha)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
+    SwCompositeOp op = { 0 };
+    SwRectsOp rects_op = { 0 };
     pixman_image_t *mask, *dest;
 
     dest = canvas_get_as_surface(canvas, dest_has_alpha);
 
+    /* our own kernel leaves the alpha of an xRGB dest cleared already */
+    if (spice_pixman_blend_over_supported(dest, src)) {
+        rects_op.dest = dest;
+        rects_op.rects = pixman_region32_rectangles(region, &rects_op.n_rects);
+        rects_op.draw_rect = rects_op_blend;
+        rects_op.src = src;
+        rects_op.offset_x = dest_x - src_x;
+        rects_op.offset_y = dest_y - src_y;
+        rects_op.overall_alpha = overall_alpha;
+        rects_op_run(&rects_op);
+        pixman_image_unref(dest);
+        return;
+    }
+
+    op.op = PIXMAN_OP_OVER;
+    op.region = region;
+    op.dest = dest;
+    op.src = src;
+    op.overall_alpha = overall_alpha;
+    op.src_x = src_x;
+    op.src_y = src_y;
+    op.dest_x = dest_x;
+    op.dest_y = dest_y;
+    op.width = width;
+    op.height = height;
+    op.clear_alpha = canvas->base.format == SPICE_SURFACE_FMT_32_xRGB && !dest_has_alpha;
+    if (composite_op_run(&op)) {
+        pixman_image_unref(dest);
+        return;
+    }
+
     pixman_image_set_clip_region32(dest, region);
 
     mask = NULL;
@@ -725,6 +995,7 @@ static void __blend_scale_image(SpiceCanvas *spice_canvas,
                                 int overall_alpha)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
+    SwCompositeOp op = { 0 };
     pixman_transform_t transform;
     pixman_image_t *mask, *dest;
     pixman_fixed_t fsx, fsy;
@@ -734,13 +1005,31 @@ static void __blend_scale_image(SpiceCanvas *spice_canvas,
 
     dest = canvas_get_as_surface(canvas, dest_has_alpha);
 
-    pixman_image_set_clip_region32(dest, region);
-
     pixman_transform_init_scale(&transform, fsx, fsy);
     pixman_transform_translate(&transform, NULL,
 			       pixman_int_to_fixed (src_x),
 			       pixman_int_to_fixed (src_y));
 
+    op.op = PIXMAN_OP_OVER;
+    op.region = region;
+    op.dest = dest;
+    op.src = src;
+    op.transform = &transform;
+    op.filter = (scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST) ?
+                PIXMAN_FILTER_NEAREST : PIXMAN_FILTER_GOOD;
+    op.overall_alpha = overall_alpha;
+    op.dest_x = dest_x;
+    op.dest_y = dest_y;
+    op.width = dest_width;
+    op.height = dest_height;
+    op.clear_alpha = canvas->base.format == SPICE_SURFACE_FMT_32_xRGB && !dest_has_alpha;
+    if (composite_op_run(&op)) {
+        pixman_image_unref(dest);
+        return;
+    }
+
+    pixman_image_set_clip_region32(dest, region);
+
     mask = NULL;
     if (overall_alpha != 0xff) {
         pixman_color_t color = { 0 };
@@ -1161,6 +1450,7 @@ static void canvas_destroy(SpiceCanvas *spice_canvas)
         free(canvas->private_data);
     }
     free(canvas);
+    canvas_bands_unref();
 }
 
 static int need_init = 1;
@@ -1209,6 +1499,7 @@ static SpiceCanvas *canvas_create_common(pixman_image_t *image,
     canvas->private_data_size = 0;
 
     canvas->image = image;
+    canvas_bands_ref();
 
     return (SpiceCanvas *)canvas;
 }
@@ -1318,4 +1609,6 @@ void sw_canvas_init() //unsafe global function
     sw_canvas_ops.copy_region = copy_region;
     sw_canvas_ops.get_image = get_image;
     rop3_init();
+    spice_pixman_rop_init();
+    canvas_bands_init();
 }
@@ -157,6 +157,7 @@ public class SpiceCanvasActivity extends Activity {
 			scaling = 2;
 		    }
 		    canvas.zoom(scaling);
+		    inputSender.sendViewScale(scaling);
 		    return true;
 		case R.id.zoomout:
 		    scaling -= 0.25;
@@ -165,6 +166,7 @@ public class SpiceCanvasActivity extends Activity {
 		    } else {
 		    }
 		    canvas.zoom(scaling);
+		    inputSender.sendViewScale(scaling);
 		    return true;
 		case R.id.exit:
 		    inputSender.sendOverMsg();
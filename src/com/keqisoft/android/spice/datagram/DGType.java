@@ -8,4 +8,5 @@ public class DGType {
 	public static final int ANDROID_BUTTON_PRESS = 3;
 	public static final int ANDROID_BUTTON_RELEASE = 4;
 	public static final int ANDROID_SHOW = 5;
+	public static final int ANDROID_VIEW_SCALE = 6;
 }
\ No newline at end of file
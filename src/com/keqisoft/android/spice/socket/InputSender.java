@@ -52,6 +52,22 @@ public class InputSender {
 		}
 	}
 
+	public void sendViewScale(float scaling) {
+		if (!sockHandler.isConnected()) {
+			if (!sockHandler.connect()) {
+				return;
+			}
+		}
+		try {
+			DataOutputStream out = sockHandler.getOut();
+			out.writeInt(DGType.ANDROID_VIEW_SCALE);
+			out.writeInt((int) (scaling * 1000));
+		} catch (IOException e) {
+			e.printStackTrace();
+			sockHandler.close();
+		}
+	}
+
 	public void sendOverMsg() {
 		if (!sockHandler.isConnected()) {
 			if (!sockHandler.connect()) {